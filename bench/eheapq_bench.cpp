@@ -0,0 +1,287 @@
+/*
+ * eheapq_bench - Microbenchmark of operations of the extended heap queue.
+ * Copyright(C) 2020 Fridolin Pokorny
+ *
+ * This program is free software: you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Each operation is run on a heap holding `size' items, for sizes from 1e2
+ * up to max_size (powers of 10), item types and key distributions. Push, pop
+ * and remove are run at most `size' times so that the heap size stays within
+ * [size, 2 * size]:
+ *
+ *   u64          - integer items compared directly
+ *   ptr          - pointers to objects holding a double key (as used by ExtHeapQueue)
+ *   compact      - EHeapQCompact entries of a double key and an integer item
+ *
+ *   random       - keys in a pseudo-random order
+ *   sorted       - increasing keys, pushed items stay in leaves
+ *   adversarial  - decreasing keys, pushed items sift up to the root
+ *
+ * An operation is run twice on the same state - the first run measures the
+ * mean time per operation, the second one timestamps each operation for
+ * latency percentiles (clock overhead included). Results are printed as JSON
+ * lines, one line per item type, key distribution, size and operation:
+ *
+ *   eheapq_bench [max_size] [ops] [filter]
+ *
+ * Only lines with the item type, key distribution or operation equal to
+ * filter are run if given. If compiled with EHEAPQ_STATS (make bench-stats),
+ * comparisons and index updates per operation of the first run are reported
+ * too.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "eheapq.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * An object compared by its key, stored by pointer.
+ */
+struct BenchObject {
+  double key;
+};
+
+struct BenchObjectCompare {
+  bool operator()(const BenchObject *a, const BenchObject *b) const { return a->key < b->key; }
+};
+
+/**
+ * Item types benchmarked - a heap type and a way to make a new item for the given key.
+ */
+struct U64Items {
+  typedef uint64_t Item;
+  typedef EHeapQ<uint64_t> Heap;
+  static const char *name() { return "u64"; }
+  Item make(uint64_t key) { return key; }
+};
+
+struct PtrItems {
+  typedef BenchObject *Item;
+  typedef EHeapQ<BenchObject *, BenchObjectCompare> Heap;
+  static const char *name() { return "ptr"; }
+
+  std::deque<BenchObject> objects;  /**< Items are never freed during a run, pointers stay unique. */
+
+  Item make(uint64_t key) {
+    this->objects.push_back(BenchObject{(double)key});
+    return &this->objects.back();
+  }
+};
+
+struct CompactItems {
+  typedef EHeapQEntry<double, uint64_t> Item;
+  typedef EHeapQCompact<double, uint64_t> Heap;
+  static const char *name() { return "compact"; }
+
+  uint64_t next = 0;
+
+  Item make(uint64_t key) {
+    Item item;
+    item.key = (double)key;
+    item.item = this->next++;
+    return item;
+  }
+};
+
+/**
+ * Key distributions - the i-th key generated, all keys are unique.
+ */
+enum Distribution { RANDOM, SORTED, ADVERSARIAL };
+
+static const char *distribution_names[] = {"random", "sorted", "adversarial"};
+
+static uint64_t make_key(Distribution distribution, uint64_t i) {
+  switch (distribution) {
+  case RANDOM:
+    // The splitmix64 finalizer is a bijection, keys are not correlated with hashes of items.
+    i = (i ^ (i >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    i = (i ^ (i >> 27)) * 0x94D049BB133111EBULL;
+    return (i ^ (i >> 31)) >> 11;  // Fits into a double exactly.
+  case SORTED:
+    return i;
+  default:
+    return (1ULL << 53) - i;
+  }
+}
+
+/**
+ * Latencies of single operations, in nanoseconds.
+ */
+class Samples {
+public:
+  void add(Clock::time_point start, Clock::time_point end) {
+    this->values.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+  }
+
+  uint64_t percentile(double p) {
+    if (this->values.empty())
+      return 0;
+
+    size_t idx = std::min(this->values.size() - 1, (size_t)(p * this->values.size()));
+    std::nth_element(this->values.begin(), this->values.begin() + idx, this->values.end());
+    return this->values[idx];
+  }
+
+private:
+  std::vector<uint64_t> values;
+};
+
+template <class Items> class Bench {
+public:
+  typedef typename Items::Item Item;
+  typedef typename Items::Heap Heap;
+
+  Bench(Distribution distribution, size_t size, size_t ops, const char *filter)
+      : distribution(distribution), size(size), ops(ops), filter(filter) {}
+
+  void run() {
+    Heap heap;
+    std::vector<Item> batch;
+
+    // Memory is preallocated so that runs do not measure reallocations of the heap vector and rehashing.
+    heap.reserve(this->size * 2);
+    for (size_t i = 0; i < this->size; i++)
+      batch.push_back(this->make());
+    heap.push_many(batch.begin(), batch.end());
+
+    // Push and pop alternate so that the heap is back at its size after each run, it holds at most twice as many items.
+    size_t n = std::min(this->ops, this->size);
+    this->measure(heap, "push", n, [&](Heap &h) { h.push(this->make()); }, NULL, [&](Heap &h) {
+      for (size_t i = 0; i < n; i++)
+        h.pop();
+    });
+    this->measure(heap, "pop", n, [&](Heap &h) { h.pop(); }, [&](Heap &h) {
+      for (size_t i = 0; i < n; i++)
+        h.push(this->make());
+    });
+    this->measure(heap, "pushpop", this->ops, [&](Heap &h) { h.pushpop(this->make()); });
+    this->measure(heap, "replace", this->ops, [&](Heap &h) { h.replace(this->make()); });
+
+    // Items removed are chosen at random positions before the run, new items are pushed after it.
+    std::vector<Item> removed;
+    this->measure(heap, "remove", n, [&](Heap &h) {
+      h.remove(removed.back());
+      removed.pop_back();
+    }, [&](Heap &h) { this->pick(h, n, removed); }, [&](Heap &h) {
+      for (size_t i = 0; i < n; i++)
+        h.push(this->make());
+    });
+
+    // The peak is computed by a scan of leaves, hence the number of calls is limited for large heaps.
+    size_t peaks = std::max((size_t)10, std::min(this->ops, this->ops * 100 / this->size));
+    this->measure(heap, "get_peak", peaks, [&](Heap &h) { h.get_peak(); });
+  }
+
+private:
+  Items items;
+  Distribution distribution;
+  size_t size;
+  size_t ops;
+  const char *filter;
+  uint64_t next_key = 0;
+  std::mt19937_64 rng;
+
+  Item make() { return this->items.make(make_key(this->distribution, this->next_key++)); }
+
+  void pick(Heap &heap, size_t n, std::vector<Item> &result) {
+    std::vector<Item> all(heap.begin(), heap.end());
+
+    result.clear();
+    for (size_t i = 0; i < n; i++) {
+      std::swap(all[i], all[i + this->rng() % (all.size() - i)]);
+      result.push_back(all[i]);
+    }
+  }
+
+  /**
+   * Run the given operation n times for the mean and n times for percentiles, setup
+   * and teardown (if given) are called before and after each run, not measured.
+   */
+  template <class Op>
+  void measure(Heap &heap, const char *name, size_t n, Op op, std::function<void(Heap &)> setup = NULL,
+               std::function<void(Heap &)> teardown = NULL) {
+    Samples samples;
+    double elapsed;
+
+    if (this->filter && strcmp(this->filter, name) != 0 && strcmp(this->filter, Items::name()) != 0 &&
+        strcmp(this->filter, distribution_names[this->distribution]) != 0)
+      return;
+
+    if (setup)
+      setup(heap);
+
+#ifdef EHEAPQ_STATS
+    heap.reset_stats();
+#endif
+    auto start = Clock::now();
+    for (size_t i = 0; i < n; i++)
+      op(heap);
+    elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+#ifdef EHEAPQ_STATS
+    EHeapQStats stats = heap.get_stats();
+#endif
+
+    if (teardown)
+      teardown(heap);
+    if (setup)
+      setup(heap);
+
+    for (size_t i = 0; i < n; i++) {
+      auto op_start = Clock::now();
+      op(heap);
+      samples.add(op_start, Clock::now());
+    }
+
+    if (teardown)
+      teardown(heap);
+
+    printf("{\"item\": \"%s\", \"keys\": \"%s\", \"size\": %zu, \"op\": \"%s\", \"ops\": %zu, "
+           "\"ns_per_op\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu",
+           Items::name(), distribution_names[this->distribution], this->size, name, n, elapsed / n,
+           (unsigned long long)samples.percentile(0.5), (unsigned long long)samples.percentile(0.99));
+#ifdef EHEAPQ_STATS
+    printf(", \"comparisons_per_op\": %.2f, \"index_updates_per_op\": %.2f", (double)stats.comparisons / n,
+           (double)stats.index_updates / n);
+#endif
+    printf("}\n");
+    fflush(stdout);
+  }
+};
+
+int main(int argc, char *argv[]) {
+  size_t max_size = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+  size_t ops = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;
+  const char *filter = argc > 3 ? argv[3] : NULL;
+
+  for (size_t size = 100; size <= max_size; size *= 10) {
+    for (int d = RANDOM; d <= ADVERSARIAL; d++) {
+      Bench<U64Items>((Distribution)d, size, ops, filter).run();
+      Bench<PtrItems>((Distribution)d, size, ops, filter).run();
+      Bench<CompactItems>((Distribution)d, size, ops, filter).run();
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * eheapq_replay - Replay of traces of heap queue operations.
+ * Copyright(C) 2020 Fridolin Pokorny
+ *
+ * This program is free software: you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Operations recorded in a trace (see etrace.hpp and ExtHeapQueue.start_trace)
+ * are replayed on EHeapQ storing item ids, keys are compared the same way as
+ * ExtHeapQueue compares them. The trace is loaded into memory first, only the
+ * replay is timed. Items returned by pop and get_max are checked against the
+ * ones recorded. The result is printed as a JSON line:
+ *
+ *   eheapq_replay trace [repeat]
+ *
+ * The exit code is non-zero if the replay diverged from the trace.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <unordered_map>
+#include <vector>
+
+#include "eheapq.hpp"
+#include "etrace.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * Keys of items replayed, item ids are mapped to offsets into a flat array of key components.
+ */
+struct ReplayKeys {
+  size_t key_width;
+  std::unordered_map<uint64_t, size_t> offsets;
+  std::vector<double> values;
+
+  void set(uint64_t item, const std::vector<double> &key) {
+    auto it = this->offsets.find(item);
+
+    if (it == this->offsets.end()) {
+      this->offsets[item] = this->values.size();
+      this->values.insert(this->values.end(), key.begin(), key.end());
+    } else {
+      std::copy(key.begin(), key.end(), this->values.begin() + it->second);
+    }
+  }
+
+  const double *get(uint64_t item) const { return this->values.data() + this->offsets.at(item); }
+};
+
+struct ReplayCompare {
+  ReplayKeys *keys = NULL;
+
+  bool operator()(uint64_t a, uint64_t b) const {
+    const double *a_key = this->keys->get(a);
+    const double *b_key = this->keys->get(b);
+
+    // Composite keys are compared lexicographically.
+    for (size_t i = 0; i < this->keys->key_width; i++) {
+      if (a_key[i] != b_key[i])
+        return a_key[i] < b_key[i];
+    }
+
+    return false;
+  }
+};
+
+typedef EHeapQ<uint64_t, ReplayCompare> ReplayHeap;
+
+static const char *op_names[] = {NULL, "push", "pop", "pushpop", "remove", "replace", "get_max", "clear"};
+
+/**
+ * Replay the given records on a new heap.
+ *
+ * @result Number of items returned that do not match the trace.
+ */
+static size_t replay(const std::vector<EHeapQTraceRecord> &records, size_t key_width, size_t size) {
+  ReplayKeys keys;
+  ReplayHeap heap(size);
+  size_t mismatches = 0;
+
+  keys.key_width = key_width;
+  heap.comp.keys = &keys;
+
+  for (const EHeapQTraceRecord &record : records) {
+    try {
+      switch (record.op) {
+      case EHEAPQ_TRACE_PUSH:
+        keys.set(record.item, record.key);
+        heap.push(record.item);
+        break;
+      case EHEAPQ_TRACE_POP:
+        mismatches += heap.pop() != record.item;
+        break;
+      case EHEAPQ_TRACE_PUSHPOP:
+        keys.set(record.item, record.key);
+        heap.pushpop(record.item);
+        break;
+      case EHEAPQ_TRACE_REMOVE:
+        heap.remove(record.item);
+        break;
+      case EHEAPQ_TRACE_REPLACE:
+        keys.set(record.item, record.key);
+        heap.replace(record.item);
+        break;
+      case EHEAPQ_TRACE_GET_MAX:
+        mismatches += heap.get_peak() != record.item;
+        break;
+      case EHEAPQ_TRACE_CLEAR:
+        heap.clear();
+        break;
+      }
+    } catch (EHeapQException &exc) {
+      // The heap diverged from the one traced, e.g. an item recorded as stored is not present.
+      mismatches++;
+    }
+  }
+
+  return mismatches;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<EHeapQTraceRecord> records;
+  size_t counts[EHEAPQ_TRACE_CLEAR + 1] = {0};
+  size_t key_width, size, mismatches = 0;
+  size_t repeat = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s trace [repeat]\n", argv[0]);
+    return 2;
+  }
+
+  try {
+    EHeapQTraceReader reader(argv[1]);
+    EHeapQTraceRecord record;
+
+    key_width = reader.get_key_width();
+    size = reader.get_size();
+    while (reader.next(record)) {
+      counts[record.op]++;
+      records.push_back(record);
+    }
+  } catch (EHeapQTraceError &exc) {
+    fprintf(stderr, "%s: %s\n", argv[1], exc.what());
+    return 2;
+  }
+
+  auto start = Clock::now();
+  for (size_t i = 0; i < repeat; i++)
+    mismatches += replay(records, key_width, size);
+  double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+  printf("{\"trace\": \"%s\", \"size\": %zu, \"key_width\": %zu, \"records\": %zu, ", argv[1], size, key_width,
+         records.size());
+  for (int op = EHEAPQ_TRACE_PUSH; op <= EHEAPQ_TRACE_CLEAR; op++)
+    printf("\"%s\": %zu, ", op_names[op], counts[op]);
+  printf("\"repeat\": %zu, \"ns_per_op\": %.1f, \"mismatches\": %zu}\n", repeat,
+         records.empty() ? 0.0 : elapsed / (records.size() * repeat), mismatches);
+
+  return mismatches != 0;
+}
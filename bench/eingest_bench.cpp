@@ -0,0 +1,156 @@
+/*
+ * eingest_bench - Benchmark of the batched ingestion buffer for eheapq.
+ * Copyright(C) 2020 Fridolin Pokorny
+ *
+ * This program is free software: you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Producer threads push items while a single consumer pops them until all
+ * the items are consumed. The ingestion buffer (EHeapQIngest), pushed to
+ * item by item and through per-thread producer handles, is compared to a
+ * single EHeapQ guarded by a global lock. Results are printed as JSON
+ * lines, one line per queue and number of producers:
+ *
+ *   eingest_bench [max_producers] [items_per_producer]
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "eheapq.hpp"
+#include "eingest.hpp"
+
+/**
+ * Keys are derived from item values so that the benchmark does not need any key storage.
+ */
+struct KeyCompare {
+  bool operator()(uint64_t a, uint64_t b) const {
+    return (a * 0x9E3779B97F4A7C15ULL) < (b * 0x9E3779B97F4A7C15ULL);
+  }
+};
+
+/**
+ * A single heap queue guarded by a global lock - the baseline.
+ */
+class LockedQueue {
+public:
+  void produce(uint64_t next, size_t items) {
+    for (size_t i = 0; i < items; i++) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->heap.push(next++);
+    }
+  }
+
+  bool try_pop(uint64_t &item) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->heap.get_length() == 0)
+      return false;
+
+    item = this->heap.pop();
+    return true;
+  }
+
+private:
+  std::mutex lock;
+  EHeapQ<uint64_t, KeyCompare> heap;
+};
+
+/**
+ * The ingestion buffer, popping is done by the consumer thread only.
+ */
+class IngestQueue {
+public:
+  void produce(uint64_t next, size_t items) {
+    for (size_t i = 0; i < items; i++)
+      this->queue.push(next++);
+  }
+
+  bool try_pop(uint64_t &item) {
+    if (this->queue.get_length() == 0)
+      return false;
+
+    item = this->queue.pop();
+    return true;
+  }
+
+protected:
+  EHeapQIngest<uint64_t, KeyCompare> queue;
+};
+
+/**
+ * The ingestion buffer pushed to through a producer handle per thread, items are published in blocks.
+ */
+class IngestProducerQueue : public IngestQueue {
+public:
+  void produce(uint64_t next, size_t items) {
+    EHeapQIngest<uint64_t, KeyCompare>::Producer producer(this->queue);
+
+    for (size_t i = 0; i < items; i++)
+      producer.push(next++);
+  }
+};
+
+template <class Queue> double run(size_t producers, size_t items) {
+  Queue queue;
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+
+  for (size_t t = 0; t < producers; t++) {
+    workers.push_back(std::thread([&queue, t, items]() {
+      queue.produce(((uint64_t)t + 1) << 40, items);
+    }));
+  }
+
+  size_t consumed = 0;
+  uint64_t item;
+  while (consumed < producers * items) {
+    if (queue.try_pop(item))
+      consumed++;
+    else
+      std::this_thread::yield();
+  }
+
+  for (auto &worker : workers)
+    worker.join();
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return (producers * items) / elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  size_t max_producers = argc > 1 ? strtoul(argv[1], NULL, 10) : std::thread::hardware_concurrency();
+  size_t items = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+  if (max_producers == 0)
+    max_producers = 1;
+
+  for (size_t producers = 1; producers <= max_producers; producers *= 2) {
+    printf("{\"queue\": \"locked_eheapq\", \"producers\": %zu, \"items\": %zu, \"items_per_sec\": %.0f}\n",
+           producers, producers * items, run<LockedQueue>(producers, items));
+    printf("{\"queue\": \"eheapq_ingest\", \"producers\": %zu, \"items\": %zu, \"items_per_sec\": %.0f}\n",
+           producers, producers * items, run<IngestQueue>(producers, items));
+    printf("{\"queue\": \"eheapq_ingest_producer\", \"producers\": %zu, \"items\": %zu, \"items_per_sec\": %.0f}\n",
+           producers, producers * items, run<IngestProducerQueue>(producers, items));
+
+    if (producers < max_producers && producers * 2 > max_producers)
+      producers = max_producers / 2;
+  }
+
+  return 0;
+}
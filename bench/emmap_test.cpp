@@ -0,0 +1,228 @@
+/*
+ * emmap_test - Tests of the heap queue stored in a memory-mapped file.
+ * Copyright(C) 2020 Fridolin Pokorny
+ *
+ * This program is free software: you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * A heap file is created in a temporary directory, filled, checkpointed and
+ * reopened. A child process modifies the heap and exits without a checkpoint,
+ * the parent checks the file still holds the last checkpoint. Files with a
+ * bad header, a different item size or capacity are rejected. The program
+ * exits with a non-zero status on the first failed check:
+ *
+ *   emmap_test
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "eheapq.hpp"
+#include "emmap.hpp"
+
+#define CHECK(condition)                                                          \
+  do {                                                                            \
+    checks++;                                                                     \
+    if (!(condition)) {                                                           \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      exit(1);                                                                    \
+    }                                                                             \
+  } while (0)
+
+const size_t CAPACITY = 1000;
+
+static size_t checks = 0;
+
+typedef EHeapQMmap<uint64_t> MmapHeap;
+
+/**
+ * Pop all the items, the heap is left empty.
+ */
+static std::vector<uint64_t> drain(MmapHeap &heap) {
+  std::vector<uint64_t> result;
+
+  while (heap.get_length() > 0)
+    result.push_back(heap.pop());
+
+  return result;
+}
+
+/**
+ * Check opening the heap file with the given parameters is rejected with a message containing the given text.
+ */
+template <class T> static void check_rejected(const std::string &path, size_t capacity, const char *message) {
+  try {
+    EHeapQMmap<T> heap(path.c_str(), capacity);
+    CHECK(!"heap file not rejected");
+  } catch (EHeapQMmapError &exc) {
+    CHECK(strstr(exc.what(), message) != NULL);
+  }
+}
+
+static void test_create(const std::string &path) {
+  MmapHeap heap(path.c_str(), CAPACITY);
+
+  CHECK(heap.get_length() == 0);
+  CHECK(heap.get_size() == CAPACITY);
+  CHECK(heap.get_generation() == 1);
+
+  try {
+    heap.pop();
+    CHECK(!"pop from an empty heap");
+  } catch (EHeapQEmpty &exc) {
+  }
+}
+
+static void test_push_pop(const std::string &path) {
+  MmapHeap heap(path.c_str(), CAPACITY);
+
+  for (uint64_t i = 0; i < CAPACITY; i++)
+    heap.push((i * 7919) % CAPACITY);
+
+  CHECK(heap.get_length() == CAPACITY);
+  CHECK(heap.get_top() == 0);
+  CHECK(heap.pop() == 0);
+  CHECK(heap.pop() == 1);
+
+  heap.remove(500);
+  CHECK(heap.pushpop(0) == 0);
+  CHECK(heap.replace(1) == 2);
+  CHECK(heap.get_length() == CAPACITY - 3);
+
+  // Items over the capacity push the smallest out.
+  std::vector<uint64_t> removed;
+  heap.push(5000);
+  heap.push(5001);
+  heap.push(5002);
+  CHECK(heap.get_length() == CAPACITY);
+  heap.push(5003, [&removed](uint64_t item) { removed.push_back(item); });
+  CHECK(heap.get_length() == CAPACITY);
+  CHECK(removed.size() == 1 && removed[0] == 1);
+  CHECK(heap.get_top() == 3);
+
+  // Creating the file and closing it in test_create made the first two checkpoints.
+  heap.checkpoint();
+  CHECK(heap.get_generation() == 3);
+}
+
+static void test_reopen(const std::string &path) {
+  {
+    MmapHeap heap(path.c_str(), CAPACITY);
+
+    CHECK(heap.get_length() == CAPACITY);
+    CHECK(heap.get_top() == 3);
+
+    // The index is persisted, items are found without a rebuild.
+    heap.remove(999);
+    heap.push(999);
+    CHECK(heap.get_length() == CAPACITY);
+
+    for (int i = 0; i < 100; i++)
+      heap.pop();
+  }
+
+  // Destruction checkpoints the heap.
+  MmapHeap heap(path.c_str(), CAPACITY);
+  std::vector<uint64_t> items = drain(heap);
+
+  CHECK(heap.get_generation() == 5);
+  CHECK(items.size() == CAPACITY - 100);
+  CHECK(items.front() == 103);
+  CHECK(items.back() == 5003);
+  for (size_t i = 1; i < items.size(); i++)
+    CHECK(items[i - 1] < items[i]);
+
+  for (uint64_t i = 0; i < 10; i++)
+    heap.push(i);
+}
+
+static void test_child_exit(const std::string &path) {
+  pid_t pid = fork();
+
+  CHECK(pid >= 0);
+  if (pid == 0) {
+    // Changes are never checkpointed, the destructor does not run on _exit.
+    MmapHeap *heap = new MmapHeap(path.c_str(), CAPACITY);
+
+    heap->pop();
+    heap->remove(5);
+    for (uint64_t i = 100; i < 200; i++)
+      heap->push(i);
+
+    heap->clear();
+    heap->push(42);
+    _exit(heap->get_length() == 1 ? 0 : 1);
+  }
+
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  MmapHeap heap(path.c_str(), CAPACITY);
+  CHECK(heap.get_generation() == 6);
+  CHECK(heap.get_length() == 10);
+
+  std::vector<uint64_t> items = drain(heap);
+  for (uint64_t i = 0; i < 10; i++)
+    CHECK(items[i] == i);
+}
+
+static void test_reject(const std::string &dir, const std::string &path) {
+  std::string bad_path = dir + "/bad.heap";
+  std::vector<char> garbage(1 << 20, 'x');
+  FILE *bad_file = fopen(bad_path.c_str(), "wb");
+
+  CHECK(bad_file != NULL);
+  CHECK(fwrite(garbage.data(), 1, garbage.size(), bad_file) == garbage.size());
+  CHECK(fclose(bad_file) == 0);
+
+  check_rejected<uint64_t>(bad_path, 10, "not a heap file");
+  check_rejected<uint32_t>(path, CAPACITY, "different item size or capacity");
+  check_rejected<uint64_t>(path, CAPACITY / 2, "different item size or capacity");
+  check_rejected<uint64_t>(path, CAPACITY * 10, "truncated");
+  check_rejected<uint64_t>(path, 0, "capacity of a heap file");
+
+  // The heap file is left intact.
+  MmapHeap heap(path.c_str(), CAPACITY);
+  CHECK(heap.get_length() == 0);
+
+  unlink(bad_path.c_str());
+}
+
+int main(int argc, char *argv[]) {
+  char dir_template[] = "/tmp/emmap_test.XXXXXX";
+  const char *dir = mkdtemp(dir_template);
+
+  CHECK(dir != NULL);
+  std::string path = std::string(dir) + "/test.heap";
+
+  test_create(path);
+  test_push_pop(path);
+  test_reopen(path);
+  test_child_exit(path);
+  test_reject(dir, path);
+
+  unlink(path.c_str());
+  rmdir(dir);
+
+  printf("emmap_test: %zu checks passed\n", checks);
+  return 0;
+}
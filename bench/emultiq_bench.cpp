@@ -0,0 +1,127 @@
+/*
+ * emultiq_bench - Throughput benchmark of the relaxed concurrent heap queue.
+ * Copyright(C) 2020 Fridolin Pokorny
+ *
+ * This program is free software: you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Each thread performs a mix of push and pop operations on a shared queue
+ * prefilled with items. The MultiQueue (EMultiQ) is compared to a single
+ * EHeapQ guarded by a global lock. Results are printed as JSON lines, one
+ * line per queue and number of threads:
+ *
+ *   emultiq_bench [max_threads] [ops_per_thread] [prefill]
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "eheapq.hpp"
+#include "emultiq.hpp"
+
+/**
+ * Keys are derived from item values so that the benchmark does not need any key storage.
+ */
+struct KeyCompare {
+  bool operator()(uint64_t a, uint64_t b) const {
+    return (a * 0x9E3779B97F4A7C15ULL) < (b * 0x9E3779B97F4A7C15ULL);
+  }
+};
+
+/**
+ * A single heap queue guarded by a global lock - the baseline.
+ */
+class LockedQueue {
+public:
+  void push(uint64_t item) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->heap.push(item);
+  }
+
+  bool try_pop(uint64_t &item) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->heap.get_length() == 0)
+      return false;
+
+    item = this->heap.pop();
+    return true;
+  }
+
+private:
+  std::mutex lock;
+  EHeapQ<uint64_t, KeyCompare> heap;
+};
+
+template <class Queue> double run(Queue &queue, size_t threads, size_t ops, size_t prefill) {
+  for (uint64_t i = 0; i < prefill; i++)
+    queue.push(i);
+
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+
+  for (size_t t = 0; t < threads; t++) {
+    workers.push_back(std::thread([&queue, t, ops]() {
+      uint64_t next = ((uint64_t)t + 1) << 40;
+      uint64_t item;
+
+      for (size_t i = 0; i < ops; i++) {
+        if (i & 1)
+          queue.try_pop(item);
+        else
+          queue.push(next++);
+      }
+    }));
+  }
+
+  for (auto &worker : workers)
+    worker.join();
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return (threads * ops) / elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  size_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : std::thread::hardware_concurrency();
+  size_t ops = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+  size_t prefill = argc > 3 ? strtoul(argv[3], NULL, 10) : 100000;
+
+  if (max_threads == 0)
+    max_threads = 1;
+
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    {
+      LockedQueue queue;
+      double throughput = run(queue, threads, ops, prefill);
+      printf("{\"queue\": \"locked_eheapq\", \"threads\": %zu, \"ops\": %zu, \"ops_per_sec\": %.0f}\n",
+             threads, threads * ops, throughput);
+    }
+
+    {
+      EMultiQ<uint64_t, KeyCompare> queue(threads);
+      double throughput = run(queue, threads, ops, prefill);
+      printf("{\"queue\": \"emultiq\", \"threads\": %zu, \"shards\": %zu, \"ops\": %zu, \"ops_per_sec\": %.0f}\n",
+             threads, queue.get_shards_count(), threads * ops, throughput);
+    }
+
+    if (threads < max_threads && threads * 2 > max_threads)
+      threads = max_threads / 2;
+  }
+
+  return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * ewide_bench - Microbenchmark of the wide-node heap queue.
+ * Copyright(C) 2020 Fridolin Pokorny
+ *
+ * This program is free software: you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * The 8-ary EHeapQWide, with the smallest child selected by the scalar loop
+ * and by AVX2 (if supported by the CPU), is compared to the binary
+ * EHeapQCompact storing the same double keys and integer items. Each heap
+ * is filled with `size' items with random keys, for sizes from 1e5 up to
+ * max_size (powers of 10), then push, pop and pushpop are run `ops' times
+ * each - pops take the heap back to `size' items after pushes. Results are
+ * printed as JSON lines, one line per heap, size and operation:
+ *
+ *   ewide_bench [max_size] [ops]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "eheapq.hpp"
+#include "ewide.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * Keys in a pseudo-random order, the splitmix64 finalizer is a bijection so that all keys are unique.
+ */
+static double make_key(uint64_t i) {
+  i = (i ^ (i >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  i = (i ^ (i >> 27)) * 0x94D049BB133111EBULL;
+  return (double)((i ^ (i >> 31)) >> 11);
+}
+
+/**
+ * Heaps benchmarked, wrapped to share the interface of EHeapQWide.
+ */
+class CompactHeap {
+public:
+  typedef EHeapQEntry<double, uint64_t> Entry;
+
+  CompactHeap(bool vectorized) {}
+  static const char *name(bool vectorized) { return "compact"; }
+
+  void reserve(size_t n) { this->heap.reserve(n); }
+  void push(double key, uint64_t item) { this->heap.push(this->entry(key, item)); }
+  uint64_t pop() { return this->heap.pop().item; }
+  uint64_t pushpop(double key, uint64_t item) { return this->heap.pushpop(this->entry(key, item)).item; }
+
+private:
+  EHeapQCompact<double, uint64_t> heap;
+
+  static Entry entry(double key, uint64_t item) {
+    Entry entry;
+    entry.key = key;
+    entry.item = item;
+    return entry;
+  }
+};
+
+class WideHeap {
+public:
+  WideHeap(bool vectorized) { this->heap.set_vectorized(vectorized); }
+  static const char *name(bool vectorized) { return vectorized ? "wide_avx2" : "wide_scalar"; }
+
+  void reserve(size_t n) { this->heap.reserve(n); }
+  void push(double key, uint64_t item) { this->heap.push(key, item); }
+  uint64_t pop() { return this->heap.pop(); }
+  uint64_t pushpop(double key, uint64_t item) { return this->heap.pushpop(key, item); }
+
+private:
+  EHeapQWide<double, uint64_t> heap;
+};
+
+template <class Heap, class Op> static void measure(Heap &heap, const char *name, size_t size, size_t n,
+                                                    bool vectorized, Op op) {
+  auto start = Clock::now();
+  for (size_t i = 0; i < n; i++)
+    op(heap);
+  double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+  printf("{\"heap\": \"%s\", \"size\": %zu, \"op\": \"%s\", \"ops\": %zu, \"ns_per_op\": %.1f}\n",
+         Heap::name(vectorized), size, name, n, elapsed / n);
+  fflush(stdout);
+}
+
+template <class Heap> static void run(size_t size, size_t ops, bool vectorized) {
+  Heap heap(vectorized);
+  uint64_t next = 0;
+  uint64_t checksum = 0;
+
+  // Memory is preallocated so that runs do not measure reallocations and rehashing.
+  heap.reserve(size + ops);
+  for (size_t i = 0; i < size; i++, next++)
+    heap.push(make_key(next), next);
+
+  measure(heap, "push", size, ops, vectorized, [&](Heap &h) {
+    h.push(make_key(next), next);
+    next++;
+  });
+  measure(heap, "pop", size, ops, vectorized, [&](Heap &h) { checksum += h.pop(); });
+  measure(heap, "pushpop", size, ops, vectorized, [&](Heap &h) {
+    checksum += h.pushpop(make_key(next), next);
+    next++;
+  });
+
+  // Keep results of pops observable.
+  if (checksum == 1)
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  size_t max_size = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+  size_t ops = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+  bool avx2 = EHeapQWide<double, uint64_t>().is_vectorized();
+
+  for (size_t size = 100000; size <= max_size; size *= 10) {
+    run<CompactHeap>(size, ops, false);
+    run<WideHeap>(size, ops, false);
+    if (avx2)
+      run<WideHeap>(size, ops, true);
+  }
+
+  return 0;
+}
@@ -22,7 +22,13 @@ __version__ = "0.2.0"
 __author__ = "Fridolin Pokorny <fridolin@redhat.com>"
 
 from .eheapq import ExtHeapQueue
+from .eheapq import ExtTopK
+from .eheapq import nlargest
+from .eheapq import nsmallest
 
 __all__ = [
     "ExtHeapQueue",
+    "ExtTopK",
+    "nlargest",
+    "nsmallest",
 ]
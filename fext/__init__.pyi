@@ -1,19 +1,80 @@
+import os
+from typing import Any
+from typing import Dict
+from typing import Iterator
 from typing import List
 from typing import Optional
+from typing import Sequence
+from typing import Tuple
+from typing import Union
 from .eheapq import ExtHeapQueue as ExtHeapQueue
+from .eheapq import ExtTopK as ExtTopK
+from .eheapq import nlargest as nlargest
+from .eheapq import nsmallest as nsmallest
 
 
 class ExtHeapQueue:
     size: int
+    key_width: int
+    order: str
 
+    def __init__(self, size: int = ..., key_width: int = 1, order: str = "min") -> None: ...
     def pop(self) -> object: ...
-    def push(self, key: float, item: object) -> None: ...
-    def pushpop(self, key: float, item: object) -> object: ...
+    def push(self, key: Union[float, Sequence[float]], item: object) -> None: ...
+    def pushpop(self, key: Union[float, Sequence[float]], item: object) -> object: ...
     def items(self) -> List[object]: ...
+    def sorted_items(self, with_keys: bool = True, reverse: bool = False, limit: Optional[int] = None) -> List[Any]: ...
+    def peek_n(self, k: int, with_keys: bool = False) -> List[Any]: ...
+    def iter_sorted(self, with_keys: bool = False) -> Iterator[Any]: ...
     def pop(self) -> object: ...
+    def pop_with_key(self) -> Tuple[Union[float, Tuple[float, ...]], object]: ...
+    def get_key(self, item: object, default: Any = None) -> Any: ...
+    def __contains__(self, item: object) -> bool: ...
     def get_top(self) -> object: ...
     def get(self, index: int) -> object: ...
     def get_last(self) -> Optional[object]: ...
     def get_max(self) -> object: ...
     def remove(self, item: object) -> object: ...
+    def merge(self, other: "ExtHeapQueue", steal: bool = True) -> None: ...
+    def __ior__(self, other: "ExtHeapQueue") -> "ExtHeapQueue": ...
     def clear(self) -> object: ...
+    def reserve(self, n: int) -> None: ...
+    def shrink(self) -> None: ...
+    def memory_stats(self) -> Dict[str, int]: ...
+    def set_sample_rate(self, rate: int) -> None: ...
+    def latency_stats(self) -> Optional[Dict[str, Any]]: ...
+    def reset_latency_stats(self) -> None: ...
+    def start_trace(self, path: Union[str, bytes, os.PathLike]) -> None: ...
+    def stop_trace(self) -> None: ...
+    # Available only if built with FEXT_STATS=1.
+    def stats(self) -> Dict[str, int]: ...
+    def reset_stats(self) -> None: ...
+
+
+class ExtTopK:
+    k: int
+    threshold: float
+
+    def __init__(self, k: int) -> None: ...
+    def push(self, key: float, item: object) -> bool: ...
+    def offer_many(self, keys: Sequence[float], items: Sequence[object]) -> int: ...
+    def items(self) -> List[object]: ...
+    def sorted_items(self, with_keys: bool = True, reverse: bool = False, limit: Optional[int] = None) -> List[Any]: ...
+    def pop(self) -> object: ...
+    def pop_with_key(self) -> Tuple[float, object]: ...
+    def get_key(self, item: object, default: Any = None) -> Any: ...
+    def __contains__(self, item: object) -> bool: ...
+    def get_top(self) -> object: ...
+    def clear(self) -> None: ...
+    def shrink(self) -> None: ...
+    def memory_stats(self) -> Dict[str, int]: ...
+    def set_sample_rate(self, rate: int) -> None: ...
+    def latency_stats(self) -> Optional[Dict[str, Any]]: ...
+    def reset_latency_stats(self) -> None: ...
+    # Available only if built with FEXT_STATS=1.
+    def stats(self) -> Dict[str, int]: ...
+    def reset_stats(self) -> None: ...
+
+
+def nsmallest(n: int, keys: Sequence[float], items: Sequence[object]) -> List[object]: ...
+def nlargest(n: int, keys: Sequence[float], items: Sequence[object]) -> List[object]: ...
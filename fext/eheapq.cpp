@@ -27,63 +27,386 @@ extern "C" {
 #include "structmember.h"
 }
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <limits>
 #include <unordered_map>
 #include <vector>
 
 #include "eheapq.hpp"
+#include "etrace.hpp"
+
+/**
+ * Maximum number of components a composite key can have.
+ */
+#define FEXT_MAX_KEY_WIDTH 32
+
+/**
+ * Selection of the best n out of N keys switches from the bounded heap to nth_element once n * FEXT_SELECT_FRACTION
+ * reaches N - the heap rejects most of the keys with a single comparison to its top while n is small, selection
+ * is O(N) regardless of n. Both take about the same time at n = N/128 for N from 1e4 to 1e6.
+ */
+#ifndef FEXT_SELECT_FRACTION
+#define FEXT_SELECT_FRACTION 128
+#endif
+
+/**
+ * A key stored for an item. The first key component is kept inline so that
+ * comparision of single keys does not need to touch any other memory, the
+ * remaining components of composite keys are stored in a shared flat array.
+ */
+struct PyObjectKey {
+  double first;  /**< The first (the most significant) key component. */
+  size_t slot;   /**< Slot to the flat array of remaining key components. */
+};
+
+/**
+ * Raw memory allocator using Python's memory manager so that allocations are
+ * attributed by tracemalloc. The GIL has to be held.
+ */
+struct PyMemRawAllocator {
+  static void *allocate(size_t bytes) {
+    void *result = PyMem_Malloc(bytes);
+    if (!result)
+      throw std::bad_alloc();
+
+    return result;
+  }
+
+  static void deallocate(void *ptr, size_t bytes) noexcept { PyMem_Free(ptr); }
+};
+
+template <class T> using PyMemAllocator = EHeapQPoolAllocator<T, PyMemRawAllocator>;
+
+/**
+ * A hash map storing keys of items, nodes are allocated from a pool.
+ */
+typedef std::unordered_map<PyObject *, PyObjectKey, std::hash<PyObject *>, std::equal_to<PyObject *>,
+                           PyMemAllocator<std::pair<PyObject *const, PyObjectKey>>> PyObjectKeyMap;
+
+/**
+ * Estimated size of a node of the key map - a pointer to the next node, the value and a hash code possibly cached.
+ */
+const size_t PYOBJECT_KEY_NODE_SIZE = sizeof(void *) + sizeof(PyObjectKeyMap::value_type) + sizeof(size_t);
 
 class PyObjectCompare {
 public:
-  std::unordered_map<PyObject *, float> *key_map;  /**< A hash map used to store keys used for obj comparision. */
+  PyObjectKeyMap *key_map;        /**< A hash map used to store keys used for obj comparision. */
+  std::vector<double, PyMemAllocator<double>> *key_rest;  /**< Remaining components of composite keys, key_width - 1 per slot. */
+  std::vector<size_t, PyMemAllocator<size_t>> *key_free;  /**< Slots in key_rest that can be reused. */
+  size_t key_width;               /**< Number of components of a key. */
 
   PyObjectCompare() {
-    this->key_map = new std::unordered_map<PyObject *, float>;
+    this->key_map = new PyObjectKeyMap;
+    this->key_rest = new std::vector<double, PyMemAllocator<double>>(this->key_map->get_allocator());
+    this->key_free = new std::vector<size_t, PyMemAllocator<size_t>>(this->key_map->get_allocator());
+    this->key_width = 1;
   }
 
   ~PyObjectCompare() {
     delete this->key_map;
+    delete this->key_rest;
+    delete this->key_free;
   }
 
   bool operator()(PyObject *a, PyObject *b) {
     // comparision keys need to be always present.
-    float a_key = this->key_map->at(a);
-    float b_key = this->key_map->at(b);
-    return a_key < b_key;
+    const PyObjectKey &a_key = this->key_map->at(a);
+    const PyObjectKey &b_key = this->key_map->at(b);
+
+    if (a_key.first != b_key.first || this->key_width == 1)
+      return a_key.first < b_key.first;
+
+    // Composite keys are compared lexicographically.
+    size_t rest_width = this->key_width - 1;
+    const double *a_rest = this->key_rest->data() + a_key.slot * rest_width;
+    const double *b_rest = this->key_rest->data() + b_key.slot * rest_width;
+    for (size_t i = 0; i < rest_width; i++) {
+      if (a_rest[i] != b_rest[i])
+        return a_rest[i] < b_rest[i];
+    }
+
+    return false;
   }
 
-  void removed_callback(PyObject *item) {
+  /**
+   * Compare the given keys the same way as items holding them are compared.
+   */
+  bool compare_keys(const double *a, const double *b) const {
+    return std::lexicographical_compare(a, a + this->key_width, b, b + this->key_width);
+  }
+
+  /**
+   * Store key for the given item.
+   *
+   * @param item The item for which the key should be stored.
+   * @param key Key components, key_width items.
+   * @result false if the item already has a key assigned, true otherwise.
+   */
+  bool add_key(PyObject *item, const double *key) {
+    auto inserted = this->key_map->insert({item, {key[0], 0}});
+    if (!inserted.second)
+      return false;
+
+    if (this->key_width > 1) {
+      size_t rest_width = this->key_width - 1;
+      size_t slot;
+
+      if (this->key_free->empty()) {
+        slot = this->key_rest->size() / rest_width;
+        this->key_rest->resize(this->key_rest->size() + rest_width);
+      } else {
+        slot = this->key_free->back();
+        this->key_free->pop_back();
+      }
+
+      inserted.first->second.slot = slot;
+      std::copy(key + 1, key + this->key_width, this->key_rest->begin() + slot * rest_width);
+    }
+
+    return true;
+  }
+
+  /**
+   * Get key stored for the given item.
+   *
+   * @param item The item stored.
+   * @param key Set to key components, key_width items.
+   */
+  void get_key(PyObject *item, double *key) const {
+    const PyObjectKey &item_key = this->key_map->at(item);
+
+    key[0] = item_key.first;
+    if (this->key_width > 1) {
+      const double *rest = this->key_rest->data() + item_key.slot * (this->key_width - 1);
+      std::copy(rest, rest + this->key_width - 1, key + 1);
+    }
+  }
+
+  /**
+   * Replace key stored for the given item, the heap invariant has to be restored by the caller.
+   *
+   * @param item The item stored.
+   * @param key Key components, key_width items.
+   */
+  void set_key(PyObject *item, const double *key) {
+    PyObjectKey &item_key = this->key_map->at(item);
+
+    item_key.first = key[0];
+    if (this->key_width > 1)
+      std::copy(key + 1, key + this->key_width, this->key_rest->begin() + item_key.slot * (this->key_width - 1));
+  }
+
+  /**
+   * Remove key stored for the given item.
+   *
+   * @param item The item for which the key should be removed.
+   */
+  void del_key(PyObject *item) {
+    if (this->key_width > 1) {
+      auto it = this->key_map->find(item);
+      if (it == this->key_map->end())
+        return;
+
+      this->key_free->push_back(it->second.slot);
+      this->key_map->erase(it);
+      return;
+    }
+
     this->key_map->erase(item);
+  }
+
+  /**
+   * Remove all the keys stored, memory is kept for keys added later.
+   */
+  void clear_keys() {
+    this->key_map->clear();
+    this->key_rest->clear();
+    this->key_free->clear();
+  }
+
+  /**
+   * Preallocate memory for keys of the given number of items.
+   *
+   * @param n Number of items to preallocate memory for.
+   */
+  void reserve_keys(size_t n) {
+    // Keys are added before the top item is removed when pushing to a full heap.
+    this->key_map->reserve(n + 1);
+
+    auto allocator = this->key_map->get_allocator();
+    eheapq_allocator_reserve(allocator, n + 1 - std::min(n + 1, this->key_map->size()), PYOBJECT_KEY_NODE_SIZE);
+
+    if (this->key_width > 1) {
+      this->key_rest->reserve((n + 1) * (this->key_width - 1));
+      this->key_free->reserve(n + 1);
+    }
+  }
+
+  /**
+   * Release memory not needed for keys currently stored - the key map is rebuilt and key slots are compacted.
+   */
+  void shrink_keys() {
+    std::vector<std::pair<PyObject *, PyObjectKey>> keys(this->key_map->begin(), this->key_map->end());
+    size_t rest_width = this->key_width - 1;
+
+    this->key_map->clear();
+    auto allocator = this->key_map->get_allocator();
+    eheapq_allocator_release(allocator);
+    this->key_map->rehash(0);
+    this->key_map->reserve(keys.size());
+    eheapq_allocator_reserve(allocator, keys.size(), PYOBJECT_KEY_NODE_SIZE);
+
+    if (rest_width > 0) {
+      std::vector<double, PyMemAllocator<double>> key_rest(allocator);
+      key_rest.reserve(keys.size() * rest_width);
+
+      for (size_t i = 0; i < keys.size(); i++) {
+        auto rest = this->key_rest->begin() + keys[i].second.slot * rest_width;
+        key_rest.insert(key_rest.end(), rest, rest + rest_width);
+        keys[i].second.slot = i;
+      }
+
+      this->key_rest->swap(key_rest);
+    }
+
+    this->key_free->clear();
+    this->key_free->shrink_to_fit();
+    this->key_map->insert(keys.begin(), keys.end());
+  }
+
+  /**
+   * Get memory used for keys.
+   *
+   * @param keys Set to memory used by the key map and key components, in bytes.
+   * @param slack Set to memory held by the pool of the key map that is not in use, in bytes.
+   */
+  void get_memory_stats(size_t &keys, size_t &slack) const noexcept {
+    EHeapQPoolStats pool_stats;
+
+    eheapq_allocator_stats(this->key_map->get_allocator(), pool_stats);
+    keys = this->key_map->bucket_count() * sizeof(void *) + pool_stats.used +
+           this->key_rest->capacity() * sizeof(double) + this->key_free->capacity() * sizeof(size_t);
+    slack = pool_stats.reserved - pool_stats.used;
+  }
+
+  void removed_callback(PyObject *item) {
+    this->del_key(item);
     Py_DECREF(item);
   }
 };
 
+/**
+ * Comparison of items by their keys in the reversed order, the item with the largest key is on top.
+ */
+class PyObjectMaxCompare : public PyObjectCompare {
+public:
+  bool operator()(PyObject *a, PyObject *b) { return PyObjectCompare::operator()(b, a); }
+
+  bool compare_keys(const double *a, const double *b) const { return PyObjectCompare::compare_keys(b, a); }
+};
+
+/**
+ * The heap queue storing Python objects, memory is allocated using Python's memory manager.
+ */
+typedef EHeapQ<PyObject *, PyObjectCompare, std::hash<PyObject *>, PyMemAllocator<PyObject *>> PyObjectHeap;
+
+/**
+ * The heap queue storing Python objects with the largest key on top.
+ */
+typedef EHeapQ<PyObject *, PyObjectMaxCompare, std::hash<PyObject *>, PyMemAllocator<PyObject *>> PyObjectMaxHeap;
+
+/**
+ * Heap queues ordered by the smallest and by the largest key use different
+ * instantiations of EHeapQ so that the order is not checked on each
+ * comparison. Exactly one of the heaps is set, operations are implemented
+ * as function templates and dispatched once per call, see FEXT_DISPATCH.
+ */
 typedef struct {
-  PyObject_HEAD EHeapQ<PyObject *, PyObjectCompare> *heap;
+  PyObject_HEAD PyObjectHeap *heap;  /**< The heap if ordered by the smallest key (order="min"). */
+  PyObjectMaxHeap *max_heap;         /**< The heap if ordered by the largest key (order="max"). */
+  EHeapQTraceWriter *trace;          /**< Operations are recorded if set, see start_trace. */
+  uint64_t modifications;            /**< Incremented on each change of the heap, checked by sorted iterators. */
 } ExtHeapQueue;
 
-static int ExtHeapQueue_traverse(ExtHeapQueue *self, visitproc visit,
-                                 void *arg) {
-  for (auto i : *(self->heap->get_items()))
+static PyTypeObject ExtMinHeapQueueType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+template <class Heap> static Heap *ExtHeapQueue_heap(ExtHeapQueue *self);
+
+template <> PyObjectHeap *ExtHeapQueue_heap<PyObjectHeap>(ExtHeapQueue *self) { return self->heap; }
+
+template <> PyObjectMaxHeap *ExtHeapQueue_heap<PyObjectMaxHeap>(ExtHeapQueue *self) { return self->max_heap; }
+
+/**
+ * Select the instantiation of the given function template for the heap of the given heap queue.
+ */
+#define FEXT_DISPATCH(queue, function) ((queue)->max_heap ? function<PyObjectMaxHeap> : function<PyObjectHeap>)
+
+/**
+ * Get keys of items stored, kept the same way for both orders.
+ */
+static PyObjectCompare &ExtHeapQueue_keys(ExtHeapQueue *self) {
+  if (self->max_heap)
+    return self->max_heap->comp;
+
+  return self->heap->comp;
+}
+
+/**
+ * Record the given operation if tracing, items are identified by their address.
+ */
+static inline void ExtHeapQueue_trace(ExtHeapQueue *self, EHeapQTraceOp op, PyObject *item, const double *key = NULL) {
+  double negated[FEXT_MAX_KEY_WIDTH];
+
+  if (!self->trace)
+    return;
+
+  // Traces are replayed on a min-heap, keys of heap queues ordered by the largest key are recorded negated.
+  if (key && self->max_heap) {
+    for (size_t i = 0; i < self->max_heap->comp.key_width; i++)
+      negated[i] = -key[i];
+    key = negated;
+  }
+
+  self->trace->record(op, (uint64_t)(uintptr_t)item, key);
+}
+
+template <class Heap> static int ExtHeapQueue_do_traverse(ExtHeapQueue *self, visitproc visit, void *arg) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+
+  for (auto i : *(heap->get_items()))
     Py_VISIT(i);
 
   return 0;
 }
 
-static int ExtHeapQueue_clear(ExtHeapQueue *self) {
-  for (auto i : *(self->heap->get_items()))
+static int ExtHeapQueue_traverse(ExtHeapQueue *self, visitproc visit, void *arg) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_traverse)(self, visit, arg);
+}
+
+template <class Heap> static int ExtHeapQueue_do_clear(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+
+  for (auto i : *(heap->get_items()))
     Py_DECREF(i);
 
-  self->heap->clear();
-  self->heap->comp.key_map->clear();
+  heap->clear();
+  heap->comp.clear_keys();
+  self->modifications++;
   return 0;
 }
 
+static int ExtHeapQueue_clear(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_clear)(self);
+}
+
 static void ExtHeapQueue_dealloc(ExtHeapQueue *self) {
   PyObject_GC_UnTrack(self);
   ExtHeapQueue_clear(self);
   delete self->heap;
+  delete self->max_heap;
+  delete self->trace;
   Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
@@ -91,28 +414,194 @@ static PyObject *ExtHeapQueue_new(PyTypeObject *type, PyObject *args,
                                   PyObject *kwds) {
   ExtHeapQueue *self;
   self = (ExtHeapQueue *)type->tp_alloc(type, 0);
-  self->heap = new EHeapQ<PyObject *, PyObjectCompare>;
+  self->heap = new PyObjectHeap;
+  self->max_heap = NULL;
+  self->trace = NULL;
+  self->modifications = 0;
   return (PyObject *)self;
 }
 
+template <class Heap> static size_t ExtHeapQueue_do_length(ExtHeapQueue *self) {
+  return ExtHeapQueue_heap<Heap>(self)->get_length();
+}
+
+template <class Heap> static size_t ExtHeapQueue_do_size(ExtHeapQueue *self) {
+  return ExtHeapQueue_heap<Heap>(self)->get_size();
+}
+
+template <class Heap> static void ExtHeapQueue_do_configure(ExtHeapQueue *self, size_t size, size_t key_width) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+
+  // Free key slots of an emptied heap are sized for the previous width.
+  if (key_width != heap->comp.key_width) {
+    heap->comp.clear_keys();
+    heap->comp.key_width = key_width;
+  }
+
+  heap->set_size(size);
+  self->modifications++;
+
+  if (size != EHEAPQ_DEFAULT_SIZE) {
+    // The final capacity is known, allocate everything upfront so that the heap does not reallocate.
+    heap->reserve(size);
+    heap->comp.reserve_keys(size);
+  }
+}
+
 static int ExtHeapQueue_init(ExtHeapQueue *self, PyObject *args,
                              PyObject *kwds) {
-  static char *kwlist[] = {"size", NULL};
+  static char *kwlist[] = {"size", "key_width", "order", NULL};
+
+  size_t size = FEXT_DISPATCH(self, ExtHeapQueue_do_size)(self);
+  size_t key_width = ExtHeapQueue_keys(self).key_width;
+  size_t length = FEXT_DISPATCH(self, ExtHeapQueue_do_length)(self);
+  const char *order = NULL;
+  bool max = self->max_heap != NULL;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|kks", kwlist, &size, &key_width, &order))
+    return -1;
+
+  if (key_width < 1 || key_width > FEXT_MAX_KEY_WIDTH) {
+    PyErr_Format(PyExc_ValueError, "key_width has to be in range 1..%d", FEXT_MAX_KEY_WIDTH);
+    return -1;
+  }
 
-  size_t size = self->heap->get_size();
+  if (order) {
+    if (strcmp(order, "min") != 0 && strcmp(order, "max") != 0) {
+      PyErr_SetString(PyExc_ValueError, "order has to be 'min' or 'max'");
+      return -1;
+    }
+    max = strcmp(order, "max") == 0;
+  }
+
+  if (key_width != ExtHeapQueue_keys(self).key_width && length > 0) {
+    PyErr_SetString(PyExc_ValueError, "key_width cannot be changed on a non-empty heap");
+    return -1;
+  }
 
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|k", kwlist, &size))
+  // The trace header records the key width and size, records written after a change would not replay.
+  if (self->trace && (key_width != ExtHeapQueue_keys(self).key_width ||
+                      size != FEXT_DISPATCH(self, ExtHeapQueue_do_size)(self))) {
+    PyErr_SetString(PyExc_RuntimeError, "key_width and size cannot be changed while operations are traced");
     return -1;
+  }
+
+  if (max != (self->max_heap != NULL)) {
+    if (length > 0) {
+      PyErr_SetString(PyExc_ValueError, "order cannot be changed on a non-empty heap");
+      return -1;
+    }
+
+    // The heap is empty, it is replaced by the instantiation for the order requested.
+    delete self->heap;
+    delete self->max_heap;
+    self->heap = max ? NULL : new PyObjectHeap;
+    self->max_heap = max ? new PyObjectMaxHeap : NULL;
+  }
 
-  self->heap->set_size(size);
+  FEXT_DISPATCH(self, ExtHeapQueue_do_configure)(self, size, key_width);
   return 0;
 }
 
-static PyObject *ExtHeapQueue_top(ExtHeapQueue *self) {
+/**
+ * Get format character of a buffer storing key components, 0 if not supported.
+ */
+static char ExtHeapQueue_key_buffer_format(const char *format) {
+  if (format == NULL)
+    return 'B';
+
+  if (format[0] == '@' || format[0] == '=')
+    format++;
+
+  if ((format[0] == 'd' || format[0] == 'f') && format[1] == '\0')
+    return format[0];
+
+  return 0;
+}
+
+/**
+ * Check none of the key components is NaN - NaN is not ordered, sorting and selection need a strict weak ordering.
+ */
+static int ExtHeapQueue_check_key(const double *key, size_t key_width) {
+  for (size_t i = 0; i < key_width; i++) {
+    if (std::isnan(key[i])) {
+      PyErr_SetString(PyExc_ValueError, "keys cannot be NaN");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Parse a key passed from Python. Single keys are floats, composite keys are
+ * passed as a sequence (e.g. a tuple) or a buffer of key_width floats.
+ */
+static int ExtHeapQueue_parse_key(ExtHeapQueue *self, PyObject *obj, double *key) {
+  size_t key_width = ExtHeapQueue_keys(self).key_width;
+
+  if (key_width == 1) {
+    key[0] = PyFloat_AsDouble(obj);
+    if (key[0] == -1.0 && PyErr_Occurred())
+      return -1;
+
+    return ExtHeapQueue_check_key(key, key_width);
+  }
+
+  if (PyObject_CheckBuffer(obj)) {
+    Py_buffer view;
+
+    if (PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+      return -1;
+
+    char format = ExtHeapQueue_key_buffer_format(view.format);
+    if (format == 0 || (size_t)view.itemsize != (format == 'd' ? sizeof(double) : sizeof(float))) {
+      PyBuffer_Release(&view);
+      PyErr_SetString(PyExc_TypeError, "key buffer has to store floats or doubles");
+      return -1;
+    }
+
+    if ((size_t)(view.len / view.itemsize) != key_width) {
+      PyBuffer_Release(&view);
+      PyErr_Format(PyExc_ValueError, "key has to have %zu components", key_width);
+      return -1;
+    }
+
+    for (size_t i = 0; i < key_width; i++)
+      key[i] = format == 'd' ? ((double *)view.buf)[i] : ((float *)view.buf)[i];
+
+    PyBuffer_Release(&view);
+    return ExtHeapQueue_check_key(key, key_width);
+  }
+
+  PyObject *seq = PySequence_Fast(obj, "key has to be a sequence or a buffer of floats");
+  if (seq == NULL)
+    return -1;
+
+  if ((size_t)PySequence_Fast_GET_SIZE(seq) != key_width) {
+    Py_DECREF(seq);
+    PyErr_Format(PyExc_ValueError, "key has to have %zu components", key_width);
+    return -1;
+  }
+
+  for (size_t i = 0; i < key_width; i++) {
+    key[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+    if (key[i] == -1.0 && PyErr_Occurred()) {
+      Py_DECREF(seq);
+      return -1;
+    }
+  }
+
+  Py_DECREF(seq);
+  return ExtHeapQueue_check_key(key, key_width);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_top(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
   PyObject *item;
 
   try {
-    item = self->heap->get_top();
+    item = heap->get_top();
   } catch (EHeapQEmpty &exc) {
     PyErr_SetString(PyExc_KeyError, exc.what());
     return NULL;
@@ -122,11 +611,16 @@ static PyObject *ExtHeapQueue_top(ExtHeapQueue *self) {
   return item;
 }
 
-static PyObject *ExtHeapQueue_last(ExtHeapQueue *self) {
+static PyObject *ExtHeapQueue_top(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_top)(self);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_last(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
   PyObject *item;
 
   try {
-    item = self->heap->get_last();
+    item = heap->get_last();
   } catch (EHeapQNoLast &exc) {
     Py_RETURN_NONE;
   } catch (EHeapQEmpty &exc) {
@@ -138,7 +632,12 @@ static PyObject *ExtHeapQueue_last(ExtHeapQueue *self) {
   return item;
 }
 
-static PyObject *ExtHeapQueue_get(ExtHeapQueue *self, PyObject *args) {
+static PyObject *ExtHeapQueue_last(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_last)(self);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_get(ExtHeapQueue *self, PyObject *args) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
   PyObject *item;
   size_t idx;
 
@@ -146,7 +645,7 @@ static PyObject *ExtHeapQueue_get(ExtHeapQueue *self, PyObject *args) {
     return NULL;
 
   try {
-    item = self->heap->get(idx);
+    item = heap->get(idx);
   } catch (EHeapQIndexError &exc) {
     PyErr_SetString(PyExc_IndexError, exc.what());
     return NULL;
@@ -156,86 +655,117 @@ static PyObject *ExtHeapQueue_get(ExtHeapQueue *self, PyObject *args) {
   return item;
 }
 
-static PyObject *ExtHeapQueue_pushpop(ExtHeapQueue *self, PyObject *args) {
-  PyObject *item, *to_return;
-  double key;
+static PyObject *ExtHeapQueue_get(ExtHeapQueue *self, PyObject *args) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_get)(self, args);
+}
 
-  if (!PyArg_ParseTuple(args, "dO", &key, &item))
+template <class Heap> static PyObject *ExtHeapQueue_do_pushpop(ExtHeapQueue *self, PyObject *args) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  PyObject *key_obj, *item, *to_return;
+  double key[FEXT_MAX_KEY_WIDTH];
+
+  if (!PyArg_ParseTuple(args, "OO", &key_obj, &item))
     return NULL;
 
-#ifndef FEXT_DANGEROUS
-  if (self->heap->comp.key_map->find(item) != self->heap->comp.key_map->end()) {
+  if (ExtHeapQueue_parse_key(self, key_obj, key) < 0)
+    return NULL;
+
+  if (!heap->comp.add_key(item, key)) {
     PyErr_SetString(PyExc_ValueError, EHeapQAlreadyPresentExc.what());
     return NULL;
   }
-#endif
-
-  self->heap->comp.key_map->insert({item, key});
 
   try {
-    to_return = self->heap->pushpop(item);
+    to_return = heap->pushpop(item);
   } catch (EHeapQAlreadyPresent &exc) {
-    // This is to complement FEXT_DANGEROUS before. Note the key gets overwritten, hence dangerous.
-    self->heap->comp.key_map->erase(item);
+    heap->comp.del_key(item);
     PyErr_SetString(PyExc_ValueError, exc.what());
     return NULL;
   }
 
+  ExtHeapQueue_trace(self, EHEAPQ_TRACE_PUSHPOP, item, key);
+  self->modifications++;
+  EHEAPQ_PROBE2(py_pushpop, item, to_return);
+
+  // The reference of the item popped is passed to the caller, the item pushed is now owned by the heap.
+  heap->comp.del_key(to_return);
   Py_INCREF(item);
   return to_return;
 }
 
-static PyObject *ExtHeapQueue_push(ExtHeapQueue *self, PyObject *args) {
-  PyObject *item;
-  double key;
+static PyObject *ExtHeapQueue_pushpop(ExtHeapQueue *self, PyObject *args) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_pushpop)(self, args);
+}
 
-  if (!PyArg_ParseTuple(args, "dO", &key, &item))
+template <class Heap> static PyObject *ExtHeapQueue_do_push(ExtHeapQueue *self, PyObject *args) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  PyObject *key_obj, *item;
+  double key[FEXT_MAX_KEY_WIDTH];
+
+  if (!PyArg_ParseTuple(args, "OO", &key_obj, &item))
     return NULL;
 
-#ifndef FEXT_DANGEROUS
-  if (self->heap->comp.key_map->find(item) != self->heap->comp.key_map->end()) {
-     PyErr_SetString(PyExc_ValueError, EHeapQAlreadyPresentExc.what());
-     return NULL;
+  if (ExtHeapQueue_parse_key(self, key_obj, key) < 0)
+    return NULL;
+
+  if (!heap->comp.add_key(item, key)) {
+    PyErr_SetString(PyExc_ValueError, EHeapQAlreadyPresentExc.what());
+    return NULL;
   }
-#endif
 
-  self->heap->comp.key_map->insert({item, key});
+  // The reference is released in the callback if the item is not kept in the heap.
+  Py_INCREF(item);
 
-  std::function<void(PyObject *)> f = std::bind(&PyObjectCompare::removed_callback, &self->heap->comp, std::placeholders::_1);
+  std::function<void(PyObject *)> f = std::bind(&PyObjectCompare::removed_callback, &heap->comp, std::placeholders::_1);
   try {
-    self->heap->push(item, f);
-    Py_INCREF(item);
+    heap->push(item, f);
   } catch (EHeapQAlreadyPresent &exc) {
-    // This is to complement FEXT_DANGEROUS before. Note the key gets overwritten, hence dangerous.
-    self->heap->comp.key_map->erase(item);
+    heap->comp.del_key(item);
+    Py_DECREF(item);
     PyErr_SetString(PyExc_ValueError, exc.what());
     return NULL;
   }
 
+  ExtHeapQueue_trace(self, EHEAPQ_TRACE_PUSH, item, key);
+  self->modifications++;
+  EHEAPQ_PROBE1(py_push, item);
   Py_RETURN_NONE;
 }
 
-static PyObject *ExtHeapQueue_pop(ExtHeapQueue *self) {
+static PyObject *ExtHeapQueue_push(ExtHeapQueue *self, PyObject *args) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_push)(self, args);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_pop(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
   PyObject *item;
 
   try {
-    item = self->heap->pop();
+    item = heap->pop();
   } catch (EHeapQEmpty &exc) {
     PyErr_SetString(PyExc_KeyError, exc.what());
     return NULL;
   }
 
-  self->heap->comp.key_map->erase(item);
+  ExtHeapQueue_trace(self, EHEAPQ_TRACE_POP, item);
+  self->modifications++;
+  EHEAPQ_PROBE1(py_pop, item);
+  heap->comp.del_key(item);
   return item;
 }
 
-static PyObject *ExtHeapQueue_remove(ExtHeapQueue *self, PyObject *args) {
+static PyObject *ExtHeapQueue_pop(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_pop)(self);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_remove(ExtHeapQueue *self, PyObject *args) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
   PyObject *item;
   if (!PyArg_ParseTuple(args, "O", &item))
     return NULL;
 
   try {
-    self->heap->remove(item);
+    heap->remove(item);
   } catch (EHeapQEmpty &exc) {
     PyErr_SetString(PyExc_KeyError, exc.what());
     return NULL;
@@ -244,16 +774,24 @@ static PyObject *ExtHeapQueue_remove(ExtHeapQueue *self, PyObject *args) {
     return NULL;
   }
 
-  self->heap->comp.key_map->erase(item);
+  ExtHeapQueue_trace(self, EHEAPQ_TRACE_REMOVE, item);
+  self->modifications++;
+  EHEAPQ_PROBE1(py_remove, item);
+  heap->comp.del_key(item);
   Py_DECREF(item);
   Py_RETURN_NONE;
 }
 
-PyObject *ExtHeapQueue_items(ExtHeapQueue *self) {
-  PyObject *result = PyList_New(self->heap->get_length());
+static PyObject *ExtHeapQueue_remove(ExtHeapQueue *self, PyObject *args) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_remove)(self, args);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_items(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  PyObject *result = PyList_New(heap->get_length());
 
   int i = 0;
-  for (auto it = self->heap->begin(); it != self->heap->end(); ++it, ++i) {
+  for (auto it = heap->begin(); it != heap->end(); ++it, ++i) {
     Py_INCREF(*it);
     PyList_SET_ITEM(result, i, *it);
   }
@@ -261,91 +799,1303 @@ PyObject *ExtHeapQueue_items(ExtHeapQueue *self) {
   return result;
 }
 
-static PyObject *ExtHeapQueue_max(ExtHeapQueue *self) {
-  PyObject *item;
+PyObject *ExtHeapQueue_items(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_items)(self);
+}
 
-  try {
-    item = self->heap->get_peak();
-  } catch (EHeapQEmpty &exc) {
-    PyErr_SetString(PyExc_KeyError, exc.what());
+/**
+ * Convert the given key to a Python object - a float, a tuple of floats for composite keys.
+ */
+static PyObject *ExtHeapQueue_key_object(ExtHeapQueue *self, const double *key) {
+  size_t key_width = ExtHeapQueue_keys(self).key_width;
+  PyObject *result;
+
+  if (key_width == 1)
+    return PyFloat_FromDouble(key[0]);
+
+  if (!(result = PyTuple_New(key_width)))
     return NULL;
+
+  for (size_t i = 0; i < key_width; i++) {
+    PyObject *component = PyFloat_FromDouble(key[i]);
+    if (!component) {
+      Py_DECREF(result);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(result, i, component);
   }
 
-  Py_INCREF(item);
-  return item;
+  return result;
 }
 
-static PyObject *ExtHeapQueue_queue_clear(ExtHeapQueue *self) {
-  ExtHeapQueue_clear(self);
-  Py_RETURN_NONE;
-}
+template <class Heap> static PyObject *ExtHeapQueue_do_sorted_items(ExtHeapQueue *self, PyObject *args, PyObject *kwds) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  static char *kwlist[] = {"with_keys", "reverse", "limit", NULL};
+  size_t length = heap->get_length(), key_width = heap->comp.key_width, limit = length;
+  PyObject *limit_obj = Py_None, *result;
+  int with_keys = 1, reverse = 0;
 
-static PyObject *ExtHeapQueue_getsize(ExtHeapQueue *self) {
-  return PyLong_FromUnsignedLong(self->heap->get_size());
-}
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ppO", kwlist, &with_keys, &reverse, &limit_obj))
+    return NULL;
 
-static long int ExtHeapQueue_len(PyObject *self) {
-  return ((ExtHeapQueue *)self)->heap->get_length();
-}
+  if (limit_obj != Py_None) {
+    Py_ssize_t limit_value = PyNumber_AsSsize_t(limit_obj, PyExc_OverflowError);
+    if (limit_value == -1 && PyErr_Occurred())
+      return NULL;
 
-static PySequenceMethods ExtHeapQueue_sequence_methods[] = {
-    ExtHeapQueue_len, // sq_length
-};
+    if (limit_value < 0) {
+      PyErr_SetString(PyExc_ValueError, "limit cannot be negative");
+      return NULL;
+    }
 
-static PyMethodDef ExtHeapQueue_methods[] = {
-    {"push", (PyCFunction)ExtHeapQueue_push, METH_VARARGS,
-     "Push item onto heap, maintaining the heap invariant."},
-    {"pushpop", (PyCFunction)ExtHeapQueue_pushpop, METH_VARARGS,
-     "Push item on the heap, then pop and return the smallest item from the "
-     "heap. The combined action runs more efficiently than heappush() followed "
-     "by a separate call tprint(a.get_size())o heappop()."},
-    {"items", (PyCFunction)ExtHeapQueue_items, METH_VARARGS,
-     "Return a list containing objects stored in the heap."},
-    {"pop", (PyCFunction)ExtHeapQueue_pop, METH_NOARGS,
-     "Pops top item from the heap."},
-    {"get_top", (PyCFunction)ExtHeapQueue_top, METH_NOARGS,
-     "Gets top item from the heap, the heap is untouched."},
-    {"get", (PyCFunction)ExtHeapQueue_get, METH_VARARGS,
-     "Get an index from the heap based on the index to the internal heap."},
-    {"get_last", (PyCFunction)ExtHeapQueue_last, METH_NOARGS,
-     "Get last item added, if the item is still present in the heap."},
-    {"get_max", (PyCFunction)ExtHeapQueue_max, METH_NOARGS,
-     "Retrieve maximum stored in the min-heapq, in O(N/2)."},
-    {"remove", (PyCFunction)ExtHeapQueue_remove, METH_VARARGS,
-     "Remove the given item, in O(log(N))."},
-    {"clear", (PyCFunction)ExtHeapQueue_queue_clear, METH_VARARGS,
-     "Clear the heap queue."},
-    {NULL}};
+    limit = std::min((size_t)limit_value, length);
+  }
 
-static PyGetSetDef ExtHeapQueue_getsetters[] = {
-    {"size", (getter)ExtHeapQueue_getsize, NULL, "Max size of the heap.", NULL},
-    {NULL} /* Sentinel */
-};
+  // Keys are copied to a flat array so that comparisons do not look them up in the key map, positions in
+  // the heap vector are sorted. Items with equal keys are ordered by their positions.
+  std::vector<double> keys(length * key_width);
+  std::vector<size_t> order(length);
+  auto it = heap->begin();
+  for (size_t i = 0; i < length; i++, ++it) {
+    heap->comp.get_key(*it, keys.data() + i * key_width);
+    order[i] = i;
+  }
 
-PyMODINIT_FUNC PyInit_eheapq(void) {
-  static PyTypeObject ExtMinHeapQueueType = {PyVarObject_HEAD_INIT(NULL, 0)};
-  ExtMinHeapQueueType.tp_name = "eheapq.ExtHeapQueue";
-  ExtMinHeapQueueType.tp_doc = "Extended heap queue algorithm.";
-  ExtMinHeapQueueType.tp_basicsize = sizeof(ExtHeapQueue);
-  ExtMinHeapQueueType.tp_itemsize = 0;
-  ExtMinHeapQueueType.tp_flags =
-      Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC;
-  ExtMinHeapQueueType.tp_new = ExtHeapQueue_new;
-  ExtMinHeapQueueType.tp_as_sequence = ExtHeapQueue_sequence_methods;
-  ExtMinHeapQueueType.tp_init = (initproc)ExtHeapQueue_init;
-  ExtMinHeapQueueType.tp_dealloc = (destructor)ExtHeapQueue_dealloc;
-  ExtMinHeapQueueType.tp_traverse = (traverseproc)ExtHeapQueue_traverse;
-  ExtMinHeapQueueType.tp_clear = (inquiry)ExtHeapQueue_clear;
-  ExtMinHeapQueueType.tp_methods = ExtHeapQueue_methods;
-  ExtMinHeapQueueType.tp_getset = ExtHeapQueue_getsetters;
+  auto before = [&keys, key_width, reverse](size_t a, size_t b) {
+    const double *a_key = keys.data() + a * key_width;
+    const double *b_key = keys.data() + b * key_width;
 
-  static PyModuleDef eheapq = {PyModuleDef_HEAD_INIT};
-  eheapq.m_name = "eheapq";
-  eheapq.m_doc = "Implementation of extended heap queues.";
-  eheapq.m_size = -1;
+    for (size_t i = 0; i < key_width; i++) {
+      if (a_key[i] != b_key[i])
+        return reverse ? a_key[i] > b_key[i] : a_key[i] < b_key[i];
+    }
 
-  PyObject *m;
-  if (PyType_Ready(&ExtMinHeapQueueType) < 0)
+    return a < b;
+  };
+
+  if (limit * FEXT_SELECT_FRACTION < length) {
+    std::partial_sort(order.begin(), order.begin() + limit, order.end(), before);
+  } else {
+    if (limit < length)
+      std::nth_element(order.begin(), order.begin() + limit, order.end(), before);
+    std::sort(order.begin(), order.begin() + limit, before);
+  }
+
+  if (!(result = PyList_New(limit)))
+    return NULL;
+
+  for (size_t i = 0; i < limit; i++) {
+    PyObject *item = heap->get(order[i]);
+
+    if (with_keys) {
+      PyObject *key = ExtHeapQueue_key_object(self, keys.data() + order[i] * key_width);
+      if (!key) {
+        Py_DECREF(result);
+        return NULL;
+      }
+
+      item = Py_BuildValue("(NO)", key, item);
+      if (!item) {
+        Py_DECREF(result);
+        return NULL;
+      }
+    } else {
+      Py_INCREF(item);
+    }
+
+    PyList_SET_ITEM(result, i, item);
+  }
+
+  return result;
+}
+
+static PyObject *ExtHeapQueue_sorted_items(ExtHeapQueue *self, PyObject *args, PyObject *kwds) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_sorted_items)(self, args, kwds);
+}
+
+/**
+ * Items in the sorted order as returned by peek_n and iter_sorted - the item or (key, item) tuple at the given position.
+ */
+template <class Heap> static PyObject *ExtHeapQueue_do_sorted_entry(ExtHeapQueue *self, size_t pos, bool with_keys) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  PyObject *item = *(heap->begin() + pos), *key;
+  double key_buffer[FEXT_MAX_KEY_WIDTH];
+
+  if (!with_keys) {
+    Py_INCREF(item);
+    return item;
+  }
+
+  heap->comp.get_key(item, key_buffer);
+  if (!(key = ExtHeapQueue_key_object(self, key_buffer)))
+    return NULL;
+
+  return Py_BuildValue("(NO)", key, item);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_peek_n(ExtHeapQueue *self, PyObject *args, PyObject *kwds) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  static char *kwlist[] = {"k", "with_keys", NULL};
+  EHeapQSortedCursor<Heap> cursor(heap);
+  Py_ssize_t k;
+  int with_keys = 0;
+  PyObject *result;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|p", kwlist, &k, &with_keys))
+    return NULL;
+
+  if (k < 0) {
+    PyErr_SetString(PyExc_ValueError, "k cannot be negative");
+    return NULL;
+  }
+
+  k = std::min((size_t)k, heap->get_length());
+  cursor.reserve(k);
+
+  if (!(result = PyList_New(k)))
+    return NULL;
+
+  for (Py_ssize_t i = 0; i < k; i++) {
+    PyObject *entry = ExtHeapQueue_do_sorted_entry<Heap>(self, cursor.next(), with_keys);
+    if (!entry) {
+      Py_DECREF(result);
+      return NULL;
+    }
+    PyList_SET_ITEM(result, i, entry);
+  }
+
+  return result;
+}
+
+static PyObject *ExtHeapQueue_peek_n(ExtHeapQueue *self, PyObject *args, PyObject *kwds) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_peek_n)(self, args, kwds);
+}
+
+/**
+ * A lazy iterator over items of a heap queue in the sorted order, see ExtHeapQueue.iter_sorted.
+ */
+typedef struct {
+  PyObject_HEAD ExtHeapQueue *queue;
+  EHeapQSortedCursor<PyObjectHeap> *cursor;          /**< The cursor if the heap queue is ordered by the smallest key. */
+  EHeapQSortedCursor<PyObjectMaxHeap> *max_cursor;  /**< The cursor if the heap queue is ordered by the largest key. */
+  uint64_t modifications;  /**< Modifications of the heap queue when the iterator was created. */
+  bool with_keys;
+} ExtHeapQueueSortedIterator;
+
+template <class Heap> static EHeapQSortedCursor<Heap> *&ExtHeapQueueSortedIterator_cursor(ExtHeapQueueSortedIterator *self);
+
+template <>
+EHeapQSortedCursor<PyObjectHeap> *&ExtHeapQueueSortedIterator_cursor<PyObjectHeap>(ExtHeapQueueSortedIterator *self) {
+  return self->cursor;
+}
+
+template <>
+EHeapQSortedCursor<PyObjectMaxHeap> *&ExtHeapQueueSortedIterator_cursor<PyObjectMaxHeap>(ExtHeapQueueSortedIterator *self) {
+  return self->max_cursor;
+}
+
+static PyTypeObject ExtHeapQueueSortedIteratorType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+static int ExtHeapQueueSortedIterator_traverse(ExtHeapQueueSortedIterator *self, visitproc visit, void *arg) {
+  Py_VISIT(self->queue);
+  return 0;
+}
+
+static int ExtHeapQueueSortedIterator_clear(ExtHeapQueueSortedIterator *self) {
+  Py_CLEAR(self->queue);
+  return 0;
+}
+
+static void ExtHeapQueueSortedIterator_dealloc(ExtHeapQueueSortedIterator *self) {
+  PyObject_GC_UnTrack(self);
+  ExtHeapQueueSortedIterator_clear(self);
+  delete self->cursor;
+  delete self->max_cursor;
+  PyObject_GC_Del(self);
+}
+
+template <class Heap> static PyObject *ExtHeapQueueSortedIterator_do_next(ExtHeapQueueSortedIterator *self) {
+  EHeapQSortedCursor<Heap> *cursor = ExtHeapQueueSortedIterator_cursor<Heap>(self);
+
+  if (cursor->empty()) {
+    Py_CLEAR(self->queue);
+    return NULL;
+  }
+
+  return ExtHeapQueue_do_sorted_entry<Heap>(self->queue, cursor->next(), self->with_keys);
+}
+
+static PyObject *ExtHeapQueueSortedIterator_next(ExtHeapQueueSortedIterator *self) {
+  if (!self->queue)
+    return NULL;
+
+  // Positions in the frontier are not valid anymore and keys of removed items are gone. The heap is not replaced
+  // without a modification, the cursor matches the heap of the heap queue.
+  if (self->queue->modifications != self->modifications) {
+    PyErr_SetString(PyExc_RuntimeError, "heap queue changed during iteration");
+    return NULL;
+  }
+
+  return FEXT_DISPATCH(self->queue, ExtHeapQueueSortedIterator_do_next)(self);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_iter_sorted(ExtHeapQueue *self, PyObject *args, PyObject *kwds) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  static char *kwlist[] = {"with_keys", NULL};
+  ExtHeapQueueSortedIterator *iterator;
+  int with_keys = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", kwlist, &with_keys))
+    return NULL;
+
+  if (!(iterator = PyObject_GC_New(ExtHeapQueueSortedIterator, &ExtHeapQueueSortedIteratorType)))
+    return NULL;
+
+  Py_INCREF(self);
+  iterator->queue = self;
+  iterator->cursor = NULL;
+  iterator->max_cursor = NULL;
+  ExtHeapQueueSortedIterator_cursor<Heap>(iterator) = new EHeapQSortedCursor<Heap>(heap);
+  iterator->modifications = self->modifications;
+  iterator->with_keys = with_keys;
+  PyObject_GC_Track(iterator);
+  return (PyObject *)iterator;
+}
+
+static PyObject *ExtHeapQueue_iter_sorted(ExtHeapQueue *self, PyObject *args, PyObject *kwds) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_iter_sorted)(self, args, kwds);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_pop_with_key(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  PyObject *item, *key;
+  double key_buffer[FEXT_MAX_KEY_WIDTH];
+
+  try {
+    item = heap->get_top();
+  } catch (EHeapQEmpty &exc) {
+    PyErr_SetString(PyExc_KeyError, exc.what());
+    return NULL;
+  }
+
+  // The key object is created first so that the heap is untouched if it fails.
+  heap->comp.get_key(item, key_buffer);
+  if (!(key = ExtHeapQueue_key_object(self, key_buffer)))
+    return NULL;
+
+  heap->pop();
+  ExtHeapQueue_trace(self, EHEAPQ_TRACE_POP, item);
+  self->modifications++;
+  EHEAPQ_PROBE1(py_pop, item);
+  heap->comp.del_key(item);
+
+  // The reference held by the heap is passed to the tuple.
+  return Py_BuildValue("(NN)", key, item);
+}
+
+static PyObject *ExtHeapQueue_pop_with_key(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_pop_with_key)(self);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_get_key(ExtHeapQueue *self, PyObject *args) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  PyObject *item, *default_value = Py_None;
+  double key[FEXT_MAX_KEY_WIDTH];
+
+  if (!PyArg_ParseTuple(args, "O|O", &item, &default_value))
+    return NULL;
+
+  if (!heap->contains(item)) {
+    Py_INCREF(default_value);
+    return default_value;
+  }
+
+  heap->comp.get_key(item, key);
+  return ExtHeapQueue_key_object(self, key);
+}
+
+static PyObject *ExtHeapQueue_get_key(ExtHeapQueue *self, PyObject *args) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_get_key)(self, args);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_max(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  PyObject *item;
+
+  try {
+    item = heap->get_peak();
+  } catch (EHeapQEmpty &exc) {
+    PyErr_SetString(PyExc_KeyError, exc.what());
+    return NULL;
+  }
+
+  ExtHeapQueue_trace(self, EHEAPQ_TRACE_GET_MAX, item);
+  Py_INCREF(item);
+  return item;
+}
+
+static PyObject *ExtHeapQueue_max(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_max)(self);
+}
+
+static PyObject *ExtHeapQueue_queue_clear(ExtHeapQueue *self) {
+  ExtHeapQueue_trace(self, EHEAPQ_TRACE_CLEAR, NULL);
+  ExtHeapQueue_clear(self);
+  Py_RETURN_NONE;
+}
+
+/**
+ * Merge items of the other heap queue into the given one, see ExtHeapQueue.merge. Both heap queues have the same order.
+ *
+ * @param steal If true, references held by the other heap queue are moved and it is left empty.
+ */
+template <class Heap> static void ExtHeapQueue_do_merge(ExtHeapQueue *self, ExtHeapQueue *other, bool steal) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self), *other_heap = ExtHeapQueue_heap<Heap>(other);
+  double key[FEXT_MAX_KEY_WIDTH], stored_key[FEXT_MAX_KEY_WIDTH];
+
+  // Keys are resolved first - an item present in both heap queues keeps the key popped later, the heap is rebuilt
+  // by the merge. Each item of the other heap queue carries one reference, released if the item is not kept.
+  heap->comp.reserve_keys(heap->get_length() + other_heap->get_length());
+  for (auto it = other_heap->begin(); it != other_heap->end(); ++it) {
+    other_heap->comp.get_key(*it, key);
+
+    if (!heap->comp.add_key(*it, key)) {
+      heap->comp.get_key(*it, stored_key);
+      if (heap->comp.compare_keys(stored_key, key)) {
+        heap->comp.set_key(*it, key);
+        ExtHeapQueue_trace(self, EHEAPQ_TRACE_REMOVE, *it);
+        ExtHeapQueue_trace(self, EHEAPQ_TRACE_PUSH, *it, key);
+      }
+    } else {
+      ExtHeapQueue_trace(self, EHEAPQ_TRACE_PUSH, *it, key);
+    }
+
+    if (!steal)
+      Py_INCREF(*it);
+  }
+
+  // Items present in both heap queues are reported while stored, items evicted after they were removed.
+  heap->merge(*other_heap, [heap](PyObject *item) {
+    if (!heap->contains(item))
+      heap->comp.del_key(item);
+    Py_DECREF(item);
+  });
+  self->modifications++;
+
+  if (steal) {
+    ExtHeapQueue_trace(other, EHEAPQ_TRACE_CLEAR, NULL);
+    other_heap->clear();
+    other_heap->comp.clear_keys();
+    other->modifications++;
+  }
+}
+
+/**
+ * Check the other heap queue can be merged into the given one and merge it, see ExtHeapQueue.merge.
+ *
+ * @result 0 on success, -1 on error.
+ */
+static int ExtHeapQueue_merge_into(ExtHeapQueue *self, ExtHeapQueue *other, bool steal) {
+  if (other == self) {
+    PyErr_SetString(PyExc_ValueError, "cannot merge a heap queue into itself");
+    return -1;
+  }
+
+  if (ExtHeapQueue_keys(other).key_width != ExtHeapQueue_keys(self).key_width) {
+    PyErr_SetString(PyExc_ValueError, "cannot merge heap queues with different key_width");
+    return -1;
+  }
+
+  if ((other->max_heap != NULL) != (self->max_heap != NULL)) {
+    PyErr_SetString(PyExc_ValueError, "cannot merge heap queues with different order");
+    return -1;
+  }
+
+  FEXT_DISPATCH(self, ExtHeapQueue_do_merge)(self, other, steal);
+  return 0;
+}
+
+static PyObject *ExtHeapQueue_merge(ExtHeapQueue *self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"other", "steal", NULL};
+  PyObject *other;
+  int steal = 1;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|p", kwlist, &ExtMinHeapQueueType, &other, &steal))
+    return NULL;
+
+  if (ExtHeapQueue_merge_into(self, (ExtHeapQueue *)other, steal) < 0)
+    return NULL;
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *ExtHeapQueue_inplace_or(PyObject *self, PyObject *other) {
+  if (!PyObject_TypeCheck(self, &ExtMinHeapQueueType) || !PyObject_TypeCheck(other, &ExtMinHeapQueueType))
+    Py_RETURN_NOTIMPLEMENTED;
+
+  if (ExtHeapQueue_merge_into((ExtHeapQueue *)self, (ExtHeapQueue *)other, false) < 0)
+    return NULL;
+
+  Py_INCREF(self);
+  return self;
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_reserve(ExtHeapQueue *self, PyObject *args) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  size_t n;
+
+  if (!PyArg_ParseTuple(args, "k", &n))
+    return NULL;
+
+  heap->reserve(n);
+  heap->comp.reserve_keys(n);
+  Py_RETURN_NONE;
+}
+
+static PyObject *ExtHeapQueue_reserve(ExtHeapQueue *self, PyObject *args) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_reserve)(self, args);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_shrink(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+
+  heap->shrink();
+  heap->comp.shrink_keys();
+  Py_RETURN_NONE;
+}
+
+static PyObject *ExtHeapQueue_shrink(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_shrink)(self);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_memory_stats(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  EHeapQMemoryStats stats = heap->get_memory_stats();
+  size_t keys, keys_slack;
+
+  heap->comp.get_memory_stats(keys, keys_slack);
+
+  size_t slack = stats.slack + keys_slack;
+  size_t total = stats.heap + stats.index_buckets + stats.index_nodes + keys + slack;
+
+  return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n}", "heap", (Py_ssize_t)stats.heap, "index_buckets",
+                       (Py_ssize_t)stats.index_buckets, "index_nodes", (Py_ssize_t)stats.index_nodes, "keys",
+                       (Py_ssize_t)keys, "slack", (Py_ssize_t)slack, "total", (Py_ssize_t)total);
+}
+
+static PyObject *ExtHeapQueue_memory_stats(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_memory_stats)(self);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_sizeof(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  EHeapQMemoryStats stats = heap->get_memory_stats();
+  size_t keys, keys_slack;
+
+  heap->comp.get_memory_stats(keys, keys_slack);
+
+  size_t result = Py_TYPE(self)->tp_basicsize + sizeof(Heap) + stats.heap + stats.index_buckets +
+                  stats.index_nodes + stats.slack + keys + keys_slack;
+  return PyLong_FromSize_t(result);
+}
+
+static PyObject *ExtHeapQueue_sizeof(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_sizeof)(self);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_start_trace(ExtHeapQueue *self, PyObject *args) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  PyObject *path_obj, *path_bytes;
+  double key[FEXT_MAX_KEY_WIDTH];
+
+  if (!PyArg_ParseTuple(args, "O", &path_obj))
+    return NULL;
+
+  if (self->trace) {
+    PyErr_SetString(PyExc_RuntimeError, "operations are already traced");
+    return NULL;
+  }
+
+  if (!PyUnicode_FSConverter(path_obj, &path_bytes))
+    return NULL;
+
+  try {
+    self->trace = new EHeapQTraceWriter(PyBytes_AS_STRING(path_bytes), heap->comp.key_width, heap->get_size());
+  } catch (EHeapQTraceError &exc) {
+    Py_DECREF(path_bytes);
+    PyErr_SetString(PyExc_OSError, exc.what());
+    return NULL;
+  }
+  Py_DECREF(path_bytes);
+
+  // Items already stored are recorded as pushed so that a replay starts with the same items.
+  for (auto it = heap->begin(); it != heap->end(); ++it) {
+    heap->comp.get_key(*it, key);
+    ExtHeapQueue_trace(self, EHEAPQ_TRACE_PUSH, *it, key);
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *ExtHeapQueue_start_trace(ExtHeapQueue *self, PyObject *args) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_start_trace)(self, args);
+}
+
+static PyObject *ExtHeapQueue_stop_trace(ExtHeapQueue *self) {
+  EHeapQTraceWriter *trace = self->trace;
+
+  if (!trace)
+    Py_RETURN_NONE;
+
+  self->trace = NULL;
+  try {
+    trace->close();
+  } catch (EHeapQTraceError &exc) {
+    delete trace;
+    PyErr_SetString(PyExc_OSError, exc.what());
+    return NULL;
+  }
+
+  delete trace;
+  Py_RETURN_NONE;
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_set_sample_rate(ExtHeapQueue *self, PyObject *args) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  Py_ssize_t rate;
+
+  if (!PyArg_ParseTuple(args, "n", &rate))
+    return NULL;
+
+  if (rate < 0) {
+    PyErr_SetString(PyExc_ValueError, "sample rate cannot be negative");
+    return NULL;
+  }
+
+  heap->set_sample_rate(rate);
+  Py_RETURN_NONE;
+}
+
+static PyObject *ExtHeapQueue_set_sample_rate(ExtHeapQueue *self, PyObject *args) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_set_sample_rate)(self, args);
+}
+
+/**
+ * Convert the given histogram of latencies to a dict with percentiles and non-empty buckets.
+ */
+static PyObject *ExtHeapQueue_histogram_dict(const EHeapQHistogram &histogram) {
+  PyObject *buckets, *result;
+  uint64_t count = histogram.get_count();
+
+  if (!(buckets = PyDict_New()))
+    return NULL;
+
+  for (size_t i = 0; i < EHeapQHistogram::BUCKETS; i++) {
+    if (histogram.get_bucket_count(i) == 0)
+      continue;
+
+    PyObject *upper = PyLong_FromUnsignedLongLong(EHeapQHistogram::get_bucket_upper(i));
+    PyObject *bucket_count = PyLong_FromUnsignedLongLong(histogram.get_bucket_count(i));
+    if (!upper || !bucket_count || PyDict_SetItem(buckets, upper, bucket_count) < 0) {
+      Py_XDECREF(upper);
+      Py_XDECREF(bucket_count);
+      Py_DECREF(buckets);
+      return NULL;
+    }
+    Py_DECREF(upper);
+    Py_DECREF(bucket_count);
+  }
+
+  result = Py_BuildValue("{s:K,s:K,s:d,s:K,s:K,s:K,s:K,s:K,s:O}", "count", (unsigned long long)count, "min",
+                         (unsigned long long)histogram.get_min(), "mean",
+                         count ? (double)histogram.get_sum() / count : 0.0, "p50",
+                         (unsigned long long)histogram.percentile(0.5), "p90",
+                         (unsigned long long)histogram.percentile(0.9), "p99",
+                         (unsigned long long)histogram.percentile(0.99), "p999",
+                         (unsigned long long)histogram.percentile(0.999), "max",
+                         (unsigned long long)histogram.get_max(), "buckets", buckets);
+  Py_DECREF(buckets);
+  return result;
+}
+
+/**
+ * Convert the given counts of sift path lengths to a list, trailing zeros are left out.
+ */
+static PyObject *ExtHeapQueue_depths_list(const uint64_t *depths) {
+  size_t length = EHEAPQ_MAX_DEPTH;
+  PyObject *result;
+
+  while (length > 0 && depths[length - 1] == 0)
+    length--;
+
+  if (!(result = PyList_New(length)))
+    return NULL;
+
+  for (size_t i = 0; i < length; i++) {
+    PyObject *count = PyLong_FromUnsignedLongLong(depths[i]);
+    if (!count) {
+      Py_DECREF(result);
+      return NULL;
+    }
+    PyList_SET_ITEM(result, i, count);
+  }
+
+  return result;
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_latency_stats(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  static const char *op_names[EHEAPQ_OPS] = {"push", "pop", "pushpop", "replace", "remove", "get_max"};
+  const EHeapQLatencyStats *stats = heap->get_latency_stats();
+  PyObject *result, *value;
+
+  if (!stats)
+    Py_RETURN_NONE;
+
+  if (!(result = Py_BuildValue("{s:n}", "sample_rate", (Py_ssize_t)heap->get_sample_rate())))
+    return NULL;
+
+  for (int op = 0; op < EHEAPQ_OPS; op++) {
+    if (!(value = ExtHeapQueue_histogram_dict(stats->latency[op])) ||
+        PyDict_SetItemString(result, op_names[op], value) < 0) {
+      Py_XDECREF(value);
+      Py_DECREF(result);
+      return NULL;
+    }
+    Py_DECREF(value);
+  }
+
+  if (!(value = ExtHeapQueue_depths_list(stats->siftup_depths)) ||
+      PyDict_SetItemString(result, "siftup_depth", value) < 0) {
+    Py_XDECREF(value);
+    Py_DECREF(result);
+    return NULL;
+  }
+  Py_DECREF(value);
+
+  if (!(value = ExtHeapQueue_depths_list(stats->siftdown_depths)) ||
+      PyDict_SetItemString(result, "siftdown_depth", value) < 0) {
+    Py_XDECREF(value);
+    Py_DECREF(result);
+    return NULL;
+  }
+  Py_DECREF(value);
+
+  return result;
+}
+
+static PyObject *ExtHeapQueue_latency_stats(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_latency_stats)(self);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_reset_latency_stats(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+
+  heap->reset_latency_stats();
+  Py_RETURN_NONE;
+}
+
+static PyObject *ExtHeapQueue_reset_latency_stats(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_reset_latency_stats)(self);
+}
+
+#ifdef EHEAPQ_STATS
+template <class Heap> static PyObject *ExtHeapQueue_do_stats(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+  EHeapQStats stats = heap->get_stats();
+
+  return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}", "pushes", (unsigned long long)stats.pushes,
+                       "pops", (unsigned long long)stats.pops, "removes", (unsigned long long)stats.removes,
+                       "evictions", (unsigned long long)stats.evictions, "siftups", (unsigned long long)stats.siftups,
+                       "siftdowns", (unsigned long long)stats.siftdowns, "comparisons",
+                       (unsigned long long)stats.comparisons, "swaps", (unsigned long long)stats.swaps,
+                       "index_updates", (unsigned long long)stats.index_updates, "peak_rescans",
+                       (unsigned long long)stats.peak_rescans);
+}
+
+static PyObject *ExtHeapQueue_stats(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_stats)(self);
+}
+
+template <class Heap> static PyObject *ExtHeapQueue_do_reset_stats(ExtHeapQueue *self) {
+  Heap *heap = ExtHeapQueue_heap<Heap>(self);
+
+  heap->reset_stats();
+  Py_RETURN_NONE;
+}
+
+static PyObject *ExtHeapQueue_reset_stats(ExtHeapQueue *self) {
+  return FEXT_DISPATCH(self, ExtHeapQueue_do_reset_stats)(self);
+}
+#endif
+
+static PyObject *ExtHeapQueue_getsize(ExtHeapQueue *self) {
+  return PyLong_FromUnsignedLong(FEXT_DISPATCH(self, ExtHeapQueue_do_size)(self));
+}
+
+static PyObject *ExtHeapQueue_getkeywidth(ExtHeapQueue *self) {
+  return PyLong_FromSize_t(ExtHeapQueue_keys(self).key_width);
+}
+
+static PyObject *ExtHeapQueue_getorder(ExtHeapQueue *self) {
+  return PyUnicode_FromString(self->max_heap ? "max" : "min");
+}
+
+static long int ExtHeapQueue_len(PyObject *self) {
+  return FEXT_DISPATCH((ExtHeapQueue *)self, ExtHeapQueue_do_length)((ExtHeapQueue *)self);
+}
+
+template <class Heap> static int ExtHeapQueue_do_contains(ExtHeapQueue *self, PyObject *item) {
+  return ExtHeapQueue_heap<Heap>(self)->contains(item);
+}
+
+static int ExtHeapQueue_contains(PyObject *self, PyObject *item) {
+  return FEXT_DISPATCH((ExtHeapQueue *)self, ExtHeapQueue_do_contains)((ExtHeapQueue *)self, item);
+}
+
+static PySequenceMethods ExtHeapQueue_sequence_methods[] = {
+    ExtHeapQueue_len, // sq_length
+};
+
+static PyNumberMethods ExtHeapQueue_number_methods;
+
+static PyMethodDef ExtHeapQueue_methods[] = {
+    {"push", (PyCFunction)ExtHeapQueue_push, METH_VARARGS,
+     "Push item onto heap, maintaining the heap invariant."},
+    {"pushpop", (PyCFunction)ExtHeapQueue_pushpop, METH_VARARGS,
+     "Push item on the heap, then pop and return the top item from the "
+     "heap. The combined action runs more efficiently than heappush() followed "
+     "by a separate call tprint(a.get_size())o heappop()."},
+    {"items", (PyCFunction)ExtHeapQueue_items, METH_VARARGS,
+     "Return a list containing objects stored in the heap."},
+    {"sorted_items", (PyCFunction)ExtHeapQueue_sorted_items, METH_VARARGS | METH_KEYWORDS,
+     "Return a list of (key, item) tuples or items sorted by key, at most limit of them. The heap is untouched."},
+    {"peek_n", (PyCFunction)ExtHeapQueue_peek_n, METH_VARARGS | METH_KEYWORDS,
+     "Return a list of k items that would be popped first, in O(k log(k)) time. The heap is untouched."},
+    {"iter_sorted", (PyCFunction)ExtHeapQueue_iter_sorted, METH_VARARGS | METH_KEYWORDS,
+     "Return a lazy iterator over items in the order they would be popped. The heap is untouched, it must not "
+     "be modified during iteration."},
+    {"pop", (PyCFunction)ExtHeapQueue_pop, METH_NOARGS,
+     "Pops top item from the heap."},
+    {"pop_with_key", (PyCFunction)ExtHeapQueue_pop_with_key, METH_NOARGS,
+     "Pops top item from the heap, returns a (key, item) tuple."},
+    {"get_key", (PyCFunction)ExtHeapQueue_get_key, METH_VARARGS,
+     "Return key of the given item, looked up by identity, or default if the item is not stored."},
+    {"get_top", (PyCFunction)ExtHeapQueue_top, METH_NOARGS,
+     "Gets top item from the heap, the heap is untouched."},
+    {"get", (PyCFunction)ExtHeapQueue_get, METH_VARARGS,
+     "Get an index from the heap based on the index to the internal heap."},
+    {"get_last", (PyCFunction)ExtHeapQueue_last, METH_NOARGS,
+     "Get last item added, if the item is still present in the heap."},
+    {"get_max", (PyCFunction)ExtHeapQueue_max, METH_NOARGS,
+     "Retrieve the item popped last - maximum stored in the min-heapq, minimum in the max-heapq, in O(N/2)."},
+    {"remove", (PyCFunction)ExtHeapQueue_remove, METH_VARARGS,
+     "Remove the given item, in O(log(N))."},
+    {"merge", (PyCFunction)ExtHeapQueue_merge, METH_VARARGS | METH_KEYWORDS,
+     "Merge items of the other heap queue of the same order in O(N+M), an item present in both keeps the key "
+     "popped later. Items popped first are removed to respect the size. The other heap queue is emptied if steal "
+     "is true."},
+    {"clear", (PyCFunction)ExtHeapQueue_queue_clear, METH_VARARGS,
+     "Clear the heap queue, memory is kept for items pushed later (see shrink)."},
+    {"reserve", (PyCFunction)ExtHeapQueue_reserve, METH_VARARGS,
+     "Preallocate memory for the given number of items, done automatically for heaps with size set."},
+    {"shrink", (PyCFunction)ExtHeapQueue_shrink, METH_NOARGS,
+     "Release memory not needed for items currently stored."},
+    {"memory_stats", (PyCFunction)ExtHeapQueue_memory_stats, METH_NOARGS,
+     "Return a dict with memory used by the heap queue, in bytes."},
+    {"__sizeof__", (PyCFunction)ExtHeapQueue_sizeof, METH_NOARGS,
+     "Size of the heap queue in memory, including native memory allocated, in bytes."},
+    {"start_trace", (PyCFunction)ExtHeapQueue_start_trace, METH_VARARGS,
+     "Record operations done on the heap queue to the given binary trace file, see the replay tool."},
+    {"stop_trace", (PyCFunction)ExtHeapQueue_stop_trace, METH_NOARGS,
+     "Stop recording operations and close the trace file."},
+    {"set_sample_rate", (PyCFunction)ExtHeapQueue_set_sample_rate, METH_VARARGS,
+     "Sample latencies of one of every rate operations and sift path lengths, 0 disables sampling."},
+    {"latency_stats", (PyCFunction)ExtHeapQueue_latency_stats, METH_NOARGS,
+     "Return a dict with histograms of operations sampled, None if sampling is disabled."},
+    {"reset_latency_stats", (PyCFunction)ExtHeapQueue_reset_latency_stats, METH_NOARGS,
+     "Remove all the values recorded in histograms of operations sampled."},
+#ifdef EHEAPQ_STATS
+    {"stats", (PyCFunction)ExtHeapQueue_stats, METH_NOARGS,
+     "Return a dict with counters of operations done since the heap was created or the counters were reset."},
+    {"reset_stats", (PyCFunction)ExtHeapQueue_reset_stats, METH_NOARGS,
+     "Reset counters of operations to zero."},
+#endif
+    {NULL}};
+
+static PyGetSetDef ExtHeapQueue_getsetters[] = {
+    {"size", (getter)ExtHeapQueue_getsize, NULL, "Max size of the heap.", NULL},
+    {"key_width", (getter)ExtHeapQueue_getkeywidth, NULL, "Number of components of keys, compared lexicographically.", NULL},
+    {"order", (getter)ExtHeapQueue_getorder, NULL, "Order of items, 'min' if the smallest key is on top, 'max' otherwise.", NULL},
+    {NULL} /* Sentinel */
+};
+
+/**
+ * A streaming top-k reducer - keeps k items with the largest keys seen. Items
+ * with a key not larger than the key of the smallest item kept (the admission
+ * threshold) are rejected without touching the heap or any of its maps.
+ *
+ * The layout starts with ExtHeapQueue so that the read-only heap operations
+ * are shared with ExtHeapQueue.
+ */
+typedef struct {
+  ExtHeapQueue base;
+  double threshold;  /**< Key of the top item, valid only if the heap is full. */
+} ExtTopK;
+
+static PyObject *ExtTopK_new(PyTypeObject *type, PyObject *args,
+                             PyObject *kwds) {
+  ExtTopK *self;
+  self = (ExtTopK *)type->tp_alloc(type, 0);
+  self->base.heap = new PyObjectHeap(0);
+  self->base.trace = NULL;
+  self->base.modifications = 0;
+  self->threshold = -std::numeric_limits<double>::infinity();
+  return (PyObject *)self;
+}
+
+static int ExtTopK_init(ExtTopK *self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"k", NULL};
+  size_t k;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "k", kwlist, &k))
+    return -1;
+
+  ExtHeapQueue_clear(&self->base);
+  self->base.heap->set_size(k);
+  self->base.heap->reserve(k);
+  self->base.heap->comp.reserve_keys(k);
+  return 0;
+}
+
+/**
+ * Offer the given item to the top-k, the key is compared to the cached threshold first.
+ *
+ * @result 1 if the item was admitted, 0 if rejected, -1 on error.
+ */
+static int ExtTopK_offer(ExtTopK *self, double key, PyObject *item) {
+  PyObjectHeap *heap = self->base.heap;
+
+  // NaN is not ordered, once it became the threshold every other key would be rejected.
+  if (std::isnan(key)) {
+    PyErr_SetString(PyExc_ValueError, "keys cannot be NaN");
+    return -1;
+  }
+
+  if (heap->get_length() == heap->get_size() && (heap->get_size() == 0 || !(key > self->threshold)))
+    return 0;
+
+  if (!heap->comp.add_key(item, &key)) {
+    PyErr_SetString(PyExc_ValueError, EHeapQAlreadyPresentExc.what());
+    return -1;
+  }
+
+  Py_INCREF(item);
+
+  std::function<void(PyObject *)> f = std::bind(&PyObjectCompare::removed_callback, &heap->comp, std::placeholders::_1);
+  try {
+    heap->push(item, f);
+  } catch (EHeapQAlreadyPresent &exc) {
+    heap->comp.del_key(item);
+    Py_DECREF(item);
+    PyErr_SetString(PyExc_ValueError, exc.what());
+    return -1;
+  }
+
+  self->base.modifications++;
+  if (heap->get_length() == heap->get_size())
+    self->threshold = heap->comp.key_map->at(heap->get_top()).first;
+
+  return 1;
+}
+
+static PyObject *ExtTopK_push(ExtTopK *self, PyObject *args) {
+  PyObject *item;
+  double key;
+
+  if (!PyArg_ParseTuple(args, "dO", &key, &item))
+    return NULL;
+
+  int admitted = ExtTopK_offer(self, key, item);
+  if (admitted < 0)
+    return NULL;
+
+  return PyBool_FromLong(admitted);
+}
+
+static PyObject *ExtTopK_offer_many(ExtTopK *self, PyObject *args) {
+  PyObject *keys, *items;
+  size_t admitted = 0;
+
+  if (!PyArg_ParseTuple(args, "OO", &keys, &items))
+    return NULL;
+
+  PyObject *items_seq = PySequence_Fast(items, "items have to be a sequence");
+  if (items_seq == NULL)
+    return NULL;
+
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(items_seq);
+  PyObject **items_arr = PySequence_Fast_ITEMS(items_seq);
+
+  if (PyObject_CheckBuffer(keys)) {
+    Py_buffer view;
+
+    if (PyObject_GetBuffer(keys, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+      Py_DECREF(items_seq);
+      return NULL;
+    }
+
+    char format = ExtHeapQueue_key_buffer_format(view.format);
+    if (format == 0 || (size_t)view.itemsize != (format == 'd' ? sizeof(double) : sizeof(float))) {
+      PyBuffer_Release(&view);
+      Py_DECREF(items_seq);
+      PyErr_SetString(PyExc_TypeError, "key buffer has to store floats or doubles");
+      return NULL;
+    }
+
+    if (view.len / view.itemsize != count) {
+      PyBuffer_Release(&view);
+      Py_DECREF(items_seq);
+      PyErr_SetString(PyExc_ValueError, "keys and items have to be of the same length");
+      return NULL;
+    }
+
+    for (Py_ssize_t i = 0; i < count; i++) {
+      double key = format == 'd' ? ((double *)view.buf)[i] : ((float *)view.buf)[i];
+      int result = ExtTopK_offer(self, key, items_arr[i]);
+
+      if (result < 0) {
+        PyBuffer_Release(&view);
+        Py_DECREF(items_seq);
+        return NULL;
+      }
+
+      admitted += result;
+    }
+
+    PyBuffer_Release(&view);
+    Py_DECREF(items_seq);
+    return PyLong_FromSize_t(admitted);
+  }
+
+  PyObject *keys_seq = PySequence_Fast(keys, "keys have to be a sequence or a buffer of floats");
+  if (keys_seq == NULL) {
+    Py_DECREF(items_seq);
+    return NULL;
+  }
+
+  if (PySequence_Fast_GET_SIZE(keys_seq) != count) {
+    Py_DECREF(keys_seq);
+    Py_DECREF(items_seq);
+    PyErr_SetString(PyExc_ValueError, "keys and items have to be of the same length");
+    return NULL;
+  }
+
+  for (Py_ssize_t i = 0; i < count; i++) {
+    double key = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(keys_seq, i));
+    int result = (key == -1.0 && PyErr_Occurred()) ? -1 : ExtTopK_offer(self, key, items_arr[i]);
+
+    if (result < 0) {
+      Py_DECREF(keys_seq);
+      Py_DECREF(items_seq);
+      return NULL;
+    }
+
+    admitted += result;
+  }
+
+  Py_DECREF(keys_seq);
+  Py_DECREF(items_seq);
+  return PyLong_FromSize_t(admitted);
+}
+
+static PyObject *ExtTopK_getthreshold(ExtTopK *self) {
+  PyObjectHeap *heap = self->base.heap;
+
+  if (heap->get_length() < heap->get_size())
+    return PyFloat_FromDouble(-std::numeric_limits<double>::infinity());
+
+  return PyFloat_FromDouble(self->threshold);
+}
+
+static PyMethodDef ExtTopK_methods[] = {
+    {"push", (PyCFunction)ExtTopK_push, METH_VARARGS,
+     "Offer item with the given key, return True if the item was admitted to the top-k."},
+    {"offer_many", (PyCFunction)ExtTopK_offer_many, METH_VARARGS,
+     "Offer items with keys passed as a buffer or a sequence of floats, return number of items admitted."},
+    {"items", (PyCFunction)ExtHeapQueue_items, METH_NOARGS,
+     "Return a list containing objects stored in the top-k, not sorted."},
+    {"sorted_items", (PyCFunction)ExtHeapQueue_sorted_items, METH_VARARGS | METH_KEYWORDS,
+     "Return a list of (key, item) tuples or items sorted by key, at most limit of them. The top-k is untouched."},
+    {"pop", (PyCFunction)ExtHeapQueue_pop, METH_NOARGS,
+     "Pops the item with the smallest key from the top-k."},
+    {"pop_with_key", (PyCFunction)ExtHeapQueue_pop_with_key, METH_NOARGS,
+     "Pops the item with the smallest key from the top-k, returns a (key, item) tuple."},
+    {"get_key", (PyCFunction)ExtHeapQueue_get_key, METH_VARARGS,
+     "Return key of the given item, looked up by identity, or default if the item is not kept."},
+    {"get_top", (PyCFunction)ExtHeapQueue_top, METH_NOARGS,
+     "Gets the item with the smallest key from the top-k, the top-k is untouched."},
+    {"clear", (PyCFunction)ExtHeapQueue_queue_clear, METH_NOARGS,
+     "Clear the top-k."},
+    {"shrink", (PyCFunction)ExtHeapQueue_shrink, METH_NOARGS,
+     "Release memory not needed for items currently stored."},
+    {"memory_stats", (PyCFunction)ExtHeapQueue_memory_stats, METH_NOARGS,
+     "Return a dict with memory used by the top-k, in bytes."},
+    {"__sizeof__", (PyCFunction)ExtHeapQueue_sizeof, METH_NOARGS,
+     "Size of the top-k in memory, including native memory allocated, in bytes."},
+    {"set_sample_rate", (PyCFunction)ExtHeapQueue_set_sample_rate, METH_VARARGS,
+     "Sample latencies of one of every rate operations and sift path lengths, 0 disables sampling."},
+    {"latency_stats", (PyCFunction)ExtHeapQueue_latency_stats, METH_NOARGS,
+     "Return a dict with histograms of operations sampled, None if sampling is disabled."},
+    {"reset_latency_stats", (PyCFunction)ExtHeapQueue_reset_latency_stats, METH_NOARGS,
+     "Remove all the values recorded in histograms of operations sampled."},
+#ifdef EHEAPQ_STATS
+    {"stats", (PyCFunction)ExtHeapQueue_stats, METH_NOARGS,
+     "Return a dict with counters of operations done since the top-k was created or the counters were reset."},
+    {"reset_stats", (PyCFunction)ExtHeapQueue_reset_stats, METH_NOARGS,
+     "Reset counters of operations to zero."},
+#endif
+    {NULL}};
+
+static PyGetSetDef ExtTopK_getsetters[] = {
+    {"k", (getter)ExtHeapQueue_getsize, NULL, "Number of items kept.", NULL},
+    {"threshold", (getter)ExtTopK_getthreshold, NULL,
+     "Key an item has to exceed to be admitted, -inf if the top-k is not full yet.", NULL},
+    {NULL} /* Sentinel */
+};
+
+/**
+ * Read keys passed as a buffer or a sequence of floats.
+ *
+ * @param count Number of keys expected.
+ * @param result Set to keys read.
+ * @result 0 on success, -1 on error.
+ */
+static int fext_parse_keys(PyObject *keys, Py_ssize_t count, std::vector<double> &result) {
+  result.resize(count);
+
+  if (PyObject_CheckBuffer(keys)) {
+    Py_buffer view;
+
+    if (PyObject_GetBuffer(keys, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+      return -1;
+
+    char format = ExtHeapQueue_key_buffer_format(view.format);
+    if (format == 0 || (size_t)view.itemsize != (format == 'd' ? sizeof(double) : sizeof(float))) {
+      PyBuffer_Release(&view);
+      PyErr_SetString(PyExc_TypeError, "key buffer has to store floats or doubles");
+      return -1;
+    }
+
+    if (view.len / view.itemsize != count) {
+      PyBuffer_Release(&view);
+      PyErr_SetString(PyExc_ValueError, "keys and items have to be of the same length");
+      return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < count; i++)
+      result[i] = format == 'd' ? ((double *)view.buf)[i] : ((float *)view.buf)[i];
+
+    PyBuffer_Release(&view);
+  } else {
+    PyObject *keys_seq = PySequence_Fast(keys, "keys have to be a sequence or a buffer of floats");
+    if (keys_seq == NULL)
+      return -1;
+
+    if (PySequence_Fast_GET_SIZE(keys_seq) != count) {
+      Py_DECREF(keys_seq);
+      PyErr_SetString(PyExc_ValueError, "keys and items have to be of the same length");
+      return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < count; i++) {
+      result[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(keys_seq, i));
+      if (result[i] == -1.0 && PyErr_Occurred()) {
+        Py_DECREF(keys_seq);
+        return -1;
+      }
+    }
+
+    Py_DECREF(keys_seq);
+  }
+
+  // NaN keys are not ordered, selection and the heap need a strict weak ordering.
+  for (Py_ssize_t i = 0; i < count; i++) {
+    if (std::isnan(result[i])) {
+      PyErr_SetString(PyExc_ValueError, "keys cannot be NaN");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Compares positions of keys passed to nsmallest and nlargest - a is worse than b. Ties are broken by
+ * position so that the result is the same as of a stable sort, as in heapq.
+ */
+struct FextSelectCompare {
+  const double *keys = NULL;
+  bool largest = false;
+
+  bool operator()(size_t a, size_t b) const {
+    if (this->keys[a] != this->keys[b])
+      return this->largest ? this->keys[a] < this->keys[b] : this->keys[a] > this->keys[b];
+
+    return a > b;
+  }
+};
+
+/**
+ * A bounded heap of positions with the worst position kept on top, evicted by pushes to the full heap.
+ */
+typedef EHeapQ<size_t, FextSelectCompare, std::hash<size_t>, std::allocator<size_t>,
+               EHeapQFlatIndex<size_t, std::hash<size_t>, uint32_t, std::allocator<size_t>>> FextSelectHeap;
+
+/**
+ * Select items with the n best keys, sorted from the best one.
+ *
+ * @param largest If true, larger keys are better, smaller keys otherwise.
+ */
+static PyObject *fext_select(PyObject *args, bool largest) {
+  PyObject *keys, *items, *result;
+  std::vector<double> key_values;
+  std::vector<size_t> selected;
+  FextSelectCompare worse;
+  Py_ssize_t n;
+
+  if (!PyArg_ParseTuple(args, "nOO", &n, &keys, &items))
+    return NULL;
+
+  PyObject *items_seq = PySequence_Fast(items, "items have to be a sequence");
+  if (items_seq == NULL)
+    return NULL;
+
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(items_seq);
+  if (fext_parse_keys(keys, count, key_values) < 0) {
+    Py_DECREF(items_seq);
+    return NULL;
+  }
+
+  n = std::max((Py_ssize_t)0, std::min(n, count));
+  worse.keys = key_values.data();
+  worse.largest = largest;
+  auto better = [&worse](size_t a, size_t b) { return worse(b, a); };
+
+  if ((size_t)n * FEXT_SELECT_FRACTION >= (size_t)count) {
+    selected.resize(count);
+    for (Py_ssize_t i = 0; i < count; i++)
+      selected[i] = i;
+
+    std::nth_element(selected.begin(), selected.begin() + n, selected.end(), better);
+    selected.resize(n);
+    std::sort(selected.begin(), selected.end(), better);
+  } else if (n > 0) {
+    FextSelectHeap heap(n);
+
+    heap.comp = worse;
+    heap.reserve(n);
+    for (Py_ssize_t i = 0; i < count; i++) {
+      // Keys not better than the worst key kept are rejected without touching the index.
+      if (heap.get_length() == (size_t)n && !worse(heap.get_top(), i))
+        continue;
+
+      heap.push(i);
+    }
+
+    selected.resize(n);
+    for (Py_ssize_t i = n; i > 0; i--)
+      selected[i - 1] = heap.pop();
+  }
+
+  if (!(result = PyList_New(n))) {
+    Py_DECREF(items_seq);
+    return NULL;
+  }
+
+  for (Py_ssize_t i = 0; i < n; i++) {
+    PyObject *item = PySequence_Fast_GET_ITEM(items_seq, selected[i]);
+    Py_INCREF(item);
+    PyList_SET_ITEM(result, i, item);
+  }
+
+  Py_DECREF(items_seq);
+  return result;
+}
+
+static PyObject *fext_nsmallest(PyObject *module, PyObject *args) { return fext_select(args, false); }
+
+static PyObject *fext_nlargest(PyObject *module, PyObject *args) { return fext_select(args, true); }
+
+static PyMethodDef eheapq_methods[] = {
+    {"nsmallest", (PyCFunction)fext_nsmallest, METH_VARARGS,
+     "Return a list of n items with the smallest keys passed as a buffer or a sequence of floats, sorted by key. "
+     "Items with equal keys are kept in the order given, as in heapq.nsmallest."},
+    {"nlargest", (PyCFunction)fext_nlargest, METH_VARARGS,
+     "Return a list of n items with the largest keys passed as a buffer or a sequence of floats, sorted by key "
+     "in descending order. Items with equal keys are kept in the order given, as in heapq.nlargest."},
+    {NULL}};
+
+PyMODINIT_FUNC PyInit_eheapq(void) {
+  ExtMinHeapQueueType.tp_name = "eheapq.ExtHeapQueue";
+  ExtMinHeapQueueType.tp_doc = "Extended heap queue algorithm.";
+  ExtMinHeapQueueType.tp_basicsize = sizeof(ExtHeapQueue);
+  ExtMinHeapQueueType.tp_itemsize = 0;
+  ExtMinHeapQueueType.tp_flags =
+      Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC;
+  ExtMinHeapQueueType.tp_new = ExtHeapQueue_new;
+  ExtMinHeapQueueType.tp_as_sequence = ExtHeapQueue_sequence_methods;
+  ExtHeapQueue_sequence_methods->sq_contains = ExtHeapQueue_contains;
+  ExtHeapQueue_number_methods.nb_inplace_or = ExtHeapQueue_inplace_or;
+  ExtMinHeapQueueType.tp_as_number = &ExtHeapQueue_number_methods;
+  ExtMinHeapQueueType.tp_init = (initproc)ExtHeapQueue_init;
+  ExtMinHeapQueueType.tp_dealloc = (destructor)ExtHeapQueue_dealloc;
+  ExtMinHeapQueueType.tp_traverse = (traverseproc)ExtHeapQueue_traverse;
+  ExtMinHeapQueueType.tp_clear = (inquiry)ExtHeapQueue_clear;
+  ExtMinHeapQueueType.tp_methods = ExtHeapQueue_methods;
+  ExtMinHeapQueueType.tp_getset = ExtHeapQueue_getsetters;
+
+  ExtHeapQueueSortedIteratorType.tp_name = "eheapq.ExtHeapQueueSortedIterator";
+  ExtHeapQueueSortedIteratorType.tp_doc = "Iterator over items of a heap queue in the sorted order.";
+  ExtHeapQueueSortedIteratorType.tp_basicsize = sizeof(ExtHeapQueueSortedIterator);
+  ExtHeapQueueSortedIteratorType.tp_itemsize = 0;
+  ExtHeapQueueSortedIteratorType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC;
+  ExtHeapQueueSortedIteratorType.tp_dealloc = (destructor)ExtHeapQueueSortedIterator_dealloc;
+  ExtHeapQueueSortedIteratorType.tp_traverse = (traverseproc)ExtHeapQueueSortedIterator_traverse;
+  ExtHeapQueueSortedIteratorType.tp_clear = (inquiry)ExtHeapQueueSortedIterator_clear;
+  ExtHeapQueueSortedIteratorType.tp_iter = PyObject_SelfIter;
+  ExtHeapQueueSortedIteratorType.tp_iternext = (iternextfunc)ExtHeapQueueSortedIterator_next;
+
+  static PyTypeObject ExtTopKType = {PyVarObject_HEAD_INIT(NULL, 0)};
+  ExtTopKType.tp_name = "eheapq.ExtTopK";
+  ExtTopKType.tp_doc = "Streaming reducer keeping k items with the largest keys.";
+  ExtTopKType.tp_basicsize = sizeof(ExtTopK);
+  ExtTopKType.tp_itemsize = 0;
+  ExtTopKType.tp_flags =
+      Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC;
+  ExtTopKType.tp_new = ExtTopK_new;
+  ExtTopKType.tp_as_sequence = ExtHeapQueue_sequence_methods;
+  ExtTopKType.tp_init = (initproc)ExtTopK_init;
+  ExtTopKType.tp_dealloc = (destructor)ExtHeapQueue_dealloc;
+  ExtTopKType.tp_traverse = (traverseproc)ExtHeapQueue_traverse;
+  ExtTopKType.tp_clear = (inquiry)ExtHeapQueue_clear;
+  ExtTopKType.tp_methods = ExtTopK_methods;
+  ExtTopKType.tp_getset = ExtTopK_getsetters;
+
+  static PyModuleDef eheapq = {PyModuleDef_HEAD_INIT};
+  eheapq.m_name = "eheapq";
+  eheapq.m_doc = "Implementation of extended heap queues.";
+  eheapq.m_size = -1;
+  eheapq.m_methods = eheapq_methods;
+
+  PyObject *m;
+  if (PyType_Ready(&ExtMinHeapQueueType) < 0)
+    return NULL;
+
+  if (PyType_Ready(&ExtTopKType) < 0)
+    return NULL;
+
+  if (PyType_Ready(&ExtHeapQueueSortedIteratorType) < 0)
     return NULL;
 
   m = PyModule_Create(&eheapq);
@@ -360,5 +2110,12 @@ PyMODINIT_FUNC PyInit_eheapq(void) {
     return NULL;
   }
 
+  Py_INCREF(&ExtTopKType);
+  if (PyModule_AddObject(m, "ExtTopK", (PyObject *)&ExtTopKType) < 0) {
+    Py_DECREF(&ExtTopKType);
+    Py_DECREF(m);
+    return NULL;
+  }
+
   return m;
 }
@@ -27,65 +27,963 @@
 
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <exception>
 #include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
 #include <unordered_map>
 #include <vector>
 
+/*
+ * USDT probes (provider fext) for bpftrace, perf and SystemTap, available if
+ * sys/sdt.h is installed (systemtap-sdt-devel) unless EHEAPQ_NO_PROBES is
+ * defined. A probe is a single nop instruction when no tracer is attached,
+ * arguments are only computed into registers.
+ */
+#if !defined(EHEAPQ_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define EHEAPQ_PROBES 1
+#endif
+#endif
+
+#ifdef EHEAPQ_PROBES
+#define EHEAPQ_PROBE1(name, a) DTRACE_PROBE1(fext, name, a)
+#define EHEAPQ_PROBE2(name, a, b) DTRACE_PROBE2(fext, name, a, b)
+#define EHEAPQ_PROBE3(name, a, b, c) DTRACE_PROBE3(fext, name, a, b, c)
+#else
+// Arguments are not evaluated, sizeof keeps variables computed for probes used.
+#define EHEAPQ_PROBE1(name, a) ((void)sizeof(a))
+#define EHEAPQ_PROBE2(name, a, b) ((void)sizeof((a), (b)))
+#define EHEAPQ_PROBE3(name, a, b, c) ((void)sizeof((a), (b), (c)))
+#endif
+
 const size_t EHEAPQ_DEFAULT_SIZE = std::numeric_limits<size_t>::max();
 
-/**
- * A base class for deriving exceptions used in the heap queue.
- */
-class EHeapQException : public std::exception {};
+/**
+ * A base class for deriving exceptions used in the heap queue.
+ */
+class EHeapQException : public std::exception {};
+
+/**
+ * An exception raised when the heap is empty.
+ */
+class EHeapQEmpty : public EHeapQException {
+public:
+  virtual const char *what() const throw() { return "the heap is empty"; }
+} EHeapQEmptyExc;
+
+/**
+ * An exception when the given item was not found in the heap.
+ */
+class EHeapQNotFound : public EHeapQException {
+public:
+  virtual const char *what() const throw() {
+    return "the given item was not found in the heap";
+  }
+} EHeapQNotFoundExc;
+
+/**
+ * An exception raised when the given item is not present in the heap.
+ */
+class EHeapQAlreadyPresent : public EHeapQException {
+public:
+  virtual const char *what() const throw() {
+    return "the given item is already present in the heap";
+  }
+} EHeapQAlreadyPresentExc;
+
+/**
+ * An exception raised when there is no last item stored.
+ */
+class EHeapQNoLast : public EHeapQException {
+public:
+  virtual const char *what() const throw() {
+    return "no record for the last item";
+  }
+} EHeapQNoLastExc;
+
+/**
+ * An exception raised when accessing elements outside of heap.
+ */
+class EHeapQIndexError : public EHeapQException {
+public:
+  virtual const char *what() const throw() {
+    return "index out of range";
+  }
+} EHeapQIndexErrorExc;
+
+/**
+ * Maximum size of a block served by EHeapQPool, larger allocations are passed to the raw allocator.
+ */
+const size_t EHEAPQ_POOL_MAX_BLOCK = 256;
+
+/**
+ * Granularity of blocks served by EHeapQPool.
+ */
+const size_t EHEAPQ_POOL_MIN_BLOCK = sizeof(void *) * 2;
+
+/**
+ * Size of the first chunk allocated by EHeapQPool, next chunks double in size up to EHEAPQ_POOL_MAX_CHUNK.
+ */
+const size_t EHEAPQ_POOL_MIN_CHUNK = 1024;
+const size_t EHEAPQ_POOL_MAX_CHUNK = 1024 * 1024;
+
+/**
+ * Raw memory allocator used by EHeapQPool and EHeapQPoolAllocator - the operator new.
+ */
+struct EHeapQNewAllocator {
+  static void *allocate(size_t bytes) { return ::operator new(bytes); }
+  static void deallocate(void *ptr, size_t bytes) noexcept { ::operator delete(ptr); }
+};
+
+/**
+ * Statistics of memory held by a pool.
+ */
+struct EHeapQPoolStats {
+  size_t reserved;  /**< Bytes of chunks allocated. */
+  size_t used;      /**< Bytes of blocks in use. */
+  size_t arrays;    /**< Bytes of arrays allocated directly by allocators using the pool. */
+};
+
+/**
+ * A pool of fixed-size memory blocks. Blocks are carved from chunks and
+ * recycled using a free list per block size so that allocation and
+ * deallocation of hash map nodes does not call malloc/free in a steady state.
+ * All the chunks are released at once by release().
+ */
+template <class Raw = EHeapQNewAllocator> class EHeapQPool {
+public:
+  EHeapQPool() {
+    std::fill(this->free_lists, this->free_lists + EHEAPQ_POOL_MAX_BLOCK / EHEAPQ_POOL_ALIGN, (FreeBlock *)NULL);
+    std::fill(this->free_counts, this->free_counts + EHEAPQ_POOL_MAX_BLOCK / EHEAPQ_POOL_ALIGN, 0);
+    this->chunks = NULL;
+    this->chunk_cur = NULL;
+    this->chunk_end = NULL;
+    this->chunk_size = EHEAPQ_POOL_MIN_CHUNK;
+    this->live = 0;
+    this->stats = {0, 0, 0};
+  }
+
+  ~EHeapQPool() { this->free_chunks(); }
+
+  /**
+   * Allocate a block of the given size.
+   *
+   * @param bytes Size of the block, at most EHEAPQ_POOL_MAX_BLOCK.
+   */
+  void *allocate(size_t bytes) {
+    size_t cls = this->size_class(bytes);
+    FreeBlock *block = this->free_lists[cls];
+
+    bytes = (cls + 1) * EHEAPQ_POOL_ALIGN;
+
+    if (block) {
+      this->free_lists[cls] = block->next;
+      this->free_counts[cls]--;
+    } else {
+      if (this->chunk_cur + bytes > this->chunk_end)
+        this->new_chunk(bytes);
+
+      block = (FreeBlock *)this->chunk_cur;
+      this->chunk_cur += bytes;
+    }
+
+    this->live++;
+    this->stats.used += bytes;
+    return block;
+  }
+
+  /**
+   * Return a block allocated by allocate() to the pool.
+   *
+   * @param ptr The block to be returned.
+   * @param bytes Size of the block as passed to allocate().
+   */
+  void deallocate(void *ptr, size_t bytes) noexcept {
+    size_t cls = this->size_class(bytes);
+    FreeBlock *block = (FreeBlock *)ptr;
+
+    block->next = this->free_lists[cls];
+    this->free_lists[cls] = block;
+    this->free_counts[cls]++;
+    this->live--;
+    this->stats.used -= (cls + 1) * EHEAPQ_POOL_ALIGN;
+  }
+
+  /**
+   * Allocate an array, not served from the pool but accounted in the pool statistics.
+   */
+  void *allocate_array(size_t bytes) {
+    void *result = Raw::allocate(bytes);
+    this->stats.arrays += bytes;
+    return result;
+  }
+
+  /**
+   * Deallocate an array allocated by allocate_array().
+   */
+  void deallocate_array(void *ptr, size_t bytes) noexcept {
+    Raw::deallocate(ptr, bytes);
+    this->stats.arrays -= bytes;
+  }
+
+  /**
+   * Make sure the given number of blocks can be allocated without allocating another chunk. Free blocks are used
+   * first - node sizes are estimated from above, so free blocks of smaller sizes are counted as well.
+   *
+   * @param n Number of blocks.
+   * @param bytes Size of a block, at most EHEAPQ_POOL_MAX_BLOCK.
+   */
+  void reserve(size_t n, size_t bytes) {
+    size_t cls = this->size_class(bytes);
+
+    for (size_t i = 0; i <= cls && n > 0; i++)
+      n -= std::min(n, this->free_counts[i]);
+
+    bytes = n * (cls + 1) * EHEAPQ_POOL_ALIGN;
+    if (this->chunk_cur + bytes <= this->chunk_end)
+      return;
+
+    this->new_chunk(bytes);
+  }
+
+  /**
+   * Release all the chunks at once. Nothing is done if there are blocks still in use.
+   */
+  void release() noexcept {
+    if (this->live > 0)
+      return;
+
+    this->free_chunks();
+    std::fill(this->free_lists, this->free_lists + EHEAPQ_POOL_MAX_BLOCK / EHEAPQ_POOL_ALIGN, (FreeBlock *)NULL);
+    std::fill(this->free_counts, this->free_counts + EHEAPQ_POOL_MAX_BLOCK / EHEAPQ_POOL_ALIGN, 0);
+    this->chunk_cur = NULL;
+    this->chunk_end = NULL;
+    this->chunk_size = EHEAPQ_POOL_MIN_CHUNK;
+  }
+
+  /**
+   * Get statistics of memory held by the pool.
+   */
+  EHeapQPoolStats get_stats() const noexcept { return this->stats; }
+
+private:
+  static const size_t EHEAPQ_POOL_ALIGN = EHEAPQ_POOL_MIN_BLOCK;
+
+  struct FreeBlock {
+    FreeBlock *next;  /**< The next free block of the same size. */
+  };
+
+  struct Chunk {
+    Chunk *next;      /**< The previously allocated chunk. */
+    size_t size;      /**< Size of the chunk, including this header. */
+  };
+
+  FreeBlock *free_lists[EHEAPQ_POOL_MAX_BLOCK / EHEAPQ_POOL_ALIGN];  /**< Free blocks, one list per size class. */
+  size_t free_counts[EHEAPQ_POOL_MAX_BLOCK / EHEAPQ_POOL_ALIGN];     /**< Number of blocks in each free list. */
+  Chunk *chunks;          /**< Chunks allocated, blocks are carved from the first one. */
+  char *chunk_cur;        /**< The next free byte in the current chunk. */
+  char *chunk_end;        /**< The end of the current chunk. */
+  size_t chunk_size;      /**< Size of the next chunk allocated. */
+  size_t live;            /**< Number of blocks in use. */
+  EHeapQPoolStats stats;  /**< Statistics of memory held. */
+
+  static size_t size_class(size_t bytes) noexcept { return (bytes - 1) / EHEAPQ_POOL_ALIGN; }
+
+  void new_chunk(size_t bytes) {
+    size_t header = (sizeof(Chunk) + EHEAPQ_POOL_ALIGN - 1) / EHEAPQ_POOL_ALIGN * EHEAPQ_POOL_ALIGN;
+    size_t size = std::max(this->chunk_size, header + bytes);
+    Chunk *chunk = (Chunk *)Raw::allocate(size);
+
+    chunk->next = this->chunks;
+    chunk->size = size;
+    this->chunks = chunk;
+    this->chunk_cur = (char *)chunk + header;
+    this->chunk_end = (char *)chunk + size;
+    this->chunk_size = std::min(this->chunk_size * 2, EHEAPQ_POOL_MAX_CHUNK);
+    this->stats.reserved += size;
+  }
+
+  void free_chunks() noexcept {
+    while (this->chunks) {
+      Chunk *next = this->chunks->next;
+      Raw::deallocate(this->chunks, this->chunks->size);
+      this->chunks = next;
+    }
+
+    this->stats.reserved = 0;
+  }
+};
+
+/**
+ * An allocator serving single objects (hash map nodes) from a pool. Each
+ * default constructed allocator creates its own pool, copies (including
+ * copies rebound to another type) share it - hence each heap queue has its
+ * own pool. Arrays are allocated using the raw allocator directly.
+ */
+template <class T, class Raw = EHeapQNewAllocator> class EHeapQPoolAllocator {
+public:
+  typedef T value_type;
+
+  template <class U> struct rebind {
+    typedef EHeapQPoolAllocator<U, Raw> other;
+  };
+
+  std::shared_ptr<EHeapQPool<Raw>> pool;  /**< The pool shared by copies of the allocator. */
+
+  EHeapQPoolAllocator() : pool(std::make_shared<EHeapQPool<Raw>>()) {}
+
+  template <class U>
+  EHeapQPoolAllocator(const EHeapQPoolAllocator<U, Raw> &other) noexcept : pool(other.pool) {}
+
+  T *allocate(size_t n) {
+    if (n == 1 && sizeof(T) <= EHEAPQ_POOL_MAX_BLOCK)
+      return (T *)this->pool->allocate(sizeof(T));
+
+    return (T *)this->pool->allocate_array(n * sizeof(T));
+  }
+
+  void deallocate(T *ptr, size_t n) noexcept {
+    if (n == 1 && sizeof(T) <= EHEAPQ_POOL_MAX_BLOCK)
+      this->pool->deallocate(ptr, sizeof(T));
+    else
+      this->pool->deallocate_array(ptr, n * sizeof(T));
+  }
+
+  /**
+   * Preallocate memory for the given number of single objects.
+   *
+   * @param n Number of objects.
+   * @param bytes Size of an object.
+   */
+  void reserve(size_t n, size_t bytes) {
+    if (bytes <= EHEAPQ_POOL_MAX_BLOCK)
+      this->pool->reserve(n, bytes);
+  }
+
+  /**
+   * Release all the memory held by the pool, if no block is in use.
+   */
+  void release() noexcept { this->pool->release(); }
+
+  template <class U> bool operator==(const EHeapQPoolAllocator<U, Raw> &other) const noexcept {
+    return this->pool == other.pool;
+  }
+
+  template <class U> bool operator!=(const EHeapQPoolAllocator<U, Raw> &other) const noexcept {
+    return this->pool != other.pool;
+  }
+};
+
+/**
+ * Preallocate memory for n single objects of the given size, no-op for allocators other than EHeapQPoolAllocator.
+ */
+template <class Allocator> void eheapq_allocator_reserve(Allocator &allocator, size_t n, size_t bytes) {}
+
+template <class T, class Raw> void eheapq_allocator_reserve(EHeapQPoolAllocator<T, Raw> &allocator, size_t n, size_t bytes) {
+  allocator.reserve(n, bytes);
+}
+
+/**
+ * Release memory held by the given allocator, no-op for allocators other than EHeapQPoolAllocator.
+ */
+template <class Allocator> void eheapq_allocator_release(Allocator &allocator) noexcept {}
+
+template <class T, class Raw> void eheapq_allocator_release(EHeapQPoolAllocator<T, Raw> &allocator) noexcept {
+  allocator.release();
+}
+
+/**
+ * Get statistics of memory held by the given allocator.
+ *
+ * @result false if the allocator does not provide statistics (allocators other than EHeapQPoolAllocator).
+ */
+template <class Allocator> bool eheapq_allocator_stats(const Allocator &allocator, EHeapQPoolStats &stats) noexcept {
+  return false;
+}
+
+template <class T, class Raw>
+bool eheapq_allocator_stats(const EHeapQPoolAllocator<T, Raw> &allocator, EHeapQPoolStats &stats) noexcept {
+  stats = allocator.pool->get_stats();
+  return true;
+}
+
+/**
+ * Memory used by a heap queue, in bytes.
+ */
+struct EHeapQMemoryStats {
+  size_t heap;           /**< Capacity of the heap vector. */
+  size_t index_buckets;  /**< Buckets of the index. */
+  size_t index_nodes;    /**< Nodes of the index. */
+  size_t slack;          /**< Memory held by the pool that is not in use. */
+};
+
+/**
+ * Counters of operations done by a heap queue, maintained only if compiled
+ * with EHEAPQ_STATS defined - otherwise they are compiled out.
+ */
+struct EHeapQStats {
+  uint64_t pushes;         /**< Items pushed by push, pushpop, replace and push_many. */
+  uint64_t pops;           /**< Items taken from the top by pop, pushpop and replace. */
+  uint64_t removes;        /**< Items removed by remove. */
+  uint64_t evictions;      /**< Items not kept when pushing to a full heap - the top or the pushed item. */
+  uint64_t siftups;        /**< Calls of siftup. */
+  uint64_t siftdowns;      /**< Calls of siftdown. */
+  uint64_t comparisons;    /**< Comparisons of items. */
+  uint64_t swaps;          /**< Items moved by one level in sift operations. */
+  uint64_t index_updates;  /**< Insertions, updates and deletions of positions in the index. */
+  uint64_t peak_rescans;   /**< Calls of get_peak that scanned leaves of the heap. */
+};
+
+#ifdef EHEAPQ_STATS
+#define EHEAPQ_COUNT(counter, n) (this->stats.counter += (n))
+#else
+#define EHEAPQ_COUNT(counter, n) ((void)0)
+#endif
+
+/**
+ * Get the level of the given position in the heap - the root is at level 0.
+ */
+static inline size_t eheapq_level(size_t pos) noexcept { return 63 - __builtin_clzll((unsigned long long)pos + 1); }
+
+/**
+ * A histogram of values with HDR-style buckets - values are bucketed by
+ * their power of 2, each power of 2 is split into SUB_BUCKETS linear
+ * buckets. Values smaller than SUB_BUCKETS are counted exactly, the relative
+ * error of larger values is at most 1 / SUB_BUCKETS.
+ */
+class EHeapQHistogram {
+public:
+  static const size_t SUB_BUCKET_BITS = 4;
+  static const size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static const size_t BUCKETS = SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+  EHeapQHistogram() noexcept { this->clear(); }
+
+  /**
+   * Record the given value.
+   */
+  void record(uint64_t value) noexcept {
+    this->counts[bucket(value)]++;
+    this->count++;
+    this->sum += value;
+    this->min = std::min(this->min, value);
+    this->max = std::max(this->max, value);
+  }
+
+  /**
+   * Get the value at the given percentile - the upper bound of the bucket it falls into.
+   *
+   * @param p The percentile, in range [0, 1].
+   * @result The value, 0 if no values were recorded.
+   */
+  uint64_t percentile(double p) const noexcept {
+    uint64_t rank = std::max((uint64_t)1, (uint64_t)(p * this->count + 0.5)), seen = 0;
+
+    for (size_t i = 0; i < BUCKETS && this->count > 0; i++) {
+      seen += this->counts[i];
+      if (seen >= rank)
+        return std::min(this->max, get_bucket_upper(i));
+    }
+
+    return this->count > 0 ? this->max : 0;
+  }
+
+  uint64_t get_count() const noexcept { return this->count; }
+  uint64_t get_sum() const noexcept { return this->sum; }
+  uint64_t get_min() const noexcept { return this->count > 0 ? this->min : 0; }
+  uint64_t get_max() const noexcept { return this->max; }
+
+  /**
+   * Get number of values recorded in the given bucket.
+   */
+  uint64_t get_bucket_count(size_t idx) const noexcept { return this->counts[idx]; }
+
+  /**
+   * Get the largest value counted in the given bucket.
+   */
+  static uint64_t get_bucket_upper(size_t idx) noexcept {
+    if (idx < SUB_BUCKETS)
+      return idx;
+
+    size_t shift = (idx - SUB_BUCKETS) / SUB_BUCKETS;
+    uint64_t lower = (uint64_t)(SUB_BUCKETS + (idx - SUB_BUCKETS) % SUB_BUCKETS) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+  }
+
+  /**
+   * Remove all the values recorded.
+   */
+  void clear() noexcept {
+    std::fill(this->counts, this->counts + BUCKETS, 0);
+    this->count = this->sum = this->max = 0;
+    this->min = std::numeric_limits<uint64_t>::max();
+  }
+
+private:
+  uint64_t counts[BUCKETS];  /**< Number of values recorded per bucket. */
+  uint64_t count;            /**< Number of values recorded. */
+  uint64_t sum;              /**< Sum of values recorded. */
+  uint64_t min;              /**< The smallest value recorded. */
+  uint64_t max;              /**< The largest value recorded. */
+
+  static size_t bucket(uint64_t value) noexcept {
+    if (value < SUB_BUCKETS)
+      return value;
+
+    size_t shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+    return SUB_BUCKETS + shift * SUB_BUCKETS + (value >> shift) - SUB_BUCKETS;
+  }
+};
+
+/**
+ * Operations of a heap queue sampled for latency histograms.
+ */
+enum EHeapQOp {
+  EHEAPQ_OP_PUSH,
+  EHEAPQ_OP_POP,
+  EHEAPQ_OP_PUSHPOP,
+  EHEAPQ_OP_REPLACE,
+  EHEAPQ_OP_REMOVE,
+  EHEAPQ_OP_GET_PEAK,
+  EHEAPQ_OPS
+};
+
+/**
+ * Maximum number of levels an item can move by in a sift operation, plus one.
+ */
+const size_t EHEAPQ_MAX_DEPTH = 64;
+
+/**
+ * Minimum number of items stored for siftup to prefetch grandchildren and index slots ahead of use. Smaller
+ * heaps mostly fit into L2, where prefetches only add instructions (see make bench).
+ */
+#ifndef EHEAPQ_PREFETCH_MIN_LENGTH
+#define EHEAPQ_PREFETCH_MIN_LENGTH 65536
+#endif
+
+/**
+ * Histograms of sampled operations of a heap queue, see EHeapQ::set_sample_rate.
+ */
+struct EHeapQLatencyStats {
+  EHeapQHistogram latency[EHEAPQ_OPS];        /**< Latencies of operations sampled, in nanoseconds. */
+  uint64_t siftup_depths[EHEAPQ_MAX_DEPTH];    /**< Levels items moved down by in siftup calls within operations sampled. */
+  uint64_t siftdown_depths[EHEAPQ_MAX_DEPTH];  /**< Levels items moved up by in siftdown calls within operations sampled. */
+};
+
+/**
+ * An index of positions of items stored in the heap based on std::unordered_map.
+ * Items are looked up by Handle - an iterator to the map that stays valid
+ * until the item is erased.
+ */
+template <class T, class Hash = std::hash<T>, class Allocator = EHeapQPoolAllocator<T>> class EHeapQMapIndex {
+private:
+  typedef typename std::allocator_traits<Allocator>::template rebind_alloc<std::pair<const T, size_t>> MapAllocator;
+  typedef std::unordered_map<T, size_t, Hash, std::equal_to<T>, MapAllocator> Map;
+
+  /**
+   * Estimated size of a node of the map - a pointer to the next node, the value and a hash code possibly cached.
+   */
+  static const size_t EHEAPQ_INDEX_NODE_SIZE = sizeof(void *) + sizeof(typename Map::value_type) + sizeof(size_t);
+
+  Allocator allocator;                      /**< Allocator used for nodes of the map. */
+  const std::vector<T, Allocator> *heap;    /**< The heap vector, items are reinserted from it on shrink. */
+  Map *map;                                 /**< Item to position mapping. */
+
+public:
+  typedef typename Map::iterator Handle;
+
+  /**
+   * Constructor.
+   *
+   * @param heap The heap vector storing items indexed.
+   * @param allocator Allocator used for nodes of the map.
+   */
+  EHeapQMapIndex(const std::vector<T, Allocator> *heap, const Allocator &allocator) : allocator(allocator), heap(heap) {
+    this->map = new Map(0, Hash(), std::equal_to<T>(), MapAllocator(this->allocator));
+  }
+
+  ~EHeapQMapIndex() { delete this->map; }
+
+  /**
+   * Find the given item.
+   *
+   * @param item The item to be found.
+   * @param handle Set to handle of the item if found.
+   * @result true if the item was found, false otherwise.
+   */
+  bool find(const T &item, Handle &handle) {
+    handle = this->map->find(item);
+    return handle != this->map->end();
+  }
+
+  /**
+   * Prefetch memory to be used by find for the given item, a hint only.
+   */
+  void prefetch(const T &item) const noexcept {
+    // Buckets of std::unordered_map are not accessible without loading them, nothing is prefetched.
+  }
+
+  /**
+   * Get position stored for the item with the given handle.
+   */
+  size_t get(Handle handle) const noexcept { return handle->second; }
+
+  /**
+   * Set position of the item with the given handle.
+   */
+  void set(Handle handle, size_t pos) noexcept { handle->second = pos; }
+
+  /**
+   * Insert the given item, stored at the given position.
+   *
+   * @result false if the item is already present in the index, true otherwise.
+   */
+  bool insert(const T &item, size_t pos) {
+    size_t buckets = this->map->bucket_count();
+    bool inserted = this->map->insert({item, pos}).second;
+
+    if (this->map->bucket_count() != buckets)
+      EHEAPQ_PROBE3(rehash, this->map->size(), buckets, this->map->bucket_count());
+
+    return inserted;
+  }
+
+  /**
+   * Erase the item with the given handle.
+   */
+  void erase(Handle handle) { this->map->erase(handle); }
+
+  /**
+   * Remove all the items, memory of nodes is kept for items inserted later.
+   */
+  void clear() { this->map->clear(); }
+
+  /**
+   * Preallocate buckets and nodes for the given number of items.
+   */
+  void reserve(size_t n) {
+    this->map->reserve(n);
+    eheapq_allocator_reserve(this->allocator, n - std::min(n, this->map->size()), EHEAPQ_INDEX_NODE_SIZE);
+  }
+
+  /**
+   * Rebuild the index so that it holds memory only for items currently stored in the heap.
+   */
+  void shrink() {
+    this->clear();
+    eheapq_allocator_release(this->allocator);
+    this->map->rehash(0);
+    this->reserve(this->heap->size());
+
+    for (size_t i = 0; i < this->heap->size(); i++)
+      this->map->insert({this->heap->data()[i], i});
+  }
+
+  /**
+   * Rebuild the index from items stored in the heap vector.
+   */
+  void restore() { this->shrink(); }
+
+  /**
+   * Get memory used by the index. Exact for the pool allocator, nodes are estimated for other allocators.
+   */
+  void get_memory_stats(EHeapQMemoryStats &stats) const noexcept {
+    EHeapQPoolStats pool_stats;
+
+    stats.index_buckets = this->map->bucket_count() * sizeof(void *);
+
+    if (eheapq_allocator_stats(this->allocator, pool_stats)) {
+      stats.index_nodes = pool_stats.used;
+      stats.slack = pool_stats.reserved - pool_stats.used;
+    } else {
+      stats.index_nodes = this->map->size() * (sizeof(void *) + sizeof(typename Map::value_type));
+      stats.slack = 0;
+    }
+  }
+};
+
+/**
+ * Minimum number of slots of EHeapQFlatIndex, a power of two.
+ */
+const size_t EHEAPQ_FLAT_INDEX_MIN_SLOTS = 16;
+
+/**
+ * Operations on an open-addressed table of slots storing positions (of type
+ * Pos) to the heap vector, items are compared directly in the heap - hence an
+ * item has to be stored in the heap at the position recorded whenever it is
+ * looked up. Linear probing is used with backward shift deletion. The number
+ * of slots is a power of two, the home slot is given by the top bits of the
+ * hash (see get_shift).
+ */
+template <class T, class Hash, class Pos> struct EHeapQFlatSlots {
+  static const Pos EMPTY = std::numeric_limits<Pos>::max();  /**< Marker of an empty slot. */
+
+  /**
+   * Get the shift used to compute home slots for the given number of slots.
+   */
+  static unsigned get_shift(size_t slots_count) noexcept {
+    unsigned shift = 64;
+
+    for (size_t n = slots_count; n > 1; n >>= 1)
+      shift--;
+
+    return shift;
+  }
+
+  static size_t home(const T &item, unsigned shift) noexcept {
+    // Fibonacci hashing spreads hashes that are not uniformly distributed (e.g. aligned pointers).
+    return (size_t)(((uint64_t)Hash()(item) * 0x9E3779B97F4A7C15ULL) >> shift);
+  }
+
+  /**
+   * Prefetch the home slot of the given item.
+   */
+  static void prefetch(const Pos *slots, unsigned shift, const T &item) noexcept {
+    __builtin_prefetch(slots + home(item, shift));
+  }
+
+  /**
+   * Find the given item.
+   *
+   * @param handle Set to the slot of the item if found, to the empty slot the item can be inserted to otherwise.
+   * @result true if the item was found, false otherwise.
+   */
+  static bool find(const T *arr, const Pos *slots, size_t slots_count, unsigned shift, const T &item, size_t &handle) {
+    size_t mask = slots_count - 1;
+
+    for (size_t i = home(item, shift);; i = (i + 1) & mask) {
+      handle = i;
+
+      if (slots[i] == EMPTY)
+        return false;
+
+      if (arr[slots[i]] == item)
+        return true;
+    }
+  }
+
+  /**
+   * Erase the given slot. Items following in the probe sequence are shifted back.
+   */
+  static void erase(const T *arr, Pos *slots, size_t slots_count, unsigned shift, size_t handle) noexcept {
+    size_t mask = slots_count - 1;
+    size_t hole = handle;
+
+    for (size_t i = (hole + 1) & mask; slots[i] != EMPTY; i = (i + 1) & mask) {
+      size_t home = EHeapQFlatSlots::home(arr[slots[i]], shift);
+
+      // Move the item to the hole if its home slot is not between the hole and its current slot.
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+        slots[hole] = slots[i];
+        hole = i;
+      }
+    }
+
+    slots[hole] = EMPTY;
+  }
+};
+
+template <class T, class Hash, class Pos> const Pos EHeapQFlatSlots<T, Hash, Pos>::EMPTY;
+
+/**
+ * An open-addressed index of positions of items stored in the heap (see
+ * EHeapQFlatSlots). The load factor is kept at most 1/2, slots are rehashed
+ * into a table twice as large when exceeded.
+ */
+template <class T, class Hash = std::hash<T>, class Pos = uint32_t, class Allocator = EHeapQPoolAllocator<T>>
+class EHeapQFlatIndex {
+private:
+  typedef typename std::allocator_traits<Allocator>::template rebind_alloc<Pos> SlotAllocator;
+  typedef std::vector<Pos, SlotAllocator> SlotVector;
+  typedef EHeapQFlatSlots<T, Hash, Pos> Slots;
+
+  const std::vector<T, Allocator> *heap;  /**< The heap vector storing items indexed. */
+  SlotVector *slots;                      /**< Slots storing positions, the size is a power of two. */
+  size_t count;                           /**< Number of items stored. */
+  unsigned shift;                         /**< Shift used to get the home slot from a hash. */
+
+public:
+  typedef size_t Handle;
+
+  /**
+   * Constructor.
+   *
+   * @param heap The heap vector storing items indexed.
+   * @param allocator Allocator used for slots.
+   */
+  EHeapQFlatIndex(const std::vector<T, Allocator> *heap, const Allocator &allocator) : heap(heap) {
+    this->slots = new SlotVector(EHEAPQ_FLAT_INDEX_MIN_SLOTS, Slots::EMPTY, SlotAllocator(allocator));
+    this->count = 0;
+    this->shift = Slots::get_shift(this->slots->size());
+  }
+
+  ~EHeapQFlatIndex() { delete this->slots; }
+
+  /**
+   * Find the given item.
+   *
+   * @param item The item to be found.
+   * @param handle Set to handle of the item if found.
+   * @result true if the item was found, false otherwise.
+   */
+  bool find(const T &item, Handle &handle) const {
+    return Slots::find(this->heap->data(), this->slots->data(), this->slots->size(), this->shift, item, handle);
+  }
+
+  /**
+   * Prefetch the home slot of the given item.
+   */
+  void prefetch(const T &item) const noexcept { Slots::prefetch(this->slots->data(), this->shift, item); }
+
+  /**
+   * Get position stored for the item with the given handle.
+   */
+  size_t get(Handle handle) const noexcept { return this->slots->data()[handle]; }
+
+  /**
+   * Set position of the item with the given handle.
+   */
+  void set(Handle handle, size_t pos) noexcept { this->slots->data()[handle] = (Pos)pos; }
+
+  /**
+   * Insert the given item, stored at the given position.
+   *
+   * @result false if the item is already present in the index, true otherwise.
+   */
+  bool insert(const T &item, size_t pos) {
+    Handle handle;
+
+    if (pos >= Slots::EMPTY)
+      throw std::length_error("too many items for the flat index");
+
+    if ((this->count + 1) * 2 > this->slots->size())
+      this->rehash(this->slots->size() * 2);
+
+    if (this->find(item, handle))
+      return false;
 
-/**
- * An exception raised when the heap is empty.
- */
-class EHeapQEmpty : public EHeapQException {
-public:
-  virtual const char *what() const throw() { return "the heap is empty"; }
-} EHeapQEmptyExc;
+    this->slots->data()[handle] = (Pos)pos;
+    this->count++;
+    return true;
+  }
 
-/**
- * An exception when the given item was not found in the heap.
- */
-class EHeapQNotFound : public EHeapQException {
-public:
-  virtual const char *what() const throw() {
-    return "the given item was not found in the heap";
+  /**
+   * Erase the item with the given handle.
+   */
+  void erase(Handle handle) noexcept {
+    Slots::erase(this->heap->data(), this->slots->data(), this->slots->size(), this->shift, handle);
+    this->count--;
   }
-} EHeapQNotFoundExc;
+
+  /**
+   * Remove all the items.
+   */
+  void clear() noexcept {
+    std::fill(this->slots->begin(), this->slots->end(), Slots::EMPTY);
+    this->count = 0;
+  }
+
+  /**
+   * Preallocate slots for the given number of items.
+   */
+  void reserve(size_t n) {
+    size_t slots_count = this->slots_for(n);
+
+    if (slots_count > this->slots->size())
+      this->rehash(slots_count);
+  }
+
+  /**
+   * Rebuild the index so that it holds memory only for items currently stored in the heap.
+   */
+  void shrink() { this->rehash(this->slots_for(this->count)); }
+
+  /**
+   * Rebuild the index from items stored in the heap vector.
+   */
+  void restore() {
+    this->clear();
+    this->reserve(this->heap->size());
+
+    for (size_t i = 0; i < this->heap->size(); i++)
+      this->insert(this->heap->data()[i], i);
+  }
+
+  /**
+   * Get memory used by the index.
+   */
+  void get_memory_stats(EHeapQMemoryStats &stats) const noexcept {
+    stats.index_buckets = this->slots->capacity() * sizeof(Pos);
+    stats.index_nodes = 0;
+    stats.slack = 0;
+  }
+
+private:
+  static size_t slots_for(size_t n) noexcept {
+    size_t result = EHEAPQ_FLAT_INDEX_MIN_SLOTS;
+
+    while (result < n * 2)
+      result <<= 1;
+
+    return result;
+  }
+
+  void rehash(size_t slots_count) {
+    SlotVector *old_slots = this->slots;
+    Handle handle;
+
+    EHEAPQ_PROBE3(rehash, this->count, old_slots->size(), slots_count);
+
+    this->slots = new SlotVector(slots_count, Slots::EMPTY, old_slots->get_allocator());
+    this->shift = Slots::get_shift(slots_count);
+
+    for (auto pos : *old_slots) {
+      if (pos == Slots::EMPTY)
+        continue;
+
+      this->find(this->heap->data()[pos], handle);
+      this->slots->data()[handle] = pos;
+    }
+
+    delete old_slots;
+  }
+};
 
 /**
- * An exception raised when the given item is not present in the heap.
+ * An item stored together with its key, to be used with EHeapQFlatIndex for a
+ * compact heap queue. Entries are equal if their items are equal - the key is
+ * ignored, hence an entry with any key can be passed to remove the item.
  */
-class EHeapQAlreadyPresent : public EHeapQException {
-public:
-  virtual const char *what() const throw() {
-    return "the given item is already present in the heap";
-  }
-} EHeapQAlreadyPresentExc;
+template <class Key, class Item> struct EHeapQEntry {
+  Key key;    /**< Key used for comparision. */
+  Item item;  /**< The item stored. */
+
+  bool operator==(const EHeapQEntry &other) const { return this->item == other.item; }
+  bool operator!=(const EHeapQEntry &other) const { return this->item != other.item; }
+};
 
 /**
- * An exception raised when there is no last item stored.
+ * Comparision of entries based on their keys.
  */
-class EHeapQNoLast : public EHeapQException {
-public:
-  virtual const char *what() const throw() {
-    return "no record for the last item";
-  }
-} EHeapQNoLastExc;
+template <class Key, class Item, class Compare = std::less<Key>> struct EHeapQEntryCompare {
+  Compare comp;  /**< The function class that implements comparision of keys. */
+
+  bool operator()(const EHeapQEntry<Key, Item> &a, const EHeapQEntry<Key, Item> &b) { return this->comp(a.key, b.key); }
+};
 
 /**
- * An exception raised when accessing elements outside of heap.
+ * Hash of entries based on their items.
  */
-class EHeapQIndexError : public EHeapQException {
-public:
-  virtual const char *what() const throw() {
-    return "index out of range";
-  }
-} EHeapQIndexErrorExc;
+template <class Key, class Item, class Hash = std::hash<Item>> struct EHeapQEntryHash {
+  size_t operator()(const EHeapQEntry<Key, Item> &entry) const { return Hash()(entry.item); }
+};
 
 /**
  * Implementation of an extended min or max heap queue
@@ -94,8 +992,13 @@ public:
  * optimizes removals of items to O(log(N)) instead
  * of O(logN) + O(N) as in case of the standard heap queue.
  * The heap cannot store multiple values that are equal.
+ *
+ * Positions of items are kept in an Index - EHeapQMapIndex by default,
+ * EHeapQFlatIndex for a compact heap queue (see EHeapQCompact).
  */
-template <class T, class Compare = std::less<T>, class Hash = std::hash<T>> class EHeapQ {
+template <class T, class Compare = std::less<T>, class Hash = std::hash<T>,
+          class Allocator = EHeapQPoolAllocator<T>, class Index = EHeapQMapIndex<T, Hash, Allocator>>
+class EHeapQ {
 public:
   Compare comp;         /**< The function class that implements comparision. */
 
@@ -103,17 +1006,23 @@ public:
    * Constructor.
    *
    * @param size Maximum number of items that can be stored in the heap.
+   * @param allocator Allocator used for the heap and the index, the default one uses a pool per heap.
    */
-  EHeapQ(size_t size = EHEAPQ_DEFAULT_SIZE) {
+  EHeapQ(size_t size = EHEAPQ_DEFAULT_SIZE, const Allocator &allocator = Allocator()) : allocator(allocator) {
     this->size = size;
-    this->index_map = new std::unordered_map<T, size_t, Hash>;
-    this->heap = new std::vector<T>;
+    this->heap = new HeapVector(this->allocator);
+    this->index = new Index(this->heap, this->allocator);
     this->last_item_set = false;
     this->max_item_set = false;
+    this->sampler = NULL;
+#ifdef EHEAPQ_STATS
+    this->reset_stats();
+#endif
   }
 
   ~EHeapQ() {
-    delete this->index_map;
+    delete this->sampler;
+    delete this->index;
     delete this->heap;
   }
 
@@ -173,19 +1082,133 @@ public:
    */
   size_t get_length() const noexcept { return this->heap->size(); }
 
+  /**
+   * Check whether the given item is stored in the heap.
+   */
+  bool contains(const T &item) const {
+    IndexHandle handle;
+    return this->index->find(item, handle);
+  }
+
   /**
    * Get raw vector representing the heap that stores items.
    *
    * @result Raw vector used for the heap representation.
    */
-  const std::vector<T> *get_items() const { return this->heap; }
+  const std::vector<T, Allocator> *get_items() const { return this->heap; }
+
+  /**
+   * Get memory used by the heap. Exact for the pool allocator, nodes of the
+   * index are estimated for other allocators.
+   *
+   * @result Memory used by the heap, in bytes.
+   */
+  EHeapQMemoryStats get_memory_stats() const noexcept {
+    EHeapQMemoryStats stats;
+
+    this->index->get_memory_stats(stats);
+    stats.heap = this->heap->capacity() * sizeof(T);
+
+    return stats;
+  }
+
+#ifdef EHEAPQ_STATS
+  /**
+   * Get counters of operations done since the heap was created or the counters were reset.
+   *
+   * @result Counters of operations.
+   */
+  EHeapQStats get_stats() const noexcept { return this->stats; }
+
+  /**
+   * Reset all the counters of operations to zero.
+   */
+  void reset_stats() noexcept { this->stats = EHeapQStats(); }
+#endif
+
+  /**
+   * Sample latencies of operations and lengths of sift paths - one of
+   * every rate operations is measured. Operations not sampled cost a
+   * single branch, nothing is measured by default.
+   *
+   * @param rate Sample one of every rate operations, 0 disables sampling and releases histograms.
+   */
+  void set_sample_rate(size_t rate) {
+    if (rate == 0) {
+      delete this->sampler;
+      this->sampler = NULL;
+      return;
+    }
+
+    if (!this->sampler)
+      this->sampler = new Sampler();
+
+    this->sampler->rate = rate;
+    this->sampler->countdown = rate;
+  }
+
+  /**
+   * Get the current sample rate, 0 if sampling is disabled.
+   */
+  size_t get_sample_rate() const noexcept { return this->sampler ? this->sampler->rate : 0; }
+
+  /**
+   * Get histograms of operations sampled since sampling was enabled or reset.
+   *
+   * @result Histograms of operations sampled, NULL if sampling is disabled.
+   */
+  const EHeapQLatencyStats *get_latency_stats() const noexcept {
+    return this->sampler ? &this->sampler->stats : NULL;
+  }
+
+  /**
+   * Remove all the values recorded in histograms of operations sampled.
+   */
+  void reset_latency_stats() noexcept {
+    if (this->sampler)
+      this->sampler->stats = EHeapQLatencyStats();
+  }
+
+  /**
+   * Preallocate memory so that the heap can store the given number of items
+   * without reallocating the heap vector, rehashing the index or allocating
+   * index nodes.
+   *
+   * @param n Number of items to preallocate memory for.
+   */
+  void reserve(size_t n) {
+    this->heap->reserve(n);
+    this->index->reserve(n);
+  }
+
+  /**
+   * Release memory not needed for items currently stored - the heap vector
+   * is shrunk and the index is rebuilt.
+   */
+  void shrink() {
+    this->heap->shrink_to_fit();
+    this->index->shrink();
+  }
+
+  /**
+   * Adopt items already present in memory of the heap vector - the vector is
+   * resized to the given length and the index is restored. Meant for
+   * allocators that leave elements uninitialized on construction (see
+   * EHeapQMmapAllocator), other allocators overwrite items stored.
+   *
+   * @param length Number of items stored.
+   */
+  void restore(size_t length) {
+    this->heap->resize(length);
+    this->index->restore();
+  }
 
   /**
-   * Remove all the items stored in the heap.
+   * Remove all the items stored in the heap. Memory is kept for items pushed later, see shrink.
    */
   void clear() {
     this->heap->clear();
-    this->index_map->clear();
+    this->index->clear();
   }
 
   /**
@@ -197,22 +1220,24 @@ public:
    * @raises EHeapQEmpty If the heap queue is empty.
    */
   T get_peak(void) {
+    Sample sample(this->sampler, EHEAPQ_OP_GET_PEAK);
     this->throw_on_empty();
 
     if (this->max_item_set)
       return this->max_item;
 
+    EHEAPQ_COUNT(peak_rescans, 1);
+    EHEAPQ_COUNT(comparisons, this->heap->size() - this->heap->size() / 2 - 1);
+    EHEAPQ_PROBE2(peak_rescan, this->heap->size(), this->heap->size() - this->heap->size() / 2);
     size_t idx = this->heap->size() / 2;
     T result = this->heap->data()[idx];
     for (auto i = idx + 1; i < this->heap->size(); i++) {
       T tmp = this->heap->data()[i];
       if (this->comp(result, tmp)) {
-        idx = i;
         result = tmp;
       }
     }
 
-    this->max_item_idx = idx;
     this->max_item = result;
     return result;
   }
@@ -224,16 +1249,26 @@ public:
    * @raises EHeapQAlreadyPresent If the given item is already present in the heap.
    */
   T pushpop(T item) {
-    if (this->index_map->find(item) != this->index_map->end())
+    Sample sample(this->sampler, EHEAPQ_OP_PUSHPOP);
+    IndexHandle handle;
+
+    if (this->index->find(item, handle))
       throw EHeapQAlreadyPresentExc;
 
+    EHEAPQ_COUNT(pushes, 1);
+    EHEAPQ_COUNT(pops, 1);
+    EHEAPQ_COUNT(comparisons, this->heap->size() > 0);
     if (this->heap->size() > 0 && this->comp(this->heap->at(0), item)) {
       T to_return = this->heap->data()[0];
+      EHEAPQ_COUNT(index_updates, 2);
+      // The index is updated only while the heap vector holds items indexed.
+      this->index->find(to_return, handle);
+      this->index->erase(handle);
       this->heap->data()[0] = item;
-      this->index_map->insert({item, 0});
-      this->index_map->erase(to_return);
+      this->index->insert(item, 0);
 
-      this->siftup(0);
+      size_t pos = this->siftup(0);
+      EHEAPQ_PROBE2(pushpop, this->heap->size(), eheapq_level(pos));
 
       this->set_last_item(item);
       this->maybe_del_max_item(to_return);
@@ -241,6 +1276,7 @@ public:
       return to_return;
     }
 
+    EHEAPQ_PROBE2(pushpop, this->heap->size(), 0);
     return item;
   }
 
@@ -248,28 +1284,44 @@ public:
    * Push the given item to the heap.
    *
    * @param item The item to be stored in the heap.
-   * @param no_removed Value returned if no item was removed.
+   * @param removed_callback Called with the item that is not kept in the heap if the heap is full -
+   *                         either the top item removed or the pushed item itself.
    */
   void push(T item, std::function<void(T)> removed_callback = NULL) {
-    if (this->index_map->find(item) != this->index_map->end())
+    Sample sample(this->sampler, EHEAPQ_OP_PUSH);
+    IndexHandle handle;
+
+    if (this->index->find(item, handle))
       throw EHeapQAlreadyPresentExc;
 
     if (this->heap->size() == this->size) {
       T removed = this->pushpop(item);
+      EHEAPQ_COUNT(evictions, 1);
+      EHEAPQ_PROBE2(evict, this->heap->size(), this->size);
 
-      if (removed != item && removed_callback)
+      if (removed_callback)
         removed_callback(removed);
 
       return;
     }
 
-    this->index_map->insert({item, this->heap->size()});
+    EHEAPQ_COUNT(pushes, 1);
+    EHEAPQ_COUNT(index_updates, 1);
     this->heap->push_back(item);
 
     try {
-      this->siftdown(0, this->heap->size() - 1);
+      this->index->insert(item, this->heap->size() - 1);
+    } catch (...) {
+      this->heap->pop_back();
+      throw;
+    }
+
+    try {
+      size_t pos = this->siftdown(0, this->heap->size() - 1);
+      EHEAPQ_PROBE2(push, this->heap->size(), eheapq_level(this->heap->size() - 1) - eheapq_level(pos));
     } catch (...) {
-      this->index_map->erase(item);
+      this->index->find(item, handle);
+      this->index->erase(handle);
       this->heap->pop_back();
       throw;
     }
@@ -277,13 +1329,138 @@ public:
     this->set_last_item(item);
 
     if (this->heap->size() == 1) {
-      this->max_item_idx = 0;
       this->max_item = item;
     } else {
       maybe_adjust_max_item(item);
     }
   }
 
+  /**
+   * Push multiple items to the heap. If the batch is at least as large as the heap and fits into it,
+   * items are appended and the heap is rebuilt in O(N+M), otherwise they are pushed one by one.
+   *
+   * @param first The beginning of the items to be stored in the heap.
+   * @param last The end of the items to be stored in the heap.
+   * @param removed_callback Called with items that are not kept in the heap - items already present
+   *                         in the heap and items removed to respect the heap size.
+   */
+  template <class ForwardIt>
+  void push_many(ForwardIt first, ForwardIt last, std::function<void(T)> removed_callback = NULL) {
+    size_t count = std::distance(first, last);
+    size_t length = this->heap->size();
+
+    if (count == 0)
+      return;
+
+    if (count < length || length + count > this->size) {
+      for (; first != last; ++first) {
+        try {
+          this->push(*first, removed_callback);
+        } catch (EHeapQAlreadyPresent &exc) {
+          if (removed_callback)
+            removed_callback(*first);
+        }
+      }
+      return;
+    }
+
+    for (; first != last; ++first) {
+      IndexHandle handle;
+
+      if (this->index->find(*first, handle)) {
+        if (removed_callback)
+          removed_callback(*first);
+        continue;
+      }
+
+      EHEAPQ_COUNT(pushes, 1);
+      EHEAPQ_COUNT(index_updates, 1);
+      this->heap->push_back(*first);
+      this->index->insert(*first, this->heap->size() - 1);
+      this->set_last_item(*first);
+    }
+
+    this->heapify();
+  }
+
+  /**
+   * Merge items stored in the other heap into this heap, the other heap is left untouched. Items are
+   * appended and the heap is rebuilt in O(N+M). If the heap size is exceeded, items with the smallest
+   * keys are selected in O(N+M) and removed - the same items as if the other items were pushed one by one.
+   * The selection relies on Compare being a strict weak ordering (e.g. keys are never NaN).
+   *
+   * An item present in both heaps is kept once, with the larger of the keys - the item of the other heap
+   * replaces the one stored if it is not smaller (e.g. an entry with a larger key in a compact heap).
+   *
+   * @param other The heap to be merged, it can be emptied using clear afterwards to move its items.
+   * @param removed_callback Called with items that are not kept in the heap - the item not kept out of
+   *                         each pair of items present in both heaps (called while the other item is
+   *                         stored) and items removed to respect the heap size (called after the heap
+   *                         is rebuilt).
+   */
+  void merge(const EHeapQ &other, std::function<void(T)> removed_callback = NULL) {
+    T *arr;
+    size_t excess, i;
+
+    if (&other == this || other.heap->empty())
+      return;
+
+    this->heap->reserve(this->heap->size() + other.heap->size());
+    for (auto it = other.heap->begin(); it != other.heap->end(); ++it) {
+      IndexHandle handle;
+
+      if (this->index->find(*it, handle)) {
+        T &stored = this->heap->data()[this->index->get(handle)];
+        T removed = *it;
+
+        EHEAPQ_COUNT(comparisons, 1);
+        if (this->comp(stored, *it)) {
+          // Equal items are interchangeable in the index, the position recorded stays valid.
+          removed = stored;
+          stored = *it;
+        }
+
+        if (removed_callback)
+          removed_callback(removed);
+        continue;
+      }
+
+      EHEAPQ_COUNT(pushes, 1);
+      EHEAPQ_COUNT(index_updates, 1);
+      this->heap->push_back(*it);
+      this->index->insert(*it, this->heap->size() - 1);
+      this->set_last_item(*it);
+    }
+
+    if (this->heap->size() <= this->size) {
+      this->heapify();
+      return;
+    }
+
+    // Items with the smallest keys are moved to the front, positions of all the items change - the index
+    // is rebuilt, as cheap as updating positions of the items moved.
+    excess = this->heap->size() - this->size;
+    arr = this->heap->data();
+    std::nth_element(arr, arr + excess, arr + this->heap->size(),
+                     [this](const T &a, const T &b) { return this->comp(a, b); });
+    std::vector<T> removed(arr, arr + excess);
+
+    this->heap->erase(this->heap->begin(), this->heap->begin() + excess);
+    this->index->clear();
+    for (i = 0; i < this->heap->size(); i++)
+      this->index->insert(this->heap->data()[i], i);
+
+    this->heapify();
+
+    EHEAPQ_COUNT(evictions, excess);
+    EHEAPQ_PROBE2(evict, this->heap->size(), this->size);
+    for (const T &item : removed) {
+      this->maybe_del_last_item(item);
+      if (removed_callback)
+        removed_callback(item);
+    }
+  }
+
   /**
    * Pop top element from the queue and return it (toppop). The
    * top is minimum in case of min heap queue, the maximum item in
@@ -293,19 +1470,27 @@ public:
    * @raises EHeapQEmpty If the heap is empty.
    */
   T pop(void) {
+    Sample sample(this->sampler, EHEAPQ_OP_POP);
     this->throw_on_empty();
 
     T result = this->heap->data()[0];
+    IndexHandle result_handle, back_handle;
+
+    EHEAPQ_COUNT(pops, 1);
+    EHEAPQ_COUNT(index_updates, this->heap->size() > 1 ? 2 : 1);
+    this->index->find(result, result_handle);
 
     if (this->heap->size() > 1) {
+      this->index->find(this->heap->back(), back_handle);
       this->heap->data()[0] = this->heap->back();
-      this->index_map->at(this->heap->data()[0]) = 0;
+      this->index->set(back_handle, 0);
     }
 
     this->heap->pop_back();
-    this->index_map->erase(result);
+    this->index->erase(result_handle);
 
-    this->siftup(0);
+    size_t pos = this->siftup(0);
+    EHEAPQ_PROBE2(pop, this->heap->size(), eheapq_level(pos));
 
     this->maybe_del_last_item(result);
     this->maybe_del_max_item(result);
@@ -321,18 +1506,26 @@ public:
    * @raises EHeapQEmpty If the heap is empty.
    */
   T replace(T item) {
+    Sample sample(this->sampler, EHEAPQ_OP_REPLACE);
     this->throw_on_empty();
 
-    if (this->index_map->find(item) != this->index_map->end())
+    IndexHandle handle;
+
+    if (this->index->find(item, handle))
       throw EHeapQAlreadyPresentExc;
 
     T result = this->heap->data()[0];
 
+    EHEAPQ_COUNT(pushes, 1);
+    EHEAPQ_COUNT(pops, 1);
+    EHEAPQ_COUNT(index_updates, 2);
+    this->index->find(result, handle);
+    this->index->erase(handle);
     this->heap->data()[0] = item;
-    this->index_map->erase(result);
-    this->index_map->insert({item, 0});
+    this->index->insert(item, 0);
 
-    this->siftup(0);
+    size_t pos = this->siftup(0);
+    EHEAPQ_PROBE2(replace, this->heap->size(), eheapq_level(pos));
 
     this->set_last_item(result);
     this->maybe_del_max_item(result);
@@ -358,7 +1551,7 @@ public:
    *
    * @result The beginning for the iterator.
    */
-  typename std::vector<T>::const_iterator begin(void) const noexcept {
+  typename std::vector<T, Allocator>::const_iterator begin(void) const noexcept {
     return this->heap->begin();
   }
 
@@ -367,7 +1560,7 @@ public:
    *
    * @result The end iterator to the heap.
    */
-  typename std::vector<T>::const_iterator end(void) const noexcept {
+  typename std::vector<T, Allocator>::const_iterator end(void) const noexcept {
     return this->heap->end();
   }
 
@@ -378,41 +1571,49 @@ public:
    * @raises EHeapQNotFound If the given item is not present in the heap.
    */
   void remove(T item) {
-    auto size = this->heap->size();
-    unsigned long idx;
+    Sample sample(this->sampler, EHEAPQ_OP_REMOVE);
+    IndexHandle handle, last_handle;
+    size_t idx;
 
-    auto idx_value = this->index_map->find(item);
-    if (idx_value == this->index_map->end())
+    if (!this->index->find(item, handle))
       throw EHeapQNotFoundExc;
 
-    idx = idx_value->second;
-    this->heap->at(idx) = this->heap->at(this->heap->size() - 1);
+    EHEAPQ_COUNT(removes, 1);
+    EHEAPQ_COUNT(index_updates, 1);
+    idx = this->index->get(handle);
+    if (idx != this->heap->size() - 1) {
+      EHEAPQ_COUNT(index_updates, 1);
+      this->index->find(this->heap->back(), last_handle);
+      this->heap->data()[idx] = this->heap->back();
+      this->index->set(last_handle, idx);
+    }
 
     this->heap->pop_back();
-    this->index_map->erase(item);
-    if (size > 0 && idx == size - 1)
-      goto end;
-
-    this->index_map->erase(this->heap->at(idx));
-    this->index_map->insert({this->heap->at(idx), idx});
+    this->index->erase(handle);
 
     if (idx < this->heap->size()) {
-      this->siftup(idx);
-      this->siftdown(0, idx);
+      // The item moved to idx either goes down or up, the other sift keeps it in place.
+      size_t down = this->siftup(idx);
+      size_t up = this->siftdown(0, idx);
+      EHEAPQ_PROBE2(remove, this->heap->size(), eheapq_level(down) - eheapq_level(up));
+    } else {
+      EHEAPQ_PROBE2(remove, this->heap->size(), 0);
     }
 
-  end:
     this->maybe_del_max_item(item);
     this->maybe_del_last_item(item);
   }
 
 private:
-  std::vector<T> *heap; /**< The raw vector of items stored in the heap. */
+  typedef std::vector<T, Allocator> HeapVector;
+  typedef typename Index::Handle IndexHandle;
+
+  Allocator allocator;  /**< Allocator used for the heap and the index. */
+  HeapVector *heap;     /**< The raw vector of items stored in the heap. */
   size_t size;          /**< The maximum number of items stored in the heap. */
   T last_item;          /**< The last item stored. */
   bool last_item_set;   /**< Set to true if the last item is present, false otherwise. */
   T max_item;           /**< The max item stored. */
-  size_t max_item_idx;  /**< The maximum item stored, used a cached value. */
   bool max_item_set;    /**< Set to true if the max item is present, false otherwise. */
 
   /**
@@ -423,94 +1624,229 @@ private:
       throw EHeapQEmptyExc;
   }
 
-  std::unordered_map<T, size_t, Hash> *index_map;  /**< A hash map used to store indexes to optimize removals. */
+  Index *index;  /**< Positions of items stored, used to optimize removals. */
+
+#ifdef EHEAPQ_STATS
+  EHeapQStats stats;  /**< Counters of operations done. */
+#endif
+
+  /**
+   * State of sampling, allocated only if sampling is enabled.
+   */
+  struct Sampler {
+    EHeapQLatencyStats stats;  /**< Histograms of operations sampled. */
+    size_t rate;               /**< One of every rate operations is sampled. */
+    size_t countdown;          /**< Number of operations left until the next one sampled. */
+    bool active;               /**< Set while an operation is sampled, nested operations are not sampled. */
+
+    Sampler() noexcept : stats(), rate(1), countdown(1), active(false) {}
+  };
+
+  /**
+   * Measure the operation in the scope if it is the one sampled.
+   */
+  class Sample {
+  public:
+    Sample(Sampler *sampler, EHeapQOp op) noexcept : sampler(NULL) {
+      if (!sampler || sampler->active || --sampler->countdown != 0)
+        return;
+
+      sampler->countdown = sampler->rate;
+      sampler->active = true;
+      this->sampler = sampler;
+      this->op = op;
+      this->start = std::chrono::steady_clock::now();
+    }
+
+    ~Sample() {
+      if (!this->sampler)
+        return;
+
+      auto elapsed = std::chrono::steady_clock::now() - this->start;
+      this->sampler->stats.latency[this->op].record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+      this->sampler->active = false;
+    }
+
+  private:
+    Sampler *sampler;
+    EHeapQOp op;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  Sampler *sampler;  /**< Sampling of operations, NULL if disabled. */
 
   /**
    * Heap's sift down operation implementation. Based on the CPython's implementation, extended with
-   * index storing for optimizing removals.
+   * index storing for optimizing removals. Parents are moved down into the hole left by the item,
+   * the item is placed once at the end - the index of each item moved is written once.
+   *
+   * @result The final position of the item sifted.
    */
-  void siftdown(size_t startpos, size_t pos) {
+  size_t siftdown(size_t startpos, size_t pos) {
     T newitem, parent, *arr;
-    size_t parentpos;
+    IndexHandle newitem_handle = IndexHandle(), parent_handle;
+    size_t frompos, parentpos;
 
-    auto size = this->heap->size();
-    if (size == 0)
-      return; // nothing to do..
+    if (this->heap->size() == 0)
+      return pos; // nothing to do..
 
+    EHEAPQ_COUNT(siftdowns, 1);
     // Follow the path to the root, moving parents down until finding a place
     // newitem fits.
     arr = this->heap->data();
     newitem = arr[pos];
+    frompos = pos;
     while (pos > startpos) {
       parentpos = (pos - 1) >> 1;
       parent = arr[parentpos];
 
+      EHEAPQ_COUNT(comparisons, 1);
       if (!this->comp(newitem, parent))
         break;
 
-      arr = this->heap->data();
-      parent = arr[parentpos];
-      newitem = arr[pos];
-      arr[parentpos] = newitem;
+      // Items are looked up only while they are at positions recorded in the index - newitem before the
+      // first move, parents before they are moved.
+      if (pos == frompos)
+        this->index->find(newitem, newitem_handle);
+
+      EHEAPQ_COUNT(swaps, 1);
+      EHEAPQ_COUNT(index_updates, 1);
+      this->index->find(parent, parent_handle);
       arr[pos] = parent;
-      this->index_map->at(newitem) = parentpos;
-      this->index_map->at(parent) = pos;
+      this->index->set(parent_handle, pos);
       pos = parentpos;
+    }
 
-      if (this->max_item_set) {
-        if (this->max_item_idx == parentpos)
-          this->max_item_idx = pos;
-        else if (this->max_item_idx == pos)
-          this->max_item_idx = parentpos;
-      }
+    if (pos != frompos) {
+      EHEAPQ_COUNT(index_updates, 1);
+      arr[pos] = newitem;
+      this->index->set(newitem_handle, pos);
     }
+
+    if (this->sampler && this->sampler->active)
+      this->sampler->stats.siftdown_depths[eheapq_level(frompos) - eheapq_level(pos)]++;
+
+    return pos;
   }
 
   /**
    * Heap's sift up operation implementation. Based on the CPython's implementation, extended with
-   * index storing for optimizing removals.
+   * index storing for optimizing removals. The path of smaller children is followed down to a leaf
+   * (bottom-up, as CPython's and Wegener's heapsort do) and the final place of the item on the path
+   * is searched for using comparisons only. Items on the path above the final place are then moved
+   * up by one level and the item is placed once - the index of each item moved is written once.
+   * In heaps exceeding caches, each level would be a dependent cache miss on the heap vector and
+   * another one in the index - both pairs of grandchildren are prefetched while descending and index
+   * slots of items on the path are prefetched before they are moved. Index slots are prefetched only
+   * by flat indexes (EHeapQFlatIndex, EHeapQCompact), EHeapQMapIndex used by the Python extension
+   * cannot locate a bucket without loading it.
+   *
+   * @result The final position of the item sifted.
    */
-  void siftup(size_t pos) {
-    size_t startpos, endpos, childpos, limit;
-    T tmp1;
-    T tmp2;
-    T *arr;
-    int cmp;
+  size_t siftup(size_t pos) {
+    size_t path[EHEAPQ_MAX_DEPTH];
+    size_t startpos, endpos, childpos, limit, depth, lo, mid, step, i;
+    T newitem, item, *arr;
+    IndexHandle newitem_handle, handle;
+    bool prefetch;
 
     endpos = this->heap->size();
+    if (endpos == 0)
+      return pos; // nothing to do..
+
+    prefetch = endpos >= EHEAPQ_PREFETCH_MIN_LENGTH;
+
     startpos = pos;
+    EHEAPQ_COUNT(siftups, 1);
 
-    /* Bubble up the smaller child until hitting a leaf. */
+    /* Follow the smaller child until hitting a leaf. */
     arr = this->heap->data();
     limit = endpos >> 1; /* smallest pos that has no child */
+    depth = 0;
+    path[0] = pos;
     while (pos < limit) {
-      /* Set childpos to index of smaller child.   */
-      childpos = (pos << 1) + 1; /* leftmost child position  */
+      childpos = (pos << 1) + 1; /* leftmost child position */
+      if (prefetch && (childpos << 1) + 1 < endpos) {
+        /* Grandchildren, loaded by the next level - either child can be followed. */
+        __builtin_prefetch(arr + (childpos << 1) + 1);
+        if ((childpos << 1) + 3 < endpos)
+          __builtin_prefetch(arr + (childpos << 1) + 3);
+      }
       if (childpos + 1 < endpos) {
-        cmp = int(this->comp(arr[childpos], arr[childpos + 1]));
-        childpos += ((unsigned)cmp ^ 1); /* increment when cmp==0 */
-        arr = this->heap->data();        /* arr may have changed */
+        EHEAPQ_COUNT(comparisons, 1);
+        childpos += !this->comp(arr[childpos], arr[childpos + 1]); /* increment when the right one is smaller */
       }
-      /* Move the smaller child up. */
-      tmp1 = arr[childpos];
-      tmp2 = arr[pos];
-      arr[childpos] = tmp2;
-      arr[pos] = tmp1;
-      this->index_map->at(tmp2) = childpos;
-      this->index_map->at(tmp1) = pos;
       pos = childpos;
+      path[++depth] = pos;
+    }
+
+    /*
+     * Find the final resting place of newitem - the deepest position on the path holding an item
+     * newitem is not smaller than. Items taken from leaves (pop, remove) mostly settle at the bottom,
+     * hence positions are probed from the leaf up at exponentially growing distances, the last
+     * interval is binary searched - one comparison if newitem stays at the leaf, O(log(depth))
+     * comparisons at most.
+     */
+    newitem = arr[startpos];
+    lo = 0;
+    EHEAPQ_COUNT(comparisons, depth > 0);
+    if (depth > 0 && this->comp(newitem, arr[path[depth]])) {
+      depth--;
+      for (step = 1; depth >= step; step <<= 1) {
+        EHEAPQ_COUNT(comparisons, 1);
+        if (!this->comp(newitem, arr[path[depth - step + 1]])) {
+          lo = depth - step + 1;
+          break;
+        }
+        depth -= step;
+      }
 
-      /* Change reference to max, as needed. */
-      if (this->max_item_set) {
-        if (this->max_item_idx == childpos)
-          this->max_item_idx = pos;
-        else if (this->max_item_idx == pos)
-          this->max_item_idx = childpos;
+      /* The place is within path[lo..depth], newitem is smaller than items below. */
+      while (lo < depth) {
+        mid = (lo + depth + 1) >> 1;
+        EHEAPQ_COUNT(comparisons, 1);
+        if (this->comp(newitem, arr[path[mid]]))
+          depth = mid - 1;
+        else
+          lo = mid;
       }
     }
 
-    /* Bubble it up to its final resting place (by sifting its parents down). */
-    this->siftdown(startpos, pos);
+    if (this->sampler && this->sampler->active)
+      this->sampler->stats.siftup_depths[depth]++;
+
+    if (depth == 0)
+      return startpos;
+
+    /* Move items on the path up by one level, items are looked up before they are moved. */
+    if (prefetch) {
+      for (i = 1; i <= depth; i++)
+        this->index->prefetch(arr[path[i]]);
+    }
+    this->index->find(newitem, newitem_handle);
+    for (i = 1; i <= depth; i++) {
+      EHEAPQ_COUNT(swaps, 1);
+      EHEAPQ_COUNT(index_updates, 1);
+      item = arr[path[i]];
+      this->index->find(item, handle);
+      arr[path[i - 1]] = item;
+      this->index->set(handle, path[i - 1]);
+    }
+
+    EHEAPQ_COUNT(index_updates, 1);
+    arr[path[depth]] = newitem;
+    this->index->set(newitem_handle, path[depth]);
+    return path[depth];
+  }
+
+  /**
+   * Restore the heap invariant of the whole heap in O(N), the same way as CPython's heapify does.
+   */
+  void heapify() {
+    this->max_item_set = false;
+
+    for (size_t i = this->heap->size() / 2; i > 0; i--)
+      this->siftup(i - 1);
   }
 
   void set_last_item(T item) noexcept {
@@ -536,3 +1872,67 @@ private:
     }
   }
 };
+
+/**
+ * Walk items of a heap queue in the order they would be popped, without
+ * modifying the heap queue or its index. A frontier heap holds positions of
+ * items that can come next - the root at first, each position taken out is
+ * replaced by positions of its children. The first k items are produced in
+ * O(k log(k)) time regardless of the heap size. The heap queue must not be
+ * modified while the cursor is used.
+ */
+template <class Heap> class EHeapQSortedCursor {
+public:
+  EHeapQSortedCursor(Heap *heap) : heap(heap) {
+    if (heap->get_length() > 0)
+      this->frontier.push_back(0);
+  }
+
+  /**
+   * Preallocate the frontier for taking n items.
+   */
+  void reserve(size_t n) { this->frontier.reserve(n + 1); }
+
+  /**
+   * Check whether all items were taken.
+   */
+  bool empty() const noexcept { return this->frontier.empty(); }
+
+  /**
+   * Take the next item, the cursor must not be empty.
+   *
+   * @return Position of the next item in the heap vector.
+   */
+  size_t next() {
+    auto items = this->heap->begin();
+    auto after = [this, &items](size_t a, size_t b) { return this->heap->comp(*(items + b), *(items + a)); };
+
+    std::pop_heap(this->frontier.begin(), this->frontier.end(), after);
+    size_t pos = this->frontier.back();
+    this->frontier.pop_back();
+
+    size_t length = this->heap->get_length();
+    for (size_t childpos = (pos << 1) + 1; childpos <= (pos << 1) + 2 && childpos < length; childpos++) {
+      this->frontier.push_back(childpos);
+      std::push_heap(this->frontier.begin(), this->frontier.end(), after);
+    }
+
+    return pos;
+  }
+
+private:
+  Heap *heap;
+  std::vector<size_t> frontier;  /**< A binary heap of positions, the next item on top. */
+};
+
+/**
+ * A compact configuration of the heap queue for very large heaps - keys are
+ * stored together with items in the heap vector (16 bytes for a double key
+ * and a pointer) and positions are kept in an open-addressed index with 32-bit
+ * slots. Up to 2^32 - 1 items can be stored.
+ */
+template <class Key, class Item, class Compare = std::less<Key>, class Hash = std::hash<Item>,
+          class Allocator = EHeapQPoolAllocator<EHeapQEntry<Key, Item>>>
+using EHeapQCompact =
+    EHeapQ<EHeapQEntry<Key, Item>, EHeapQEntryCompare<Key, Item, Compare>, EHeapQEntryHash<Key, Item, Hash>, Allocator,
+           EHeapQFlatIndex<EHeapQEntry<Key, Item>, EHeapQEntryHash<Key, Item, Hash>, uint32_t, Allocator>>;
@@ -0,0 +1,337 @@
+/*
+ * eingest - A batched multi-producer ingestion buffer for eheapq.
+ * Copyright(C) 2020 Fridolin Pokorny
+ *
+ * This program is free software: you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * This module implements an ingestion buffer placed in front of a heap queue.
+ * Producer threads append blocks of items to a lock-free multi-producer stack,
+ * the single consumer takes the whole stack at once and merges it into the
+ * heap queue in one batch (see EHeapQ::push_many) before each operation that
+ * reads the heap. Producers do not pay for hashing and sifting, the consumer
+ * amortizes the work - batches large relative to the heap are heapified in
+ * O(N+M). Producers using EHeapQIngest::Producer fill fixed size blocks that
+ * the consumer hands back once merged, so steady ingestion does not allocate.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+#include <new>
+
+#include "eheapq.hpp"
+
+/**
+ * Number of items in a block filled by EHeapQIngest::Producer.
+ */
+const size_t EHEAPQ_INGEST_BLOCK_ITEMS = 128;
+
+/**
+ * A heap queue with a multi-producer single-consumer ingestion buffer. Methods
+ * push and push_many (and producer handles) can be used from any thread, all
+ * the other methods must be called from the consumer thread only.
+ */
+template <class T, class Compare = std::less<T>, class Hash = std::hash<T>> class EHeapQIngest {
+private:
+  /**
+   * A block of items in the lock-free stack used as the ingestion buffer, items are stored right after the header.
+   */
+  struct alignas(T) alignas(void *) Block {
+    Block *next;      /**< The next (previously appended) block. */
+    size_t count;     /**< Number of items stored. */
+    size_t capacity;  /**< Number of items the block can hold. */
+
+    T *items() noexcept { return reinterpret_cast<T *>(this + 1); }
+  };
+
+  static_assert(alignof(Block) <= alignof(std::max_align_t), "Items cannot be over-aligned");
+
+public:
+  /**
+   * A handle used by one producer thread. Items are appended to a block owned by the producer and published
+   * EHEAPQ_INGEST_BLOCK_ITEMS at a time (or on flush), merged blocks are recycled by the consumer. Each handle
+   * must be used by one thread only and destroyed before the ingestion buffer.
+   */
+  class Producer {
+  public:
+    Producer(EHeapQIngest &ingest) : ingest(ingest), block(NULL), cache(NULL) {}
+
+    Producer(const Producer &) = delete;
+    Producer &operator=(const Producer &) = delete;
+
+    ~Producer() {
+      this->flush();
+      this->ingest.recycle(this->cache);
+    }
+
+    /**
+     * Append the given item to the producer's block, the block is published once full.
+     *
+     * @param item The item to be stored in the heap.
+     */
+    void push(T item) {
+      if (!this->block)
+        this->block = this->take_block();
+
+      new (this->block->items() + this->block->count++) T(item);
+
+      if (this->block->count == this->block->capacity)
+        this->flush();
+    }
+
+    /**
+     * Publish the items appended so far so that the consumer sees them.
+     */
+    void flush() {
+      if (this->block) {
+        this->ingest.append(this->block, this->block);
+        this->block = NULL;
+      }
+    }
+
+  private:
+    EHeapQIngest &ingest;  /**< The ingestion buffer items are published to. */
+    Block *block;          /**< The block being filled. */
+    Block *cache;          /**< Recycled blocks taken from the ingestion buffer, private to the producer. */
+
+    Block *take_block() {
+      // Take all the recycled blocks at once, a single exchange is not prone to ABA.
+      if (!this->cache)
+        this->cache = this->ingest.free_blocks.exchange(NULL, std::memory_order_acquire);
+
+      if (!this->cache)
+        return EHeapQIngest::allocate(EHEAPQ_INGEST_BLOCK_ITEMS);
+
+      Block *block = this->cache;
+      this->cache = block->next;
+      block->next = NULL;
+      return block;
+    }
+  };
+
+  /**
+   * Constructor.
+   *
+   * @param size Maximum number of items that can be stored in the heap.
+   * @param removed_callback Called with items not kept in the heap (duplicates and items removed to respect size).
+   */
+  EHeapQIngest(size_t size = EHEAPQ_DEFAULT_SIZE, std::function<void(T)> removed_callback = NULL) {
+    this->heap = new EHeapQ<T, Compare, Hash>(size);
+    this->batch = new std::vector<T>;
+    this->removed_callback = removed_callback;
+    this->head.store(NULL);
+    this->free_blocks.store(NULL);
+  }
+
+  ~EHeapQIngest() {
+    EHeapQIngest::release(this->head.exchange(NULL));
+    EHeapQIngest::release(this->free_blocks.exchange(NULL));
+
+    delete this->heap;
+    delete this->batch;
+  }
+
+  /**
+   * Append the given item to the ingestion buffer, lock-free. Can be called from any thread. Producers pushing
+   * items one by one should prefer a Producer handle that does not allocate per item.
+   *
+   * @param item The item to be stored in the heap.
+   */
+  void push(T item) {
+    Block *block = EHeapQIngest::allocate(1);
+
+    new (block->items()) T(item);
+    block->count = 1;
+    this->append(block, block);
+  }
+
+  /**
+   * Append the given items to the ingestion buffer at once in one block, lock-free. Can be called from any thread.
+   *
+   * @param first The beginning of the items to be stored in the heap.
+   * @param last The end of the items to be stored in the heap.
+   */
+  template <class ForwardIt>
+  void push_many(ForwardIt first, ForwardIt last) {
+    size_t count = std::distance(first, last);
+
+    if (count == 0)
+      return;
+
+    Block *block = EHeapQIngest::allocate(count);
+    for (; first != last; ++first)
+      new (block->items() + block->count++) T(*first);
+
+    this->append(block, block);
+  }
+
+  /**
+   * Merge all the items from the ingestion buffer into the heap.
+   *
+   * @result The heap queue with all the items pushed so far.
+   */
+  EHeapQ<T, Compare, Hash> *flush() {
+    Block *block = this->head.exchange(NULL, std::memory_order_acquire);
+
+    if (!block)
+      return this->heap;
+
+    // The stack is in LIFO order, reverse it to keep the order in which blocks were appended.
+    Block *ordered = NULL;
+    while (block) {
+      Block *next = block->next;
+      block->next = ordered;
+      ordered = block;
+      block = next;
+    }
+
+    this->batch->clear();
+    Block *recycled_first = NULL, *recycled_last = NULL;
+    for (block = ordered; block;) {
+      Block *next = block->next;
+      T *items = block->items();
+
+      for (size_t i = 0; i < block->count; i++) {
+        this->batch->push_back(items[i]);
+        items[i].~T();
+      }
+      block->count = 0;
+
+      if (block->capacity == EHEAPQ_INGEST_BLOCK_ITEMS) {
+        block->next = recycled_first;
+        recycled_first = block;
+        if (!recycled_last)
+          recycled_last = block;
+      } else {
+        ::operator delete(block);
+      }
+
+      block = next;
+    }
+
+    if (recycled_first)
+      this->give_back(recycled_first, recycled_last);
+
+    this->heap->push_many(this->batch->begin(), this->batch->end(), this->removed_callback);
+    return this->heap;
+  }
+
+  /**
+   * Pop top element from the queue, after merging buffered items.
+   *
+   * @result Top element returned.
+   * @raises EHeapQEmpty If the heap is empty.
+   */
+  T pop(void) { return this->flush()->pop(); }
+
+  /**
+   * Get top item stored in the heap, after merging buffered items.
+   *
+   * @result Top item stored (the top of the heap queue).
+   * @raises EHeapQEmpty If the heap is empty.
+   */
+  T get_top() { return this->flush()->get_top(); }
+
+  /**
+   * Remove the given item from the heap, after merging buffered items.
+   *
+   * @param item The item to be removed.
+   * @raises EHeapQNotFound If the given item is not present in the heap.
+   */
+  void remove(T item) { this->flush()->remove(item); }
+
+  /**
+   * Get number of items stored, after merging buffered items.
+   *
+   * @return Number of items stored.
+   */
+  size_t get_length() { return this->flush()->get_length(); }
+
+private:
+  EHeapQ<T, Compare, Hash> *heap;            /**< The heap queue items are merged into. */
+  std::vector<T> *batch;                     /**< Items taken from the buffer, reused across flushes. */
+  std::function<void(T)> removed_callback;   /**< Called with items not kept in the heap. */
+  std::atomic<Block *> head;                 /**< The top of the lock-free stack. */
+  std::atomic<Block *> free_blocks;          /**< Merged blocks of producers waiting to be reused. */
+
+  /**
+   * Allocate an empty block for the given number of items.
+   */
+  static Block *allocate(size_t capacity) {
+    Block *block = static_cast<Block *>(::operator new(sizeof(Block) + capacity * sizeof(T)));
+
+    block->next = NULL;
+    block->count = 0;
+    block->capacity = capacity;
+    return block;
+  }
+
+  /**
+   * Destroy items and free all the blocks in the given chain.
+   */
+  static void release(Block *block) {
+    while (block) {
+      Block *next = block->next;
+      T *items = block->items();
+
+      for (size_t i = 0; i < block->count; i++)
+        items[i].~T();
+
+      ::operator delete(block);
+      block = next;
+    }
+  }
+
+  /**
+   * Append a chain of blocks to the stack.
+   */
+  void append(Block *first, Block *last) {
+    Block *old_head = this->head.load(std::memory_order_relaxed);
+
+    do {
+      last->next = old_head;
+    } while (!this->head.compare_exchange_weak(old_head, first, std::memory_order_release,
+                                               std::memory_order_relaxed));
+  }
+
+  /**
+   * Return a chain of empty blocks to the free list. Producers only ever take the whole list, so pushing with
+   * compare-exchange does not suffer from ABA.
+   */
+  void give_back(Block *first, Block *last) {
+    Block *old_head = this->free_blocks.load(std::memory_order_relaxed);
+
+    do {
+      last->next = old_head;
+    } while (!this->free_blocks.compare_exchange_weak(old_head, first, std::memory_order_release,
+                                                      std::memory_order_relaxed));
+  }
+
+  /**
+   * Return blocks cached by a destroyed producer to the free list.
+   */
+  void recycle(Block *first) {
+    if (!first)
+      return;
+
+    Block *last = first;
+    while (last->next)
+      last = last->next;
+
+    this->give_back(first, last);
+  }
+};
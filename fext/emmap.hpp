@@ -0,0 +1,506 @@
+/*
+ * emmap - A persistent heap queue stored in a memory-mapped file.
+ * Copyright(C) 2020 Fridolin Pokorny
+ *
+ * This program is free software: you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * This module implements a storage backend for the heap queue that places
+ * the heap vector and a flat index (see EHeapQFlatSlots) in a memory-mapped
+ * file, so that the heap survives restarts and opens without a rebuild.
+ *
+ * The file holds a header and two images of the heap. The heap operates on a
+ * private (copy-on-write) mapping of the active image, hence changes do not
+ * reach the file until a checkpoint - the working image is copied to the
+ * inactive image, synced, and only then the header is switched to it and
+ * synced. A crash at any point leaves the file with the last checkpointed
+ * image consistent.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "eheapq.hpp"
+
+/**
+ * An exception raised when the heap file cannot be created, opened or synced.
+ */
+class EHeapQMmapError : public EHeapQException {
+public:
+  EHeapQMmapError(const std::string &message) : message(message) {}
+
+  virtual const char *what() const throw() { return this->message.c_str(); }
+
+private:
+  std::string message;
+};
+
+/**
+ * Magic bytes at the beginning of a heap file and the version of its layout.
+ */
+const char EHEAPQ_MMAP_MAGIC[8] = {'F', 'E', 'X', 'T', 'H', 'E', 'A', 'P'};
+const uint32_t EHEAPQ_MMAP_VERSION = 1;
+
+/**
+ * Alignment of the heap vector and slots in an image.
+ */
+const size_t EHEAPQ_MMAP_ALIGN = 64;
+
+/**
+ * A file storing two images of a heap - the heap vector of items of a fixed
+ * size and slots of the flat index. Slots are sized for the load factor of
+ * at most 1/2 with the maximum number of items stored.
+ */
+class EHeapQMmapFile {
+public:
+  /**
+   * Open the given heap file, the file is created if it does not exist.
+   *
+   * @param path Path to the heap file.
+   * @param capacity Maximum number of items stored, has to match the capacity the file was created with.
+   * @param item_size Size of an item stored, has to match the item size the file was created with.
+   * @raises EHeapQMmapError If the file cannot be opened or it does not match the parameters.
+   */
+  EHeapQMmapFile(const char *path, size_t capacity, size_t item_size) {
+    struct stat st;
+
+    if (capacity == 0 || capacity >= std::numeric_limits<uint32_t>::max())
+      throw EHeapQMmapError("capacity of a heap file has to be between 1 and 2^32 - 2");
+
+    this->header = NULL;
+    this->working = NULL;
+    this->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (this->fd < 0)
+      throw EHeapQMmapError(std::string("cannot open heap file: ") + strerror(errno));
+
+    try {
+      if (fstat(this->fd, &st) != 0)
+        this->throw_errno("cannot stat heap file");
+
+      this->page_size = sysconf(_SC_PAGESIZE);
+      this->capacity = capacity;
+      this->item_size = item_size;
+      this->slots_count = EHEAPQ_FLAT_INDEX_MIN_SLOTS;
+      while (this->slots_count < capacity * 2)
+        this->slots_count <<= 1;
+
+      this->heap_offset = EHEAPQ_MMAP_ALIGN;
+      this->slots_offset = align(this->heap_offset + capacity * item_size, EHEAPQ_MMAP_ALIGN);
+      this->image_size = align(this->slots_offset + this->slots_count * sizeof(uint32_t), this->page_size);
+
+      if (st.st_size == 0)
+        this->create();
+      else
+        this->load((size_t)st.st_size);
+    } catch (...) {
+      this->unmap();
+      close(this->fd);
+      throw;
+    }
+  }
+
+  /**
+   * Unmap the file, changes made since the last checkpoint are discarded.
+   */
+  ~EHeapQMmapFile() {
+    this->unmap();
+    close(this->fd);
+  }
+
+  /**
+   * Write the working image to the file. Once the call returns, the file
+   * holds the given number of items even if the process crashes.
+   *
+   * @param length Number of items stored in the heap vector.
+   * @raises EHeapQMmapError If the image cannot be synced.
+   */
+  void checkpoint(size_t length) {
+    uint64_t target = 1 - this->header->active;
+    char *image;
+
+    this->get_meta()->length = length;
+    this->get_meta()->generation = this->header->generation + 1;
+
+    image = (char *)mmap(NULL, this->image_size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd,
+                         this->get_image_offset(target));
+    if (image == MAP_FAILED)
+      this->throw_errno("cannot map heap image");
+
+    // Only items stored are copied, the rest of the heap vector is never read.
+    memcpy(image, this->working, this->heap_offset + length * this->item_size);
+    memcpy(image + this->slots_offset, this->working + this->slots_offset, this->slots_count * sizeof(uint32_t));
+
+    if (msync(image, this->image_size, MS_SYNC) != 0) {
+      munmap(image, this->image_size);
+      this->throw_errno("cannot sync heap image");
+    }
+    munmap(image, this->image_size);
+
+    // The header fits into a single sector, switching images is atomic.
+    this->header->active = target;
+    this->header->generation++;
+    if (msync(this->header, this->page_size, MS_SYNC) != 0)
+      this->throw_errno("cannot sync heap file header");
+
+    // Keep the working image at the same address - the heap vector and the index point into it.
+    this->map_working(this->working);
+  }
+
+  /**
+   * Get the heap vector of the working image.
+   */
+  void *get_heap() const noexcept { return this->working + this->heap_offset; }
+
+  /**
+   * Get slots of the flat index of the working image.
+   */
+  uint32_t *get_slots() const noexcept { return (uint32_t *)(this->working + this->slots_offset); }
+
+  /**
+   * Get the number of slots of the flat index, a power of two.
+   */
+  size_t get_slots_count() const noexcept { return this->slots_count; }
+
+  /**
+   * Get the maximum number of items stored.
+   */
+  size_t get_capacity() const noexcept { return this->capacity; }
+
+  /**
+   * Get the number of items stored at the last checkpoint.
+   */
+  size_t get_length() const noexcept { return this->get_meta()->length; }
+
+  /**
+   * Get the number of checkpoints done since the file was created.
+   */
+  uint64_t get_generation() const noexcept { return this->header->generation; }
+
+private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t item_size;
+    uint64_t capacity;
+    uint64_t active;      /**< Image the heap is loaded from, 0 or 1. */
+    uint64_t generation;  /**< Number of checkpoints done. */
+  };
+
+  struct Meta {
+    uint64_t length;      /**< Number of items stored in the image. */
+    uint64_t generation;  /**< Generation of the checkpoint that wrote the image. */
+  };
+
+  int fd;               /**< File descriptor of the heap file. */
+  Header *header;       /**< Shared mapping of the header page. */
+  char *working;        /**< Private mapping of the active image the heap operates on. */
+  size_t page_size;     /**< Size of a page, images are page-aligned. */
+  size_t capacity;      /**< Maximum number of items stored. */
+  size_t item_size;     /**< Size of an item stored. */
+  size_t slots_count;   /**< Number of slots of the flat index. */
+  size_t heap_offset;   /**< Offset of the heap vector in an image. */
+  size_t slots_offset;  /**< Offset of slots in an image. */
+  size_t image_size;    /**< Size of an image. */
+
+  static size_t align(size_t n, size_t alignment) noexcept { return (n + alignment - 1) / alignment * alignment; }
+
+  [[noreturn]] void throw_errno(const char *message) const {
+    throw EHeapQMmapError(std::string(message) + ": " + strerror(errno));
+  }
+
+  Meta *get_meta() const noexcept { return (Meta *)this->working; }
+
+  off_t get_image_offset(uint64_t image) const noexcept { return this->page_size + image * this->image_size; }
+
+  void map_header() {
+    void *header = mmap(NULL, this->page_size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+
+    if (header == MAP_FAILED)
+      this->throw_errno("cannot map heap file header");
+
+    this->header = (Header *)header;
+  }
+
+  void map_working(void *address) {
+    void *working = mmap(address, this->image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | (address ? MAP_FIXED : 0),
+                         this->fd, this->get_image_offset(this->header->active));
+
+    if (working == MAP_FAILED)
+      this->throw_errno("cannot map heap image");
+
+    this->working = (char *)working;
+  }
+
+  void create() {
+    uint32_t *slots;
+
+    if (ftruncate(this->fd, this->get_image_offset(2)) != 0)
+      this->throw_errno("cannot resize heap file");
+
+    this->map_header();
+    this->header->version = EHEAPQ_MMAP_VERSION;
+    this->header->item_size = this->item_size;
+    this->header->capacity = this->capacity;
+    this->header->active = 0;
+    this->header->generation = 0;
+
+    this->map_working(NULL);
+    slots = this->get_slots();
+    std::fill(slots, slots + this->slots_count, std::numeric_limits<uint32_t>::max());  // All slots empty.
+
+    // The magic is synced with the first checkpoint, a partially created file is not recognized.
+    memcpy(this->header->magic, EHEAPQ_MMAP_MAGIC, sizeof(EHEAPQ_MMAP_MAGIC));
+    this->checkpoint(0);
+  }
+
+  void load(size_t file_size) {
+    if (file_size < (size_t)this->get_image_offset(2))
+      throw EHeapQMmapError("heap file is truncated or created with a different capacity");
+
+    this->map_header();
+
+    if (memcmp(this->header->magic, EHEAPQ_MMAP_MAGIC, sizeof(EHEAPQ_MMAP_MAGIC)) != 0)
+      throw EHeapQMmapError("not a heap file");
+
+    if (this->header->version != EHEAPQ_MMAP_VERSION)
+      throw EHeapQMmapError("unsupported version of the heap file");
+
+    if (this->header->item_size != this->item_size || this->header->capacity != this->capacity)
+      throw EHeapQMmapError("heap file was created with a different item size or capacity");
+
+    this->map_working(NULL);
+  }
+
+  void unmap() noexcept {
+    if (this->working)
+      munmap(this->working, this->image_size);
+
+    if (this->header)
+      munmap(this->header, this->page_size);
+
+    this->working = NULL;
+    this->header = NULL;
+  }
+};
+
+/**
+ * An allocator placing the heap vector into the working image of a heap file.
+ * Elements are left uninitialized on default construction so that items
+ * stored in the file are adopted by EHeapQ::restore.
+ */
+template <class T> class EHeapQMmapAllocator {
+public:
+  typedef T value_type;
+
+  template <class U> struct rebind { typedef EHeapQMmapAllocator<U> other; };
+
+  std::shared_ptr<EHeapQMmapFile> file;  /**< The heap file, shared by rebound allocators. */
+
+  EHeapQMmapAllocator(const std::shared_ptr<EHeapQMmapFile> &file) : file(file) {}
+
+  template <class U> EHeapQMmapAllocator(const EHeapQMmapAllocator<U> &other) noexcept : file(other.file) {}
+
+  /**
+   * Get the heap vector of the working image - there is exactly one vector
+   * per file, reallocations map onto the same memory.
+   */
+  T *allocate(size_t n) {
+    if (n > this->file->get_capacity())
+      throw std::length_error("heap file capacity exceeded");
+
+    return (T *)this->file->get_heap();
+  }
+
+  void deallocate(T *ptr, size_t n) noexcept {}
+
+  template <class U> void construct(U *ptr) noexcept {}
+
+  template <class U, class... Args> void construct(U *ptr, Args &&... args) {
+    ::new ((void *)ptr) U(std::forward<Args>(args)...);
+  }
+
+  template <class U> bool operator==(const EHeapQMmapAllocator<U> &other) const noexcept {
+    return this->file == other.file;
+  }
+
+  template <class U> bool operator!=(const EHeapQMmapAllocator<U> &other) const noexcept {
+    return this->file != other.file;
+  }
+};
+
+/**
+ * A flat index (see EHeapQFlatSlots) with slots stored in the working image of
+ * a heap file. Slots are sized for the capacity of the file and never
+ * rehashed, the index is persisted together with the heap vector.
+ *
+ * Hash has to give the same values across runs - e.g. std::hash of integers.
+ */
+template <class T, class Hash = std::hash<T>, class Allocator = EHeapQMmapAllocator<T>> class EHeapQMmapIndex {
+private:
+  typedef EHeapQFlatSlots<T, Hash, uint32_t> Slots;
+
+  const std::vector<T, Allocator> *heap;  /**< The heap vector storing items indexed. */
+  std::shared_ptr<EHeapQMmapFile> file;   /**< The heap file storing slots. */
+  uint32_t *slots;                        /**< Slots storing positions. */
+  size_t slots_count;                     /**< Number of slots, a power of two. */
+  unsigned shift;                         /**< Shift used to get the home slot from a hash. */
+
+public:
+  typedef size_t Handle;
+
+  /**
+   * Constructor.
+   *
+   * @param heap The heap vector storing items indexed.
+   * @param allocator Allocator of the heap vector, slots are taken from its file.
+   */
+  EHeapQMmapIndex(const std::vector<T, Allocator> *heap, const Allocator &allocator)
+      : heap(heap), file(allocator.file) {
+    this->slots = this->file->get_slots();
+    this->slots_count = this->file->get_slots_count();
+    this->shift = Slots::get_shift(this->slots_count);
+  }
+
+  bool find(const T &item, Handle &handle) const {
+    return Slots::find(this->heap->data(), this->slots, this->slots_count, this->shift, item, handle);
+  }
+
+  void prefetch(const T &item) const noexcept { Slots::prefetch(this->slots, this->shift, item); }
+
+  size_t get(Handle handle) const noexcept { return this->slots[handle]; }
+
+  void set(Handle handle, size_t pos) noexcept { this->slots[handle] = (uint32_t)pos; }
+
+  bool insert(const T &item, size_t pos) {
+    Handle handle;
+
+    if (this->find(item, handle))
+      return false;
+
+    this->slots[handle] = (uint32_t)pos;
+    return true;
+  }
+
+  void erase(Handle handle) noexcept {
+    Slots::erase(this->heap->data(), this->slots, this->slots_count, this->shift, handle);
+  }
+
+  void clear() noexcept { std::fill(this->slots, this->slots + this->slots_count, Slots::EMPTY); }
+
+  void reserve(size_t n) {
+    if (n > this->file->get_capacity())
+      throw std::length_error("heap file capacity exceeded");
+  }
+
+  /**
+   * Slots are part of the file, nothing to release.
+   */
+  void shrink() noexcept {}
+
+  /**
+   * Slots were persisted together with items, nothing to rebuild.
+   */
+  void restore() noexcept {}
+
+  void get_memory_stats(EHeapQMemoryStats &stats) const noexcept {
+    stats.index_buckets = this->slots_count * sizeof(uint32_t);
+    stats.index_nodes = 0;
+    stats.slack = 0;
+  }
+};
+
+/**
+ * A heap queue of trivially copyable items stored in a memory-mapped file
+ * (see EHeapQMmapFile). The heap opens in O(1) without a rebuild, operations
+ * stay O(log(N)). Changes are persisted by checkpoint, the heap is
+ * checkpointed also on destruction.
+ */
+template <class T, class Compare = std::less<T>, class Hash = std::hash<T>> class EHeapQMmap {
+  static_assert(std::is_trivially_copyable<T>::value, "items stored in a heap file have to be trivially copyable");
+
+public:
+  typedef EHeapQ<T, Compare, Hash, EHeapQMmapAllocator<T>, EHeapQMmapIndex<T, Hash>> Heap;
+
+  /**
+   * Constructor.
+   *
+   * @param path Path to the heap file, created if it does not exist.
+   * @param size Maximum number of items that can be stored in the heap, fixed when the file is created.
+   * @raises EHeapQMmapError If the file cannot be opened or it does not match the parameters.
+   */
+  EHeapQMmap(const char *path, size_t size) {
+    this->file = std::make_shared<EHeapQMmapFile>(path, size, sizeof(T));
+    this->heap = new Heap(size, EHeapQMmapAllocator<T>(this->file));
+    this->heap->reserve(size);
+    this->heap->restore(this->file->get_length());
+  }
+
+  ~EHeapQMmap() {
+    try {
+      this->checkpoint();
+    } catch (EHeapQMmapError &exc) {
+      // The last checkpointed image stays consistent.
+    }
+
+    delete this->heap;
+  }
+
+  /**
+   * Persist the current state of the heap, see EHeapQMmapFile::checkpoint.
+   *
+   * @raises EHeapQMmapError If the image cannot be synced.
+   */
+  void checkpoint() { this->file->checkpoint(this->heap->get_length()); }
+
+  /**
+   * Get the number of checkpoints done since the file was created.
+   */
+  uint64_t get_generation() const noexcept { return this->file->get_generation(); }
+
+  /**
+   * Get the heap queue stored in the file, see EHeapQ for operations.
+   */
+  Heap *get_heap() const noexcept { return this->heap; }
+
+  T get_top() const { return this->heap->get_top(); }
+
+  size_t get_size() const noexcept { return this->heap->get_size(); }
+
+  size_t get_length() const noexcept { return this->heap->get_length(); }
+
+  void push(T item, std::function<void(T)> removed_callback = NULL) { this->heap->push(item, removed_callback); }
+
+  T pushpop(T item) { return this->heap->pushpop(item); }
+
+  T pop() { return this->heap->pop(); }
+
+  T replace(T item) { return this->heap->replace(item); }
+
+  void remove(T item) { this->heap->remove(item); }
+
+  void clear() { this->heap->clear(); }
+
+private:
+  std::shared_ptr<EHeapQMmapFile> file;  /**< The heap file. */
+  Heap *heap;                            /**< The heap operating on the working image of the file. */
+};
@@ -0,0 +1,353 @@
+/*
+ * emultiq - A relaxed concurrent priority queue built on top of eheapq.
+ * Copyright(C) 2020 Fridolin Pokorny
+ *
+ * This program is free software: you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * This module implements a MultiQueue - a relaxed concurrent priority queue
+ * (see Rihani, Sanders, Dementiev: MultiQueues: Simpler, Faster, and Better
+ * Relaxed Concurrent Priority Queues). The queue is made of c*P heap queues
+ * (shards), each protected by its own lock. Items are pushed to a random
+ * shard, pop takes the better top of two randomly chosen shards. Locks are
+ * only try-locked - if a shard is busy, another one is chosen.
+ *
+ * The pop operation is relaxed - the item returned is not necessarily the top
+ * item of the whole queue, but it is one of the top items with high
+ * probability.
+ *
+ * Removal of an item is routed to the shard storing the item using an index
+ * that is sharded as well. Operations on the same item are linearizable only
+ * if they do not overlap in time.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#include "eheapq.hpp"
+
+const size_t EMULTIQ_DEFAULT_FACTOR = 2;
+
+/**
+ * Alignment of shards, shards start on a cache line of their own.
+ */
+const size_t EMULTIQ_CACHE_LINE = 64;
+
+/**
+ * Implementation of a relaxed concurrent min or max heap queue. The heap
+ * cannot store multiple values that are equal.
+ */
+template <class T, class Compare = std::less<T>, class Hash = std::hash<T>> class EMultiQ {
+public:
+  Compare comp;         /**< The function class that implements comparision. */
+
+  /**
+   * Constructor.
+   *
+   * @param threads Number of threads expected to access the queue, 0 to use the hardware concurrency.
+   * @param factor Number of shards per thread (the c constant in c*P shards).
+   * @param comp The function class used to compare items, copied to heaps of all the shards.
+   */
+  EMultiQ(size_t threads = 0, size_t factor = EMULTIQ_DEFAULT_FACTOR, const Compare &comp = Compare()) : comp(comp) {
+    if (threads == 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+
+    this->shards_count = std::max((size_t)1, threads * factor);
+    this->shards = allocate_aligned<Shard>(this->shards_count);
+    try {
+      this->index = allocate_aligned<IndexShard>(this->shards_count);
+    } catch (...) {
+      free_aligned(this->shards, this->shards_count);
+      throw;
+    }
+
+    // Items of a shard are ordered the same way as tops of shards are compared.
+    for (size_t i = 0; i < this->shards_count; i++)
+      this->shards[i].heap.comp = comp;
+
+    this->length.store(0);
+  }
+
+  ~EMultiQ() {
+    free_aligned(this->shards, this->shards_count);
+    free_aligned(this->index, this->shards_count);
+  }
+
+  /**
+   * Push the given item to a randomly chosen shard.
+   *
+   * @param item The item to be stored in the queue.
+   * @raises EHeapQAlreadyPresent If the given item is already present in the queue.
+   */
+  void push(T item) {
+    size_t shard_idx = this->random() % this->shards_count;
+    IndexShard &index = this->get_index(item);
+
+    {
+      std::lock_guard<std::mutex> guard(index.lock);
+      if (!index.map.insert({item, shard_idx}).second)
+        throw EHeapQAlreadyPresentExc;
+    }
+
+    for (;;) {
+      Shard &shard = this->shards[shard_idx];
+
+      if (shard.lock.try_lock()) {
+        shard.heap.push(item);
+        shard.lock.unlock();
+        break;
+      }
+
+      // The shard is busy, choose another one and record the new location.
+      shard_idx = this->random() % this->shards_count;
+      std::lock_guard<std::mutex> guard(index.lock);
+      index.map[item] = shard_idx;
+    }
+
+    this->length.fetch_add(1);
+  }
+
+  /**
+   * Pop top element of two randomly chosen shards.
+   *
+   * @param item Set to the item popped.
+   * @result true if an item was popped, false if the queue is empty.
+   */
+  bool try_pop(T &item) {
+    size_t attempts = 0;
+
+    while (this->length.load() > 0) {
+      if (++attempts > this->shards_count * 4) {
+        // Too many empty or busy shards hit, do a blocking scan so that progress is guaranteed.
+        if (this->pop_scan(item))
+          return true;
+
+        attempts = 0;
+        continue;
+      }
+
+      Shard *a = &this->shards[this->random() % this->shards_count];
+      Shard *b = &this->shards[this->random() % this->shards_count];
+
+      if (!a->lock.try_lock())
+        continue;
+
+      if (a != b && !b->lock.try_lock()) {
+        a->lock.unlock();
+        continue;
+      }
+
+      Shard *chosen = this->choose(a, b);
+      bool found = chosen->heap.get_length() > 0;
+      if (found)
+        item = chosen->heap.pop();
+
+      if (a != b)
+        b->lock.unlock();
+      a->lock.unlock();
+
+      if (found) {
+        this->popped(item);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * Pop top element of two randomly chosen shards.
+   *
+   * @result The item popped.
+   * @raises EHeapQEmpty If the queue is empty.
+   */
+  T pop(void) {
+    T item;
+
+    if (!this->try_pop(item))
+      throw EHeapQEmptyExc;
+
+    return item;
+  }
+
+  /**
+   * Remove the given item from the queue. This operates in O(log(N/(c*P))) time.
+   *
+   * @param item The item to be removed.
+   * @raises EHeapQNotFound If the given item is not present in the queue.
+   */
+  void remove(T item) {
+    IndexShard &index = this->get_index(item);
+    size_t shard_idx;
+
+    {
+      std::lock_guard<std::mutex> guard(index.lock);
+      auto idx_value = index.map.find(item);
+      if (idx_value == index.map.end())
+        throw EHeapQNotFoundExc;
+
+      shard_idx = idx_value->second;
+    }
+
+    {
+      // Blocking lock - the item is in this shard unless it was popped concurrently.
+      std::lock_guard<std::mutex> guard(this->shards[shard_idx].lock);
+      this->shards[shard_idx].heap.remove(item);
+    }
+
+    this->popped(item);
+  }
+
+  /**
+   * Get number of items currently stored.
+   *
+   * @return Number of items currently stored, approximate in case of concurrent modifications.
+   */
+  size_t get_length() const noexcept { return this->length.load(); }
+
+  /**
+   * Get number of shards used.
+   *
+   * @return Number of shards used.
+   */
+  size_t get_shards_count() const noexcept { return this->shards_count; }
+
+private:
+  /**
+   * A heap queue with its lock, aligned to a cache line to avoid false sharing.
+   */
+  struct alignas(EMULTIQ_CACHE_LINE) Shard {
+    std::mutex lock;                     /**< Lock guarding the shard. */
+    EHeapQ<T, Compare, Hash> heap;       /**< Heap queue storing items of the shard. */
+  };
+
+  /**
+   * A part of the index mapping items to shards storing them, aligned to a cache line to avoid false sharing.
+   */
+  struct alignas(EMULTIQ_CACHE_LINE) IndexShard {
+    std::mutex lock;                                  /**< Lock guarding the index shard. */
+    std::unordered_map<T, size_t, Hash> map;          /**< Item to shard mapping. */
+  };
+
+  /**
+   * Allocate and construct n objects aligned to a cache line - new[] does not respect extended alignment before C++17.
+   */
+  template <class S> static S *allocate_aligned(size_t n) {
+    void *ptr;
+    size_t i = 0;
+
+    if (posix_memalign(&ptr, alignof(S), n * sizeof(S)) != 0)
+      throw std::bad_alloc();
+
+    S *result = static_cast<S *>(ptr);
+    try {
+      for (; i < n; i++)
+        new (result + i) S();
+    } catch (...) {
+      free_aligned(result, i);
+      throw;
+    }
+
+    return result;
+  }
+
+  /**
+   * Destroy n objects allocated by allocate_aligned and free their memory.
+   */
+  template <class S> static void free_aligned(S *objects, size_t n) noexcept {
+    for (size_t i = 0; i < n; i++)
+      objects[i].~S();
+    free(objects);
+  }
+
+  Shard *shards;               /**< Shards storing items. */
+  IndexShard *index;           /**< Index to shards, sharded by item hash. */
+  size_t shards_count;         /**< Number of shards (and index shards). */
+  std::atomic<size_t> length;  /**< Number of items stored. */
+
+  /**
+   * Get a pseudo-random number using a per-thread xorshift generator.
+   */
+  static uint64_t random() noexcept {
+    static thread_local uint64_t state = 0;
+
+    if (state == 0)
+      state = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+
+  IndexShard &get_index(T item) {
+    return this->index[Hash()(item) % this->shards_count];
+  }
+
+  /**
+   * Choose shard with the better top item, both shards need to be locked.
+   */
+  Shard *choose(Shard *a, Shard *b) {
+    if (a->heap.get_length() == 0)
+      return b;
+
+    if (b->heap.get_length() == 0)
+      return a;
+
+    return this->comp(b->heap.get_top(), a->heap.get_top()) ? b : a;
+  }
+
+  /**
+   * Pop top item of the first non-empty shard, shards are locked one by one.
+   */
+  bool pop_scan(T &item) {
+    for (size_t i = 0; i < this->shards_count; i++) {
+      bool found;
+
+      {
+        std::lock_guard<std::mutex> guard(this->shards[i].lock);
+        found = this->shards[i].heap.get_length() > 0;
+        if (found)
+          item = this->shards[i].heap.pop();
+      }
+
+      if (found) {
+        this->popped(item);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * Record the given item is no longer stored in any of the shards.
+   */
+  void popped(T item) {
+    IndexShard &index = this->get_index(item);
+
+    {
+      std::lock_guard<std::mutex> guard(index.lock);
+      index.map.erase(item);
+    }
+
+    this->length.fetch_sub(1);
+  }
+};
@@ -0,0 +1,239 @@
+/*
+ * etrace - Recording and reading traces of heap queue operations.
+ * Copyright(C) 2020 Fridolin Pokorny
+ *
+ * This program is free software: you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * A trace is a binary file with a header followed by records of operations
+ * done on a heap queue, in native byte order:
+ *
+ *   header  - magic "FEXTTRC\0", version (uint32), key width (uint32), heap size (uint64)
+ *   record  - operation (uint8), item id (uint64), key (key width doubles, push, pushpop and replace only)
+ *
+ * Item ids are opaque, an id identifies an item while it is stored in the
+ * heap. Records of operations returning an item (pop, get_max) store the id
+ * of the item returned, so that a replay can be verified.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "eheapq.hpp"
+
+/**
+ * Operations recorded in a trace.
+ */
+enum EHeapQTraceOp : uint8_t {
+  EHEAPQ_TRACE_PUSH = 1,
+  EHEAPQ_TRACE_POP = 2,
+  EHEAPQ_TRACE_PUSHPOP = 3,
+  EHEAPQ_TRACE_REMOVE = 4,
+  EHEAPQ_TRACE_REPLACE = 5,
+  EHEAPQ_TRACE_GET_MAX = 6,
+  EHEAPQ_TRACE_CLEAR = 7,
+};
+
+const char EHEAPQ_TRACE_MAGIC[8] = {'F', 'E', 'X', 'T', 'T', 'R', 'C', '\0'};
+const uint32_t EHEAPQ_TRACE_VERSION = 1;
+
+/**
+ * Size of the buffer used for writing and reading traces.
+ */
+const size_t EHEAPQ_TRACE_BUFFER_SIZE = 1024 * 1024;
+
+/**
+ * An exception raised when a trace cannot be written or read.
+ */
+class EHeapQTraceError : public EHeapQException {
+public:
+  EHeapQTraceError(const std::string &message) : message(message) {}
+
+  virtual const char *what() const throw() { return this->message.c_str(); }
+
+private:
+  std::string message;
+};
+
+/**
+ * A record of an operation read from a trace.
+ */
+struct EHeapQTraceRecord {
+  EHeapQTraceOp op;          /**< The operation done. */
+  uint64_t item;             /**< Id of the item pushed, removed or returned. */
+  std::vector<double> key;   /**< Key of the item pushed, empty for other operations. */
+};
+
+static inline bool eheapq_trace_has_key(uint8_t op) noexcept {
+  return op == EHEAPQ_TRACE_PUSH || op == EHEAPQ_TRACE_PUSHPOP || op == EHEAPQ_TRACE_REPLACE;
+}
+
+/**
+ * Writer of traces, records are buffered.
+ */
+class EHeapQTraceWriter {
+public:
+  /**
+   * Create the given trace file, an existing file is truncated.
+   *
+   * @param path Path to the trace file.
+   * @param key_width Number of components of keys recorded.
+   * @param size Maximum number of items stored in the heap traced.
+   * @raises EHeapQTraceError If the file cannot be created.
+   */
+  EHeapQTraceWriter(const char *path, size_t key_width, size_t size) : key_width(key_width), failed(false) {
+    uint32_t version = EHEAPQ_TRACE_VERSION, width = (uint32_t)key_width;
+    uint64_t heap_size = size;
+
+    this->file = fopen(path, "wb");
+    if (!this->file)
+      throw EHeapQTraceError(std::string("cannot create trace file: ") + strerror(errno));
+
+    setvbuf(this->file, NULL, _IOFBF, EHEAPQ_TRACE_BUFFER_SIZE);
+    this->write(EHEAPQ_TRACE_MAGIC, sizeof(EHEAPQ_TRACE_MAGIC));
+    this->write(&version, sizeof(version));
+    this->write(&width, sizeof(width));
+    this->write(&heap_size, sizeof(heap_size));
+  }
+
+  ~EHeapQTraceWriter() {
+    if (this->file)
+      fclose(this->file);
+  }
+
+  /**
+   * Record the given operation.
+   *
+   * @param op The operation done.
+   * @param item Id of the item pushed, removed or returned.
+   * @param key Key of the item pushed (key_width components) for push, pushpop and replace, NULL otherwise.
+   */
+  void record(EHeapQTraceOp op, uint64_t item, const double *key = NULL) noexcept {
+    uint8_t op_byte = op;
+
+    this->write(&op_byte, sizeof(op_byte));
+    this->write(&item, sizeof(item));
+
+    if (eheapq_trace_has_key(op))
+      this->write(key, this->key_width * sizeof(double));
+  }
+
+  /**
+   * Flush records buffered and close the file.
+   *
+   * @raises EHeapQTraceError If any of the records could not be written.
+   */
+  void close() {
+    bool failed = fclose(this->file) != 0 || this->failed;
+
+    this->file = NULL;
+    if (failed)
+      throw EHeapQTraceError("cannot write trace file");
+  }
+
+private:
+  FILE *file;        /**< The trace file. */
+  size_t key_width;  /**< Number of components of keys recorded. */
+  bool failed;       /**< Set if writing any of the records failed. */
+
+  void write(const void *data, size_t size) noexcept {
+    if (fwrite(data, size, 1, this->file) != 1)
+      this->failed = true;
+  }
+};
+
+/**
+ * Reader of traces.
+ */
+class EHeapQTraceReader {
+public:
+  /**
+   * Open the given trace file and read its header.
+   *
+   * @param path Path to the trace file.
+   * @raises EHeapQTraceError If the file cannot be opened or it is not a trace.
+   */
+  EHeapQTraceReader(const char *path) {
+    char magic[sizeof(EHEAPQ_TRACE_MAGIC)];
+    uint32_t version, width;
+    uint64_t size;
+
+    this->file = fopen(path, "rb");
+    if (!this->file)
+      throw EHeapQTraceError(std::string("cannot open trace file: ") + strerror(errno));
+
+    setvbuf(this->file, NULL, _IOFBF, EHEAPQ_TRACE_BUFFER_SIZE);
+    if (!this->read(magic, sizeof(magic)) || memcmp(magic, EHEAPQ_TRACE_MAGIC, sizeof(magic)) != 0 ||
+        !this->read(&version, sizeof(version)) || version != EHEAPQ_TRACE_VERSION || !this->read(&width, sizeof(width)) ||
+        width == 0 || !this->read(&size, sizeof(size))) {
+      fclose(this->file);
+      throw EHeapQTraceError("not a trace file or unsupported version");
+    }
+
+    this->key_width = width;
+    this->size = size;
+  }
+
+  ~EHeapQTraceReader() { fclose(this->file); }
+
+  /**
+   * Read the next record.
+   *
+   * @param record Set to the record read.
+   * @result true if a record was read, false at the end of the trace.
+   * @raises EHeapQTraceError If the trace is truncated or corrupted.
+   */
+  bool next(EHeapQTraceRecord &record) {
+    uint8_t op;
+
+    if (!this->read(&op, sizeof(op)))
+      return false;
+
+    if (op < EHEAPQ_TRACE_PUSH || op > EHEAPQ_TRACE_CLEAR)
+      throw EHeapQTraceError("unknown operation in trace file");
+
+    record.op = (EHeapQTraceOp)op;
+    if (!this->read(&record.item, sizeof(record.item)))
+      throw EHeapQTraceError("truncated trace file");
+
+    record.key.resize(eheapq_trace_has_key(op) ? this->key_width : 0);
+    if (!record.key.empty() && !this->read(record.key.data(), record.key.size() * sizeof(double)))
+      throw EHeapQTraceError("truncated trace file");
+
+    return true;
+  }
+
+  /**
+   * Get the number of components of keys recorded.
+   */
+  size_t get_key_width() const noexcept { return this->key_width; }
+
+  /**
+   * Get the maximum number of items stored in the heap traced.
+   */
+  size_t get_size() const noexcept { return this->size; }
+
+private:
+  FILE *file;        /**< The trace file. */
+  size_t key_width;  /**< Number of components of keys recorded. */
+  size_t size;       /**< Maximum number of items stored in the heap traced. */
+
+  bool read(void *data, size_t size) noexcept { return fread(data, size, 1, this->file) == 1; }
+};
@@ -0,0 +1,547 @@
+/*
+ * ewide - A wide-node heap queue with keys stored apart from items.
+ * Copyright(C) 2020 Fridolin Pokorny
+ *
+ * This program is free software: you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * This module implements a d-ary (8-ary by default) min-heap queue for very
+ * large heaps, where the depth of sift paths and cache misses dominate. Keys
+ * (float or double) are kept in a separate array from items (structure of
+ * arrays), children of a node are stored next to each other and the key array
+ * is laid out so that keys of all children of a node share one aligned block
+ * of Arity keys - one cache line for 8 doubles or 16 floats. The smallest
+ * child is selected with AVX2 compare-and-reduce on x86-64 CPUs supporting
+ * it (detected at runtime), a scalar loop is used otherwise. Define
+ * EHEAPQ_NO_SIMD to compile the scalar selection only.
+ *
+ * Positions of items are kept in EHeapQFlatIndex, as in EHeapQCompact.
+ */
+
+#pragma once
+
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include "eheapq.hpp"
+
+#if !defined(EHEAPQ_NO_SIMD) && defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define EHEAPQ_WIDE_AVX2 1
+#endif
+
+/**
+ * Alignment of the key array, in bytes.
+ */
+const size_t EHEAPQ_WIDE_ALIGN = 64;
+
+/**
+ * An allocator returning memory aligned to EHEAPQ_WIDE_ALIGN bytes.
+ */
+template <class T> struct EHeapQAlignedAllocator {
+  typedef T value_type;
+
+  EHeapQAlignedAllocator() noexcept {}
+  template <class U> EHeapQAlignedAllocator(const EHeapQAlignedAllocator<U> &other) noexcept {}
+
+  T *allocate(size_t n) {
+    void *ptr;
+
+    if (posix_memalign(&ptr, EHEAPQ_WIDE_ALIGN, n * sizeof(T)) != 0)
+      throw std::bad_alloc();
+
+    return (T *)ptr;
+  }
+
+  void deallocate(T *ptr, size_t n) noexcept { free(ptr); }
+
+  template <class U> bool operator==(const EHeapQAlignedAllocator<U> &other) const noexcept { return true; }
+  template <class U> bool operator!=(const EHeapQAlignedAllocator<U> &other) const noexcept { return false; }
+};
+
+/**
+ * Selection of the smallest key out of Arity keys using a scalar loop - the first one if there are more.
+ */
+template <class Key, size_t Arity> struct EHeapQWideScalar {
+  static size_t select(const Key *keys) noexcept {
+    size_t result = 0;
+
+    for (size_t i = 1; i < Arity; i++) {
+      if (keys[i] < keys[result])
+        result = i;
+    }
+
+    return result;
+  }
+};
+
+#ifdef EHEAPQ_WIDE_AVX2
+/**
+ * Detect whether the CPU supports AVX2.
+ */
+static inline bool eheapq_wide_has_avx2() noexcept {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+/**
+ * AVX2 operations on lanes of keys of the given type.
+ */
+template <class Key> struct EHeapQAvx2Lanes {
+  static const size_t COUNT = 0;  /**< Keys of other types are not vectorized. */
+};
+
+template <> struct EHeapQAvx2Lanes<double> {
+  typedef __m256d Vector;
+  static const size_t COUNT = 4;
+
+  __attribute__((target("avx2"))) static Vector load(const double *keys) noexcept { return _mm256_loadu_pd(keys); }
+  __attribute__((target("avx2"))) static Vector min(Vector a, Vector b) noexcept { return _mm256_min_pd(a, b); }
+
+  /**
+   * Broadcast the smallest lane to all the lanes.
+   */
+  __attribute__((target("avx2"))) static Vector reduce(Vector v) noexcept {
+    v = _mm256_min_pd(v, _mm256_permute2f128_pd(v, v, 1));
+    return _mm256_min_pd(v, _mm256_permute_pd(v, 5));
+  }
+
+  /**
+   * Get a bit mask of lanes equal in both vectors.
+   */
+  __attribute__((target("avx2"))) static unsigned equal(Vector a, Vector b) noexcept {
+    return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ));
+  }
+};
+
+template <> struct EHeapQAvx2Lanes<float> {
+  typedef __m256 Vector;
+  static const size_t COUNT = 8;
+
+  __attribute__((target("avx2"))) static Vector load(const float *keys) noexcept { return _mm256_loadu_ps(keys); }
+  __attribute__((target("avx2"))) static Vector min(Vector a, Vector b) noexcept { return _mm256_min_ps(a, b); }
+
+  __attribute__((target("avx2"))) static Vector reduce(Vector v) noexcept {
+    v = _mm256_min_ps(v, _mm256_permute2f128_ps(v, v, 1));
+    v = _mm256_min_ps(v, _mm256_permute_ps(v, 0x4E));
+    return _mm256_min_ps(v, _mm256_permute_ps(v, 0xB1));
+  }
+
+  __attribute__((target("avx2"))) static unsigned equal(Vector a, Vector b) noexcept {
+    return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_EQ_OQ));
+  }
+};
+
+/**
+ * Selection of the smallest key out of Arity keys using AVX2 - the minimum of all the lanes is
+ * broadcast and compared to the keys, the first lane equal to it is selected.
+ */
+template <class Key, size_t Arity> struct EHeapQWideAvx2 {
+  typedef EHeapQAvx2Lanes<Key> Lanes;
+  static const size_t VECTORS = Lanes::COUNT ? Arity / Lanes::COUNT : 0;
+
+  /**
+   * Vectorized selection is used only if keys of a node fill whole vectors.
+   */
+  static const bool SUPPORTED = Lanes::COUNT != 0 && Arity % Lanes::COUNT == 0;
+
+  __attribute__((target("avx2"))) static size_t select(const Key *keys) noexcept {
+    typename Lanes::Vector vectors[VECTORS], smallest;
+    unsigned mask = 0;
+
+    smallest = vectors[0] = Lanes::load(keys);
+    for (size_t i = 1; i < VECTORS; i++) {
+      vectors[i] = Lanes::load(keys + i * Lanes::COUNT);
+      smallest = Lanes::min(smallest, vectors[i]);
+    }
+
+    smallest = Lanes::reduce(smallest);
+    for (size_t i = 0; i < VECTORS; i++)
+      mask |= Lanes::equal(vectors[i], smallest) << (i * Lanes::COUNT);
+
+    return __builtin_ctz(mask);
+  }
+};
+#endif
+
+/**
+ * A d-ary min-heap queue of items with float or double keys, keys are stored
+ * apart from items. Items have to be unique, keys must not be NaN.
+ */
+template <class Key, class Item, size_t Arity = 8, class Hash = std::hash<Item>> class EHeapQWide {
+  static_assert(std::is_floating_point<Key>::value, "keys have to be float or double");
+  static_assert(Arity >= 2 && Arity <= 32 && (Arity & (Arity - 1)) == 0, "arity has to be a power of two up to 32");
+
+public:
+  /**
+   * Constructor.
+   *
+   * @param size Maximum number of items that can be stored in the heap.
+   */
+  EHeapQWide(size_t size = EHEAPQ_DEFAULT_SIZE) : index(&this->items, std::allocator<Item>()) {
+    this->size = size;
+    this->keys.assign(Arity, INF);
+#ifdef EHEAPQ_WIDE_AVX2
+    this->vectorized = EHeapQWideAvx2<Key, Arity>::SUPPORTED && eheapq_wide_has_avx2();
+#else
+    this->vectorized = false;
+#endif
+  }
+
+  /**
+   * Get top item stored in the heap - the one with the smallest key.
+   *
+   * @raises EHeapQEmpty If the heap is empty.
+   */
+  Item get_top() const {
+    this->throw_on_empty();
+    return this->items[0];
+  }
+
+  /**
+   * Get key of the top item stored in the heap.
+   *
+   * @raises EHeapQEmpty If the heap is empty.
+   */
+  Key get_top_key() const {
+    this->throw_on_empty();
+    return this->keys[OFFSET];
+  }
+
+  /**
+   * Get key of the given item.
+   *
+   * @raises EHeapQNotFound If the given item is not present in the heap.
+   */
+  Key get_key(const Item &item) const {
+    IndexHandle handle;
+
+    if (!this->index.find(item, handle))
+      throw EHeapQNotFoundExc;
+
+    return this->keys[OFFSET + this->index.get(handle)];
+  }
+
+  /**
+   * Check whether the given item is stored in the heap.
+   */
+  bool contains(const Item &item) const {
+    IndexHandle handle;
+    return this->index.find(item, handle);
+  }
+
+  size_t get_size() const noexcept { return this->size; }
+  size_t get_length() const noexcept { return this->items.size(); }
+
+  /**
+   * Check whether the smallest child is selected using SIMD instructions.
+   */
+  bool is_vectorized() const noexcept { return this->vectorized; }
+
+  /**
+   * Use SIMD instructions for selecting the smallest child if supported, the scalar loop otherwise.
+   *
+   * @result true if SIMD instructions are used.
+   */
+  bool set_vectorized(bool vectorized) noexcept {
+#ifdef EHEAPQ_WIDE_AVX2
+    this->vectorized = vectorized && EHeapQWideAvx2<Key, Arity>::SUPPORTED && eheapq_wide_has_avx2();
+#endif
+    return this->vectorized;
+  }
+
+  /**
+   * Push the given item to the heap.
+   *
+   * @param key Key of the item.
+   * @param item The item to be stored in the heap.
+   * @param removed_callback Called with the item that is not kept in the heap if the heap is full -
+   *                         either the top item removed or the pushed item itself.
+   * @raises EHeapQAlreadyPresent If the given item is already present in the heap.
+   */
+  void push(Key key, Item item, std::function<void(Item)> removed_callback = NULL) {
+    size_t pos = this->items.size();
+
+    if (pos == this->size) {
+      Item removed = this->pushpop(key, item);
+
+      if (removed_callback)
+        removed_callback(removed);
+
+      return;
+    }
+
+    if (this->contains(item))
+      throw EHeapQAlreadyPresentExc;
+
+    // Keys of nodes not stored yet are kept at infinity up to the end of the last block of children.
+    if (OFFSET + pos == this->keys.size())
+      this->keys.resize(this->keys.size() + Arity, INF);
+
+    this->items.push_back(item);
+    try {
+      this->index.insert(item, pos);
+    } catch (...) {
+      this->items.pop_back();
+      throw;
+    }
+
+    this->sift_to_root(pos, key, item, NULL);
+  }
+
+  /**
+   * A fast version of push followed by a pop.
+   *
+   * @result The item with the smallest key - the given item if its key is not larger than the top key.
+   * @raises EHeapQAlreadyPresent If the given item is already present in the heap.
+   */
+  Item pushpop(Key key, Item item) {
+    if (this->contains(item))
+      throw EHeapQAlreadyPresentExc;
+
+    if (this->items.empty() || !(this->keys[OFFSET] < key))
+      return item;
+
+    return this->replace_top(key, item);
+  }
+
+  /**
+   * Pop the top item and push the given item.
+   *
+   * @result The top item that is replaced.
+   * @raises EHeapQEmpty If the heap is empty.
+   * @raises EHeapQAlreadyPresent If the given item is already present in the heap.
+   */
+  Item replace(Key key, Item item) {
+    this->throw_on_empty();
+
+    if (this->contains(item))
+      throw EHeapQAlreadyPresentExc;
+
+    return this->replace_top(key, item);
+  }
+
+  /**
+   * Pop the top item - the one with the smallest key.
+   *
+   * @raises EHeapQEmpty If the heap is empty.
+   */
+  Item pop() {
+    this->throw_on_empty();
+
+    Item result = this->items[0];
+    this->remove_at(0);
+    return result;
+  }
+
+  /**
+   * Remove the given item from the heap.
+   *
+   * @raises EHeapQNotFound If the given item is not present in the heap.
+   */
+  void remove(const Item &item) {
+    IndexHandle handle;
+
+    if (!this->index.find(item, handle))
+      throw EHeapQNotFoundExc;
+
+    this->remove_at(this->index.get(handle));
+  }
+
+  /**
+   * Remove all the items stored in the heap.
+   */
+  void clear() {
+    this->items.clear();
+    this->keys.assign(Arity, INF);
+    this->index.clear();
+  }
+
+  /**
+   * Preallocate memory for the given number of items.
+   */
+  void reserve(size_t n) {
+    this->items.reserve(n);
+    this->keys.reserve((OFFSET + n + Arity - 1) / Arity * Arity);
+    this->index.reserve(n);
+  }
+
+  /**
+   * Get items stored, in the heap order.
+   */
+  const std::vector<Item> &get_items() const noexcept { return this->items; }
+
+private:
+  typedef EHeapQFlatIndex<Item, Hash, uint32_t, std::allocator<Item>> Index;
+  typedef typename Index::Handle IndexHandle;
+
+  /**
+   * Keys are shifted in the key array so that children of the node at position pos, stored at
+   * positions Arity * pos + 1 to Arity * pos + Arity, start at a multiple of Arity.
+   */
+  static const size_t OFFSET = Arity - 1;
+  static constexpr Key INF = std::numeric_limits<Key>::infinity();
+
+  std::vector<Item> items;                               /**< Items stored, in the heap order. */
+  std::vector<Key, EHeapQAlignedAllocator<Key>> keys;    /**< Keys of items at OFFSET, infinity past the last item. */
+  Index index;                                           /**< Positions of items stored. */
+  size_t size;                                           /**< The maximum number of items stored in the heap. */
+  bool vectorized;                                       /**< Set if SIMD instructions select the smallest child. */
+
+  void throw_on_empty() const {
+    if (this->items.empty())
+      throw EHeapQEmptyExc;
+  }
+
+  Item replace_top(Key key, Item item) {
+    IndexHandle handle;
+    Item result = this->items[0];
+
+    this->index.find(result, handle);
+    this->index.erase(handle);
+    this->items[0] = item;
+    this->index.insert(item, 0);
+    this->index.find(item, handle);
+
+    this->sift_to_leaves(0, this->items.size(), key, item, handle);
+    return result;
+  }
+
+  /**
+   * Remove the item at the given position, the last item is moved to the hole.
+   */
+  void remove_at(size_t pos) {
+    IndexHandle handle;
+    size_t last = this->items.size() - 1;
+
+    this->index.find(this->items[pos], handle);
+    this->index.erase(handle);
+
+    if (pos != last) {
+      Item item = this->items[last];
+      Key key = this->keys[OFFSET + last];
+
+      // The last item stays at its position recorded in the index until it is placed.
+      this->index.find(item, handle);
+      this->keys[OFFSET + last] = INF;
+
+      if (pos > 0 && key < this->keys[OFFSET + (pos - 1) / Arity])
+        this->sift_to_root(pos, key, item, &handle);
+      else
+        this->sift_to_leaves(pos, last, key, item, handle);
+    } else {
+      this->keys[OFFSET + last] = INF;
+    }
+
+    this->items.pop_back();
+  }
+
+  /**
+   * Move parents down into the hole at pos while their keys are larger, place the item once at the end.
+   *
+   * @param handle Handle of the item in the index, NULL if the item is stored at pos - it is looked up
+   *               before it is moved.
+   * @result The final position of the item.
+   */
+  size_t sift_to_root(size_t pos, Key key, Item item, IndexHandle *handle) {
+    IndexHandle item_handle, parent_handle;
+    Item *items = this->items.data();
+    Key *keys = this->keys.data() + OFFSET;
+    size_t frompos = pos, parentpos;
+
+    while (pos > 0) {
+      parentpos = (pos - 1) / Arity;
+      if (!(key < keys[parentpos]))
+        break;
+
+      if (!handle) {
+        this->index.find(item, item_handle);
+        handle = &item_handle;
+      }
+
+      this->index.find(items[parentpos], parent_handle);
+      items[pos] = items[parentpos];
+      keys[pos] = keys[parentpos];
+      this->index.set(parent_handle, pos);
+      pos = parentpos;
+    }
+
+    items[pos] = item;
+    keys[pos] = key;
+    if (handle && (pos != frompos || handle != &item_handle))
+      this->index.set(*handle, pos);
+
+    return pos;
+  }
+
+  /**
+   * Move the smallest children up into the hole at pos while their keys are smaller, place the item
+   * once at the end.
+   *
+   * @param length Number of items stored, positions from length on hold keys at infinity.
+   * @param handle Handle of the item in the index.
+   * @result The final position of the item.
+   */
+  size_t sift_to_leaves(size_t pos, size_t length, Key key, Item item, IndexHandle handle) {
+#ifdef EHEAPQ_WIDE_AVX2
+    if (this->vectorized)
+      return this->sift_to_leaves_avx2(pos, length, key, item, handle);
+#endif
+    return this->sift_to_leaves_with<EHeapQWideScalar<Key, Arity>>(pos, length, key, item, handle);
+  }
+
+#ifdef EHEAPQ_WIDE_AVX2
+  // Arities not supported by EHeapQWideAvx2 never take this path, they are instantiated with the scalar loop.
+  typedef typename std::conditional<EHeapQWideAvx2<Key, Arity>::SUPPORTED, EHeapQWideAvx2<Key, Arity>,
+                                    EHeapQWideScalar<Key, Arity>>::type Avx2Select;
+
+  __attribute__((target("avx2"))) size_t sift_to_leaves_avx2(size_t pos, size_t length, Key key, Item item,
+                                                             IndexHandle handle) {
+    return this->sift_to_leaves_with<Avx2Select>(pos, length, key, item, handle);
+  }
+#endif
+
+  template <class Select>
+  __attribute__((always_inline)) inline size_t sift_to_leaves_with(size_t pos, size_t length, Key key, Item item,
+                                                                  IndexHandle handle) {
+    IndexHandle child_handle;
+    Item *items = this->items.data();
+    Key *keys = this->keys.data() + OFFSET;
+    size_t childpos;
+
+    while ((childpos = Arity * pos + 1) < length) {
+      // Children of the last node with children are followed by keys at infinity, never selected.
+      childpos += Select::select(keys + childpos);
+      if (!(keys[childpos] < key))
+        break;
+
+      this->index.find(items[childpos], child_handle);
+      items[pos] = items[childpos];
+      keys[pos] = keys[childpos];
+      this->index.set(child_handle, pos);
+      pos = childpos;
+    }
+
+    items[pos] = item;
+    keys[pos] = key;
+    this->index.set(handle, pos);
+    return pos;
+  }
+};
+
+template <class Key, class Item, size_t Arity, class Hash> constexpr Key EHeapQWide<Key, Item, Arity, Hash>::INF;
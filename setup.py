@@ -86,6 +86,8 @@ setup(
             "fext.eheapq",
             sources=["fext/eheapq.cpp"],
             extra_compile_args=["-std=c++11"],
+            # Counters of heap operations (ExtHeapQueue.stats()) are compiled in only on demand.
+            define_macros=[("EHEAPQ_STATS", None)] if os.getenv("FEXT_STATS") else [],
         ),
     ],
     cmdclass={"test": Test},
@@ -0,0 +1,337 @@
+#!/usr/bin/env python3
+# fext
+# Copyright(C) 2020 Fridolin Pokorny
+#
+# This program is free software: you can redistribute it and / or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+# type: ignore
+
+"""Benchmarks of ExtHeapQueue compared to heapq based alternatives, run using pyperf.
+
+Beams are bounded - pushing to a full beam evicts the item with the smallest
+key (or rejects the pushed item if its key is not larger), as resolver's beam
+in Thoth's adviser does. Each scenario is run for each beam implementation:
+
+  ExtHeapQueue      - fext.ExtHeapQueue
+  HeapqLazy         - heapq with lazy deletion (removed entries are marked and skipped)
+  HeapqRemove       - heapq with list.remove followed by heapify
+  SortedList        - sortedcontainers.SortedList, if installed
+
+Run (see also make bench-python and make bench-python-baseline):
+
+  python3 tests/bench_eheapq.py -o result.json
+  python3 -m pyperf compare_to tests/bench_eheapq_baseline.json result.json --table
+"""
+
+import heapq
+import itertools
+import random
+
+import pyperf
+
+from fext import ExtHeapQueue
+
+try:
+    from sortedcontainers import SortedList
+except ImportError:
+    SortedList = None
+
+
+class _Item:
+    """An item stored in beams, compared by identity."""
+
+
+class ExtHeapQueueBeam:
+    """A beam based on ExtHeapQueue."""
+
+    def __init__(self, size):
+        """Create a beam storing at most size items."""
+        self._heap = ExtHeapQueue(size)
+
+    def push(self, key, item):
+        """Push the given item, evict the item with the smallest key if full."""
+        self._heap.push(key, item)
+
+    def pop(self):
+        """Pop the item with the smallest key."""
+        return self._heap.pop()
+
+    def remove(self, item):
+        """Remove the given item."""
+        self._heap.remove(item)
+
+    def get_max(self):
+        """Get the item with the largest key."""
+        return self._heap.get_max()
+
+    def __len__(self):
+        """Get number of items stored."""
+        return len(self._heap)
+
+
+class HeapqLazyBeam:
+    """A beam based on heapq, removed entries are marked and skipped on pop."""
+
+    _REMOVED = object()
+
+    def __init__(self, size):
+        """Create a beam storing at most size items."""
+        self._size = size
+        self._heap = []
+        self._entries = {}
+        self._counter = itertools.count()
+
+    def push(self, key, item):
+        """Push the given item, evict the item with the smallest key if full."""
+        if len(self._entries) == self._size:
+            self._skip_removed()
+            if self._heap[0][0] >= key:
+                return
+
+            self.pop()
+
+        entry = [key, next(self._counter), item]
+        self._entries[item] = entry
+        heapq.heappush(self._heap, entry)
+
+    def pop(self):
+        """Pop the item with the smallest key."""
+        self._skip_removed()
+        item = heapq.heappop(self._heap)[2]
+        del self._entries[item]
+        return item
+
+    def remove(self, item):
+        """Remove the given item, compact the heap if more than a half of entries are removed."""
+        self._entries.pop(item)[2] = self._REMOVED
+
+        if len(self._heap) > 2 * len(self._entries):
+            self._heap = [entry for entry in self._heap if entry[2] is not self._REMOVED]
+            heapq.heapify(self._heap)
+
+    def get_max(self):
+        """Get the item with the largest key."""
+        return max(self._entries.values())[2]
+
+    def __len__(self):
+        """Get number of items stored."""
+        return len(self._entries)
+
+    def _skip_removed(self):
+        while self._heap[0][2] is self._REMOVED:
+            heapq.heappop(self._heap)
+
+
+class HeapqRemoveBeam:
+    """A beam based on heapq, removal is done using list.remove followed by heapify."""
+
+    def __init__(self, size):
+        """Create a beam storing at most size items."""
+        self._size = size
+        self._heap = []
+        self._entries = {}
+        self._counter = itertools.count()
+
+    def push(self, key, item):
+        """Push the given item, evict the item with the smallest key if full."""
+        entry = (key, next(self._counter), item)
+
+        if len(self._heap) == self._size:
+            if self._heap[0][0] >= key:
+                return
+
+            del self._entries[heapq.heapreplace(self._heap, entry)[2]]
+        else:
+            heapq.heappush(self._heap, entry)
+
+        self._entries[item] = entry
+
+    def pop(self):
+        """Pop the item with the smallest key."""
+        item = heapq.heappop(self._heap)[2]
+        del self._entries[item]
+        return item
+
+    def remove(self, item):
+        """Remove the given item."""
+        self._heap.remove(self._entries.pop(item))
+        heapq.heapify(self._heap)
+
+    def get_max(self):
+        """Get the item with the largest key."""
+        return max(self._heap)[2]
+
+    def __len__(self):
+        """Get number of items stored."""
+        return len(self._heap)
+
+
+class SortedListBeam:
+    """A beam based on sortedcontainers.SortedList."""
+
+    def __init__(self, size):
+        """Create a beam storing at most size items."""
+        self._size = size
+        self._list = SortedList()
+        self._entries = {}
+        self._counter = itertools.count()
+
+    def push(self, key, item):
+        """Push the given item, evict the item with the smallest key if full."""
+        if len(self._list) == self._size:
+            if self._list[0][0] >= key:
+                return
+
+            self.pop()
+
+        entry = (key, next(self._counter), item)
+        self._entries[item] = entry
+        self._list.add(entry)
+
+    def pop(self):
+        """Pop the item with the smallest key."""
+        item = self._list.pop(0)[2]
+        del self._entries[item]
+        return item
+
+    def remove(self, item):
+        """Remove the given item."""
+        self._list.remove(self._entries.pop(item))
+
+    def get_max(self):
+        """Get the item with the largest key."""
+        return self._list[-1][2]
+
+    def __len__(self):
+        """Get number of items stored."""
+        return len(self._list)
+
+
+BEAMS = [("ExtHeapQueue", ExtHeapQueueBeam), ("HeapqLazy", HeapqLazyBeam), ("HeapqRemove", HeapqRemoveBeam)]
+if SortedList is not None:
+    BEAMS.append(("SortedList", SortedListBeam))
+
+SIZES = [8, 100, 1000, 10000]
+
+# Number of steps done on a full beam, independent of its size - removals are O(N) for some of the beams.
+STEPS = 500
+
+
+def _make_data(count, seed=42):
+    """Make items and their keys, the same for all the beam implementations."""
+    rnd = random.Random(seed)
+    return [_Item() for _ in range(count)], [rnd.random() for _ in range(count)]
+
+
+def bench_push_bounded(loops, beam_class, size):
+    """Push 10 * size items to a beam of the given size, evicting items with the smallest key."""
+    items, keys = _make_data(10 * size)
+    pairs = list(zip(keys, items))
+    elapsed = 0.0
+
+    for _ in range(loops):
+        beam = beam_class(size)
+        start = pyperf.perf_counter()
+        for key, item in pairs:
+            beam.push(key, item)
+        elapsed += pyperf.perf_counter() - start
+
+    return elapsed
+
+
+def bench_random_removal(loops, beam_class, size):
+    """Remove a random item from a full beam and push a new one, STEPS times."""
+    items, keys = _make_data(size + STEPS)
+    rnd = random.Random(42)
+    removals = []
+    present = list(items[:size])
+    for i in range(STEPS):
+        idx = rnd.randrange(len(present))
+        removals.append((present[idx], keys[size + i], items[size + i]))
+        present[idx] = items[size + i]
+
+    elapsed = 0.0
+    for _ in range(loops):
+        beam = beam_class(size)
+        for key, item in zip(keys[:size], items[:size]):
+            beam.push(key, item)
+
+        start = pyperf.perf_counter()
+        for removed, key, item in removals:
+            beam.remove(removed)
+            beam.push(key, item)
+        elapsed += pyperf.perf_counter() - start
+
+    return elapsed
+
+
+def bench_adviser_step(loops, beam_class, size):
+    """Take the item with the largest key out of a full beam and push 3 expanded items, STEPS times."""
+    items, keys = _make_data(size + 3 * STEPS)
+    elapsed = 0.0
+
+    for _ in range(loops):
+        beam = beam_class(size)
+        for key, item in zip(keys[:size], items[:size]):
+            beam.push(key, item)
+
+        expanded = iter(zip(keys[size:], items[size:]))
+        start = pyperf.perf_counter()
+        for _ in range(STEPS):
+            beam.remove(beam.get_max())
+            for _ in range(3):
+                beam.push(*next(expanded))
+        elapsed += pyperf.perf_counter() - start
+
+    return elapsed
+
+
+def bench_push_pop(loops, beam_class, size):
+    """Fill an unbounded beam with size items and pop all of them."""
+    items, keys = _make_data(size)
+    pairs = list(zip(keys, items))
+    elapsed = 0.0
+
+    for _ in range(loops):
+        beam = beam_class(size)
+        start = pyperf.perf_counter()
+        for key, item in pairs:
+            beam.push(key, item)
+        while len(beam):
+            beam.pop()
+        elapsed += pyperf.perf_counter() - start
+
+    return elapsed
+
+
+SCENARIOS = [
+    ("push_bounded", bench_push_bounded),
+    ("random_removal", bench_random_removal),
+    ("adviser_step", bench_adviser_step),
+    ("push_pop", bench_push_pop),
+]
+
+
+def main():
+    """Run all the scenarios for all the beam implementations and sizes."""
+    runner = pyperf.Runner()
+    runner.metadata["description"] = "ExtHeapQueue compared to heapq based beams"
+
+    for scenario_name, scenario in SCENARIOS:
+        for size in SIZES:
+            for beam_name, beam_class in BEAMS:
+                runner.bench_time_func(f"{scenario_name}-{size}-{beam_name}", scenario, beam_class, size)
+
+
+if __name__ == "__main__":
+    main()
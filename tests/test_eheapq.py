@@ -17,7 +17,10 @@
 
 """Heap queue related tests for fext library."""
 
+import array
+import struct
 import sys
+import tracemalloc
 import pytest
 import heapq
 
@@ -461,3 +464,720 @@ class TestEHeapq(FextTestBase):
         heap.push(3.3, "33")
 
         assert set(heap.items()) == {"11", "22", "33"}
+
+    def test_sorted_items(self) -> None:
+        """Test sorted export of items does not modify the heap."""
+        heap = ExtHeapQueue()
+
+        assert heap.sorted_items() == []
+
+        heap.push(2.2, "22")
+        heap.push(1.1, "11")
+        heap.push(3.3, "33")
+        heap.push(0.5, "05")
+
+        assert heap.sorted_items() == [(0.5, "05"), (1.1, "11"), (2.2, "22"), (3.3, "33")]
+        assert heap.sorted_items(with_keys=False, reverse=True) == ["33", "22", "11", "05"]
+        assert heap.sorted_items(reverse=True, limit=2) == [(3.3, "33"), (2.2, "22")]
+        assert heap.sorted_items(with_keys=False, limit=0) == []
+        assert heap.sorted_items(with_keys=False, limit=10) == ["05", "11", "22", "33"]
+
+        assert len(heap) == 4
+        assert [heap.pop() for _ in range(len(heap))] == ["05", "11", "22", "33"]
+
+        with pytest.raises(ValueError, match="limit cannot be negative"):
+            heap.sorted_items(limit=-1)
+
+        with pytest.raises(TypeError):
+            heap.sorted_items(limit="1")
+
+    def test_sorted_items_composite_key(self) -> None:
+        """Test sorted export of items with composite keys."""
+        heap = ExtHeapQueue(key_width=2)
+
+        heap.push((1.0, 3.0), "a")
+        heap.push((0.0, 5.0), "b")
+        heap.push((1.0, 2.0), "c")
+
+        assert heap.sorted_items() == [((0.0, 5.0), "b"), ((1.0, 2.0), "c"), ((1.0, 3.0), "a")]
+        assert heap.sorted_items(with_keys=False, reverse=True, limit=1) == ["a"]
+
+    @given(lists(integers(min_value=-65535, max_value=65535)), integers(min_value=0, max_value=20))
+    def test_sorted_items_limit(self, arr, limit) -> None:
+        """Test sorted export of items with a limit matches a full sort."""
+        heap = ExtHeapQueue()
+
+        # Remove duplicates.
+        arr = list(dict.fromkeys(arr).keys())
+        for i in arr:
+            heap.push(float(i), i)
+
+        assert heap.sorted_items(with_keys=False, limit=limit) == sorted(arr)[:limit]
+        expected = [(float(i), i) for i in sorted(arr, reverse=True)[:limit]]
+        assert heap.sorted_items(reverse=True, limit=limit) == expected
+
+    def test_nan_key(self) -> None:
+        """Test NaN keys are rejected so that items stay ordered."""
+        heap = ExtHeapQueue()
+        composite = ExtHeapQueue(key_width=2)
+        nan = float("nan")
+
+        heap.push(1.0, "a")
+        with pytest.raises(ValueError, match="keys cannot be NaN"):
+            heap.push(nan, "b")
+
+        with pytest.raises(ValueError, match="keys cannot be NaN"):
+            heap.pushpop(nan, "c")
+
+        with pytest.raises(ValueError, match="keys cannot be NaN"):
+            composite.push((1.0, nan), "a")
+
+        with pytest.raises(ValueError, match="keys cannot be NaN"):
+            composite.push(array.array("d", [nan, 1.0]), "a")
+
+        assert "b" not in heap
+        assert heap.sorted_items() == [(1.0, "a")]
+        assert len(composite) == 0
+
+    def test_peek_n(self) -> None:
+        """Test taking the first k items without popping them."""
+        heap = ExtHeapQueue()
+
+        assert heap.peek_n(3) == []
+
+        for key, item in ((2.2, "22"), (1.1, "11"), (3.3, "33"), (0.5, "05"), (4.4, "44")):
+            heap.push(key, item)
+
+        assert heap.peek_n(3) == ["05", "11", "22"]
+        assert heap.peek_n(2, with_keys=True) == [(0.5, "05"), (1.1, "11")]
+        assert heap.peek_n(0) == []
+        assert heap.peek_n(10) == ["05", "11", "22", "33", "44"]
+        assert [heap.pop() for _ in range(len(heap))] == ["05", "11", "22", "33", "44"]
+
+        with pytest.raises(ValueError, match="k cannot be negative"):
+            heap.peek_n(-1)
+
+    @given(lists(integers(min_value=-65535, max_value=65535)), integers(min_value=0, max_value=20))
+    def test_peek_n_sorted(self, arr, k) -> None:
+        """Test the first k items match heapq.nsmallest."""
+        heap = ExtHeapQueue()
+
+        # Remove duplicates.
+        arr = list(dict.fromkeys(arr).keys())
+        for i in arr:
+            heap.push(float(i), i)
+
+        assert heap.peek_n(k) == heapq.nsmallest(k, arr)
+        assert list(heap.iter_sorted()) == sorted(arr)
+
+    def test_iter_sorted(self) -> None:
+        """Test lazy iteration over items in the sorted order."""
+        heap = ExtHeapQueue(key_width=2)
+
+        heap.push((1.0, 3.0), "a")
+        heap.push((0.0, 5.0), "b")
+        heap.push((1.0, 2.0), "c")
+
+        iterator = heap.iter_sorted(with_keys=True)
+        assert next(iterator) == ((0.0, 5.0), "b")
+        assert list(iterator) == [((1.0, 2.0), "c"), ((1.0, 3.0), "a")]
+        assert list(iterator) == []
+        assert len(heap) == 3
+
+    def test_iter_sorted_modified(self) -> None:
+        """Test iteration fails if the heap queue is modified."""
+        heap = ExtHeapQueue()
+
+        heap.push(1.0, "a")
+        heap.push(2.0, "b")
+
+        iterator = heap.iter_sorted()
+        assert next(iterator) == "a"
+
+        heap.pushpop(3.0, "c")
+        with pytest.raises(RuntimeError, match="heap queue changed during iteration"):
+            next(iterator)
+
+        iterator = heap.iter_sorted()
+        heap.clear()
+        with pytest.raises(RuntimeError):
+            next(iterator)
+
+    def test_contains(self) -> None:
+        """Test membership of items."""
+        heap = ExtHeapQueue()
+        a, b = "a_contains", "b_contains"
+
+        assert a not in heap
+
+        heap.push(1.0, a)
+        heap.push(2.0, b)
+        assert a in heap
+        assert b in heap
+
+        heap.remove(a)
+        assert a not in heap
+        assert heap.pop() == b
+        assert b not in heap
+
+    def test_get_key(self) -> None:
+        """Test reading keys of items stored."""
+        heap = ExtHeapQueue()
+        a, b = "a_get_key", "b_get_key"
+
+        heap.push(1.5, a)
+        assert heap.get_key(a) == 1.5
+        assert heap.get_key(b) is None
+        assert heap.get_key(b, -1.0) == -1.0
+
+        composite = ExtHeapQueue(key_width=2)
+        composite.push((1.0, 2.0), a)
+        assert composite.get_key(a) == (1.0, 2.0)
+
+    def test_pop_with_key(self) -> None:
+        """Test popping items together with their keys."""
+        heap = ExtHeapQueue()
+        a, b = "a_pop_with_key", "b_pop_with_key"
+        a_refcount = sys.getrefcount(a)
+
+        heap.push(2.0, b)
+        heap.push(1.0, a)
+
+        assert heap.pop_with_key() == (1.0, a)
+        assert a not in heap
+        assert heap.get_key(a) is None
+        assert a_refcount == sys.getrefcount(a)
+        assert heap.pop_with_key() == (2.0, b)
+
+        with pytest.raises(KeyError):
+            heap.pop_with_key()
+
+    def test_order_max(self) -> None:
+        """Test the heap queue ordered by the largest key."""
+        heap = ExtHeapQueue(order="max")
+
+        assert heap.order == "max"
+        assert ExtHeapQueue().order == "min"
+
+        for key, item in ((2.2, "22"), (1.1, "11"), (3.3, "33"), (0.5, "05")):
+            heap.push(key, item)
+
+        assert heap.get_top() == "33"
+        assert heap.get_max() == "05"
+        assert heap.get_key("22") == 2.2
+        assert heap.peek_n(2) == ["33", "22"]
+        assert list(heap.iter_sorted()) == ["33", "22", "11", "05"]
+        assert heap.pushpop(4.4, "44") == "44"
+        assert heap.pop_with_key() == (3.3, "33")
+        heap.remove("11")
+        assert [heap.pop() for _ in range(len(heap))] == ["22", "05"]
+
+    @given(lists(integers(min_value=-65535, max_value=65535)), integers(min_value=1, max_value=20))
+    def test_order_max_size(self, arr, size) -> None:
+        """Test a bounded heap queue ordered by the largest key keeps the smallest keys."""
+        heap = ExtHeapQueue(size, order="max")
+
+        # Remove duplicates.
+        arr = list(dict.fromkeys(arr).keys())
+        for i in arr:
+            heap.push(float(i), i)
+
+        assert [heap.pop() for _ in range(len(heap))] == sorted(arr)[:size][::-1]
+
+    def test_order_max_composite_key(self) -> None:
+        """Test composite keys ordered by the largest key."""
+        heap = ExtHeapQueue(key_width=2, order="max")
+
+        heap.push((1.0, 3.0), "a")
+        heap.push((0.0, 5.0), "b")
+        heap.push((1.0, 2.0), "c")
+
+        assert [heap.pop() for _ in range(len(heap))] == ["a", "c", "b"]
+
+    def test_order_merge(self) -> None:
+        """Test merging heap queues ordered by the largest key."""
+        heap = ExtHeapQueue(2, order="max")
+        other = ExtHeapQueue(order="max")
+        a, b, c = "a_merge_max", "b_merge_max", "c_merge_max"
+
+        heap.push(5.0, a)
+        heap.push(3.0, b)
+        other.push(1.0, a)
+        other.push(4.0, c)
+
+        heap.merge(other)
+        assert heap.sorted_items() == [(1.0, a), (3.0, b)]
+
+        with pytest.raises(ValueError, match="cannot merge heap queues with different order"):
+            heap.merge(ExtHeapQueue())
+
+    def test_order_invalid(self) -> None:
+        """Test invalid orders and changing order of a non-empty heap queue."""
+        with pytest.raises(ValueError, match="order has to be 'min' or 'max'"):
+            ExtHeapQueue(order="desc")
+
+        heap = ExtHeapQueue()
+        heap.__init__(order="max")
+        assert heap.order == "max"
+
+        heap.push(1.0, "a")
+        with pytest.raises(ValueError, match="order cannot be changed on a non-empty heap"):
+            heap.__init__(order="min")
+
+    def test_push_size_rejected_refcount(self) -> None:
+        """Test an item not kept in a full heap is not referenced by the heap."""
+        heap = ExtHeapQueue(size=1)
+
+        a1 = "111_rejected"
+        a2 = "222_rejected"
+
+        a1_refcount = sys.getrefcount(a1)
+        a2_refcount = sys.getrefcount(a2)
+
+        heap.push(2.0, a2)
+        heap.push(1.0, a1)
+
+        assert len(heap) == 1
+        assert heap.get_top() == a2
+        assert a1_refcount == sys.getrefcount(a1)
+
+        heap.clear()
+        assert a2_refcount == sys.getrefcount(a2)
+
+    def test_composite_key(self) -> None:
+        """Test composite keys are compared lexicographically."""
+        heap = ExtHeapQueue(key_width=2)
+
+        assert heap.key_width == 2
+
+        heap.push((1.0, 3.0), "a")
+        heap.push((0.0, 5.0), "b")
+        heap.push((1.0, 2.0), "c")
+        heap.push([1.0, 4.0], "d")
+
+        assert heap.get_max() == "d"
+        assert [heap.pop() for _ in range(len(heap))] == ["b", "c", "a", "d"]
+
+    def test_composite_key_buffer(self) -> None:
+        """Test composite keys passed in a buffer."""
+        heap = ExtHeapQueue(key_width=3)
+
+        heap.push(array.array("d", [1.0, 1.0, 2.0]), "a")
+        heap.push(array.array("f", [1.0, 1.0, 1.0]), "b")
+        heap.push(memoryview(array.array("d", [0.5, 9.0, 9.0])), "c")
+
+        assert heap.pushpop((1.0, 1.0, 1.5), "d") == "c"
+        assert [heap.pop() for _ in range(len(heap))] == ["b", "d", "a"]
+
+    def test_composite_key_remove(self) -> None:
+        """Test removal of items with composite keys reuses key storage correctly."""
+        heap = ExtHeapQueue(key_width=2)
+
+        for i in range(10):
+            heap.push((float(i % 2), float(i)), i)
+
+        heap.remove(4)
+        heap.remove(1)
+        heap.push((0.0, 100.0), 100)
+        heap.push((1.0, -1.0), -1)
+
+        assert [heap.pop() for _ in range(len(heap))] == [0, 2, 6, 8, 100, -1, 3, 5, 7, 9]
+
+    def test_composite_key_invalid(self) -> None:
+        """Test passing invalid composite keys."""
+        heap = ExtHeapQueue(key_width=2)
+
+        with pytest.raises(ValueError, match="key has to have 2 components"):
+            heap.push((1.0,), "a")
+
+        with pytest.raises(ValueError, match="key has to have 2 components"):
+            heap.push(array.array("d", [1.0, 2.0, 3.0]), "a")
+
+        with pytest.raises(TypeError, match="key buffer has to store floats or doubles"):
+            heap.push(b"ab", "a")
+
+        with pytest.raises(TypeError):
+            heap.push(1.0, "a")
+
+        with pytest.raises(TypeError):
+            heap.push(("x", 1.0), "a")
+
+        assert len(heap) == 0
+
+    def test_key_width_invalid(self) -> None:
+        """Test configuring an invalid key width."""
+        with pytest.raises(ValueError, match="key_width has to be in range"):
+            ExtHeapQueue(key_width=0)
+
+        with pytest.raises(ValueError, match="key_width has to be in range"):
+            ExtHeapQueue(key_width=1000)
+
+    def test_key_width_change(self) -> None:
+        """Test changing the key width of an emptied heap."""
+        heap = ExtHeapQueue(key_width=2)
+
+        for i in range(8):
+            heap.push((float(i), 0.0), i)
+
+        for _ in range(8):
+            heap.pop()
+
+        heap.__init__(key_width=5)
+        assert heap.key_width == 5
+
+        for i in range(8):
+            heap.push((1.0, 2.0, 3.0, 4.0, float(-i)), i)
+
+        expected = [((1.0, 2.0, 3.0, 4.0, float(-i)), i) for i in range(7, -1, -1)]
+        assert [heap.pop_with_key() for _ in range(8)] == expected
+
+    def test_memory_stats(self) -> None:
+        """Test reporting memory used by the heap."""
+        heap = ExtHeapQueue()
+
+        empty_stats = heap.memory_stats()
+        assert set(empty_stats.keys()) == {"heap", "index_buckets", "index_nodes", "keys", "slack", "total"}
+
+        for i in range(1000):
+            heap.push(float(i), i)
+
+        stats = heap.memory_stats()
+        assert stats["heap"] >= 1000 * 8
+        assert stats["index_nodes"] > 0
+        assert stats["keys"] > 0
+        assert stats["total"] == sum(v for k, v in stats.items() if k != "total")
+        assert sys.getsizeof(heap) > stats["total"] > empty_stats["total"]
+
+        heap.clear()
+        assert heap.memory_stats()["index_nodes"] == 0
+        assert heap.memory_stats()["total"] == stats["total"]
+
+        heap.shrink()
+        assert heap.memory_stats()["slack"] == 0
+
+    def test_memory_clear(self) -> None:
+        """Test clearing a heap with size set keeps its preallocated memory."""
+        heap = ExtHeapQueue(size=1000)
+        stats = heap.memory_stats()
+
+        for _ in range(2):
+            for i in range(1000):
+                heap.push(float(i), str(i))
+
+            assert heap.memory_stats()["total"] == stats["total"]
+            heap.clear()
+            assert heap.memory_stats()["slack"] == stats["slack"]
+
+        # Items are re-indexed when the merge removes some, memory is reused by the next merge.
+        totals = []
+        for _ in range(2):
+            heap.clear()
+            for i in range(1000):
+                heap.push(float(i), str(i))
+
+            other = ExtHeapQueue()
+            for i in range(1500):
+                other.push(float(i), -i)
+
+            heap.merge(other)
+            assert len(heap) == 1000
+            totals.append(heap.memory_stats()["total"])
+
+        assert totals[0] == totals[1]
+
+    def test_memory_tracemalloc(self) -> None:
+        """Test native memory is attributed by tracemalloc."""
+        items = [object() for _ in range(1000)]
+
+        tracemalloc.start()
+        try:
+            before = tracemalloc.get_traced_memory()[0]
+
+            heap = ExtHeapQueue()
+            for i, item in enumerate(items):
+                heap.push(float(i), item)
+
+            traced = tracemalloc.get_traced_memory()[0] - before
+        finally:
+            tracemalloc.stop()
+
+        assert traced >= heap.memory_stats()["total"]
+
+    def test_size_preallocated(self) -> None:
+        """Test a heap with size set does not allocate memory when staying within its bound."""
+        heap = ExtHeapQueue(size=100, key_width=2)
+
+        stats = heap.memory_stats()
+        assert stats["heap"] >= 100 * 8
+
+        for i in range(2000):
+            heap.push((float(i % 13), float(i)), str(i))
+
+        for _ in range(10):
+            heap.pop()
+
+        assert len(heap) == 90
+        assert heap.memory_stats()["heap"] == stats["heap"]
+        assert heap.memory_stats()["index_buckets"] == stats["index_buckets"]
+        assert heap.memory_stats()["total"] == stats["total"]
+
+    def test_reserve(self) -> None:
+        """Test preallocating memory for items."""
+        heap = ExtHeapQueue()
+
+        heap.reserve(1000)
+        stats = heap.memory_stats()
+
+        for i in range(1000):
+            heap.push(float(i), i)
+
+        assert heap.memory_stats()["heap"] == stats["heap"]
+        assert heap.memory_stats()["index_buckets"] == stats["index_buckets"]
+        assert heap.memory_stats()["total"] == stats["total"]
+
+    def test_shrink(self) -> None:
+        """Test releasing memory after a burst."""
+        heap = ExtHeapQueue(key_width=2)
+        items = [str(i) for i in range(10000)]
+
+        for i, item in enumerate(items):
+            heap.push((float(i % 3), float(i)), item)
+
+        for item in items[::2]:
+            heap.remove(item)
+
+        while len(heap) > 10:
+            heap.pop()
+
+        total = heap.memory_stats()["total"]
+        heap.shrink()
+
+        assert heap.memory_stats()["total"] < total / 10
+        expected = sorted(range(1, 10000, 2), key=lambda i: (i % 3, i))[-10:]
+        assert [heap.pop() for _ in range(len(heap))] == [items[i] for i in expected]
+
+    @pytest.mark.skipif(not hasattr(ExtHeapQueue, "stats"), reason="built without FEXT_STATS=1")
+    def test_stats(self) -> None:
+        """Test counters of operations done."""
+        heap = ExtHeapQueue(size=3)
+        items = [str(i) for i in range(4)]
+
+        for i, item in enumerate(items):
+            heap.push(float(i), item)
+
+        heap.pop()
+        heap.remove(items[3])
+        heap.get_max()
+
+        stats = heap.stats()
+        assert stats["pushes"] == 4
+        assert stats["pops"] == 2  # The eviction and the pop.
+        assert stats["removes"] == 1
+        assert stats["evictions"] == 1
+        assert stats["peak_rescans"] == 1
+        assert stats["siftups"] >= 2
+        assert stats["comparisons"] > 0
+        assert stats["index_updates"] > 0
+
+        heap.reset_stats()
+        assert set(heap.stats().values()) == {0}
+
+    def test_trace(self, tmp_path) -> None:
+        """Test recording operations to a trace file."""
+        heap = ExtHeapQueue(size=3)
+        items = [str(i) for i in range(5)]
+        path = tmp_path / "heap.trace"
+
+        heap.push(1.0, items[0])
+        heap.start_trace(path)
+        with pytest.raises(RuntimeError):
+            heap.start_trace(path)
+
+        heap.push(2.0, items[1])
+        heap.pushpop(3.0, items[2])
+        heap.get_max()
+        heap.remove(items[2])
+        heap.pop()
+        heap.clear()
+        heap.stop_trace()
+        heap.push(4.0, items[3])
+        heap.stop_trace()
+
+        data = path.read_bytes()
+        assert data[:8] == b"FEXTTRC\0"
+        assert struct.unpack_from("=IIQ", data, 8) == (1, 1, 3)
+
+        records = []
+        offset = 24
+        while offset < len(data):
+            op, item_id = struct.unpack_from("=BQ", data, offset)
+            offset += 9
+            key = None
+            if op in (1, 3, 5):
+                (key,) = struct.unpack_from("=d", data, offset)
+                offset += 8
+            records.append((op, item_id, key))
+
+        # The item stored when the trace was started is recorded as pushed.
+        assert records == [
+            (1, id(items[0]), 1.0),
+            (1, id(items[1]), 2.0),
+            (3, id(items[2]), 3.0),
+            (6, id(items[2]), None),
+            (4, id(items[2]), None),
+            (2, id(items[1]), None),
+            (7, 0, None),
+        ]
+
+    def test_trace_configure(self, tmp_path) -> None:
+        """Test the key width and size recorded in a trace cannot be changed while tracing."""
+        heap = ExtHeapQueue(size=3)
+        heap.start_trace(tmp_path / "heap.trace")
+
+        with pytest.raises(RuntimeError, match="cannot be changed while operations are traced"):
+            heap.__init__(key_width=2)
+
+        with pytest.raises(RuntimeError, match="cannot be changed while operations are traced"):
+            heap.__init__(size=5)
+
+        heap.__init__(size=3, order="max")
+        assert heap.key_width == 1
+        assert heap.size == 3
+
+        heap.stop_trace()
+        heap.__init__(key_width=2)
+        assert heap.key_width == 2
+
+    def test_latency_stats(self) -> None:
+        """Test histograms of operations sampled."""
+        heap = ExtHeapQueue(size=100)
+        items = [str(i) for i in range(200)]
+
+        assert heap.latency_stats() is None
+
+        heap.set_sample_rate(1)
+        for i, item in enumerate(items):
+            heap.push(float(i), item)
+
+        heap.pop()
+        heap.get_max()
+
+        stats = heap.latency_stats()
+        assert stats["sample_rate"] == 1
+        assert stats["push"]["count"] == 200
+        assert sum(stats["push"]["buckets"].values()) == 200
+        assert stats["push"]["min"] <= stats["push"]["p50"] <= stats["push"]["p99"] <= stats["push"]["max"]
+        assert stats["pop"]["count"] == 1
+        assert stats["get_max"]["count"] == 1
+        assert stats["remove"]["count"] == 0
+        # Increasing keys pushed to a heap that is not full stay in leaves.
+        assert stats["siftdown_depth"][0] >= 100
+        # Pops and evictions move the last item down from the root.
+        assert sum(stats["siftup_depth"]) == 101
+
+        heap.reset_latency_stats()
+        heap.set_sample_rate(10)
+        for _ in range(50):
+            heap.pop()
+        assert heap.latency_stats()["pop"]["count"] == 5
+
+        heap.set_sample_rate(0)
+        assert heap.latency_stats() is None
+
+        with pytest.raises(ValueError):
+            heap.set_sample_rate(-1)
+
+    def test_merge(self) -> None:
+        """Test merging heap queues, an item present in both keeps the larger key."""
+        heap1 = ExtHeapQueue()
+        heap2 = ExtHeapQueue()
+        items = [str(i) for i in range(6)]
+
+        heap1.push(1.0, items[0])
+        heap1.push(5.0, items[1])
+        heap1.push(3.0, items[2])
+        heap2.push(2.0, items[3])
+        heap2.push(0.5, items[4])
+        heap2.push(7.0, items[1])
+        heap2.push(0.0, items[2])
+
+        heap1.merge(heap2)
+
+        assert len(heap1) == 5
+        assert len(heap2) == 0
+        assert [heap1.pop() for _ in range(len(heap1))] == [items[4], items[0], items[3], items[2], items[1]]
+
+    def test_merge_size(self) -> None:
+        """Test items with the smallest keys are removed to respect the size after a merge."""
+        heap1 = ExtHeapQueue(size=4)
+        heap2 = ExtHeapQueue()
+        items = [str(i) for i in range(10)]
+        refcounts = [sys.getrefcount(item) for item in items]
+
+        for i in range(0, 10, 2):
+            heap2.push(float(i), items[i])
+        for i in range(1, 8, 2):
+            heap1.push(float(i), items[i])
+
+        heap1.merge(heap2)
+
+        assert len(heap1) == 4
+        assert heap1.get_max() == items[8]
+        assert [heap1.pop() for _ in range(len(heap1))] == [items[5], items[6], items[7], items[8]]
+        assert [sys.getrefcount(item) for item in items] == refcounts
+
+    def test_merge_size_nan(self) -> None:
+        """Test NaN keys cannot reach the selection done by a merge exceeding the size."""
+        heap1 = ExtHeapQueue(size=3)
+        heap2 = ExtHeapQueue()
+
+        for i in range(5):
+            heap1.push(float(i), i)
+            heap2.push(float(i + 10), i + 10)
+
+        with pytest.raises(ValueError, match="keys cannot be NaN"):
+            heap2.push(float("nan"), 100)
+
+        heap1.merge(heap2)
+        assert [heap1.pop() for _ in range(len(heap1))] == [12, 13, 14]
+
+    def test_merge_no_steal(self) -> None:
+        """Test merging heap queues without emptying the other one, also using |=."""
+        heap1 = ExtHeapQueue(key_width=2)
+        heap2 = ExtHeapQueue(key_width=2)
+        items = [str(i) for i in range(4)]
+        refcounts = [sys.getrefcount(item) for item in items]
+
+        heap1.push((1.0, 1.0), items[0])
+        heap1.push((2.0, 0.0), items[1])
+        heap2.push((2.0, 1.0), items[1])
+        heap2.push((0.0, 0.0), items[2])
+
+        heap1.merge(heap2, steal=False)
+        assert len(heap2) == 2
+
+        heap3 = ExtHeapQueue(key_width=2)
+        heap3.push((3.0, 0.0), items[3])
+        heap1 |= heap3
+        assert len(heap3) == 1
+
+        assert [heap1.pop() for _ in range(len(heap1))] == [items[2], items[0], items[1], items[3]]
+        assert [heap2.pop() for _ in range(len(heap2))] == [items[2], items[1]]
+        heap3.clear()
+        assert [sys.getrefcount(item) for item in items] == refcounts
+
+    def test_merge_invalid(self) -> None:
+        """Test merging heap queues that cannot be merged."""
+        heap = ExtHeapQueue()
+
+        with pytest.raises(ValueError):
+            heap.merge(heap)
+
+        with pytest.raises(ValueError):
+            heap.merge(ExtHeapQueue(key_width=2))
+
+        with pytest.raises(TypeError):
+            heap.merge([])
+
+        with pytest.raises(TypeError):
+            heap |= []
@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+# fext
+# Copyright(C) 2020 Fridolin Pokorny
+#
+# This program is free software: you can redistribute it and / or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+"""Streaming top-k related tests for fext library."""
+
+import array
+import sys
+import pytest
+import heapq
+
+from hypothesis import given
+from hypothesis.strategies import integers
+from hypothesis.strategies import lists
+
+from fext import ExtTopK
+from base import FextTestBase
+
+
+class TestETopK(FextTestBase):
+    """Test streaming top-k reducer."""
+
+    def test_push(self) -> None:
+        """Test pushing items to the top-k."""
+        topk = ExtTopK(2)
+
+        assert topk.k == 2
+        assert topk.threshold == float("-inf")
+
+        assert topk.push(1.0, "a") is True
+        assert topk.push(3.0, "b") is True
+        assert topk.threshold == 1.0
+
+        assert topk.push(0.5, "c") is False
+        assert topk.push(1.0, "d") is False
+        assert topk.push(2.0, "e") is True
+        assert topk.threshold == 2.0
+
+        assert len(topk) == 2
+        assert set(topk.items()) == {"b", "e"}
+        assert topk.get_top() == "e"
+
+    def test_push_refcount(self) -> None:
+        """Test rejected and evicted items are not referenced by the top-k."""
+        topk = ExtTopK(1)
+
+        a, b, c = "foo_topk", "bar_topk", "baz_topk"
+        a_refcount = sys.getrefcount(a)
+        b_refcount = sys.getrefcount(b)
+        c_refcount = sys.getrefcount(c)
+
+        topk.push(2.0, a)
+        topk.push(1.0, b)
+        assert b_refcount == sys.getrefcount(b)
+
+        topk.push(3.0, c)
+        assert a_refcount == sys.getrefcount(a)
+        assert c_refcount + 1 == sys.getrefcount(c)
+
+        assert topk.pop() == c
+        assert c_refcount == sys.getrefcount(c)
+
+    def test_push_already_present(self) -> None:
+        """Test pushing an item that is already present in the top-k."""
+        topk = ExtTopK(3)
+
+        topk.push(1.0, "a")
+        with pytest.raises(ValueError, match="the given item is already present in the heap"):
+            topk.push(2.0, "a")
+
+        assert len(topk) == 1
+
+    def test_zero(self) -> None:
+        """Test top-k keeping no items."""
+        topk = ExtTopK(0)
+
+        assert topk.push(1.0, "a") is False
+        assert topk.offer_many([1.0, 2.0], ["a", "b"]) == 0
+        assert len(topk) == 0
+
+    def test_pop_threshold(self) -> None:
+        """Test the threshold is not applied once the top-k is not full."""
+        topk = ExtTopK(2)
+
+        topk.push(5.0, "a")
+        topk.push(6.0, "b")
+        assert topk.pop() == "a"
+        assert topk.threshold == float("-inf")
+
+        assert topk.push(1.0, "c") is True
+        assert topk.threshold == 1.0
+
+        topk.clear()
+        assert len(topk) == 0
+        assert topk.push(0.0, "d") is True
+
+    def test_offer_many_buffer(self) -> None:
+        """Test offering items with keys in a buffer."""
+        topk = ExtTopK(3)
+
+        keys = array.array("d", [5.0, 1.0, 7.0, 3.0, 9.0, 2.0])
+        items = ["a", "b", "c", "d", "e", "f"]
+
+        assert topk.offer_many(keys, items) == 5
+        assert set(topk.items()) == {"a", "c", "e"}
+
+        assert topk.offer_many(array.array("f", [6.0, 4.0]), ["g", "h"]) == 1
+        assert [topk.pop() for _ in range(len(topk))] == ["g", "c", "e"]
+
+    def test_sorted_items(self) -> None:
+        """Test sorted export of items kept in the top-k."""
+        topk = ExtTopK(2)
+
+        topk.offer_many([3.0, 1.0, 2.0], ["c", "a", "b"])
+
+        assert topk.sorted_items(reverse=True) == [(3.0, "c"), (2.0, "b")]
+        assert len(topk) == 2
+
+    def test_get_key(self) -> None:
+        """Test membership and keys of items kept in the top-k."""
+        topk = ExtTopK(1)
+        a, b = "a_topk", "b_topk"
+
+        topk.push(1.0, a)
+        topk.push(2.0, b)
+
+        assert a not in topk
+        assert b in topk
+        assert topk.get_key(b) == 2.0
+        assert topk.get_key(a, 0.0) == 0.0
+        assert topk.pop_with_key() == (2.0, b)
+
+    def test_offer_many_invalid(self) -> None:
+        """Test offering items with invalid arguments."""
+        topk = ExtTopK(3)
+
+        with pytest.raises(ValueError, match="keys and items have to be of the same length"):
+            topk.offer_many([1.0, 2.0], ["a"])
+
+        with pytest.raises(ValueError, match="keys and items have to be of the same length"):
+            topk.offer_many(array.array("d", [1.0]), ["a", "b"])
+
+        with pytest.raises(TypeError, match="key buffer has to store floats or doubles"):
+            topk.offer_many(b"ab", ["a", "b"])
+
+        assert len(topk) == 0
+
+    def test_nan(self) -> None:
+        """Test NaN keys are rejected whether the top-k is full or not."""
+        topk = ExtTopK(2)
+        nan = float("nan")
+
+        with pytest.raises(ValueError, match="keys cannot be NaN"):
+            topk.push(nan, "a")
+
+        with pytest.raises(ValueError, match="keys cannot be NaN"):
+            topk.offer_many(array.array("d", [1.0, nan]), ["b", "c"])
+
+        with pytest.raises(ValueError, match="keys cannot be NaN"):
+            topk.offer_many(array.array("f", [nan]), ["d"])
+
+        assert "c" not in topk
+        assert topk.sorted_items() == [(1.0, "b")]
+
+        with pytest.raises(ValueError, match="keys cannot be NaN"):
+            topk.offer_many([2.0, nan], ["e", "f"])
+
+        assert topk.threshold == 1.0
+
+        with pytest.raises(ValueError, match="keys cannot be NaN"):
+            topk.push(nan, "g")
+
+        assert topk.sorted_items() == [(1.0, "b"), (2.0, "e")]
+
+    @given(lists(integers(min_value=-65535, max_value=65535)), integers(min_value=0, max_value=20))
+    def test_nlargest(self, arr, k) -> None:
+        """Test the top-k keeps the same items as heapq.nlargest."""
+        topk = ExtTopK(k)
+
+        # Remove duplicates.
+        arr = list(dict.fromkeys(arr).keys())
+        topk.offer_many([float(i) for i in arr], arr)
+
+        assert sorted(topk.items()) == sorted(heapq.nlargest(k, arr))
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+# fext
+# Copyright(C) 2020 Fridolin Pokorny
+#
+# This program is free software: you can redistribute it and / or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+"""Tests of nsmallest and nlargest of fext library."""
+
+import array
+import heapq
+import sys
+import pytest
+
+from hypothesis import given
+from hypothesis.strategies import integers
+from hypothesis.strategies import lists
+
+from fext import nlargest
+from fext import nsmallest
+from base import FextTestBase
+
+
+class TestNSelect(FextTestBase):
+    """Test selection of items with the smallest and the largest keys."""
+
+    def test_nsmallest(self) -> None:
+        """Test selecting items with the smallest keys."""
+        keys = [3.0, 1.0, 2.0, 5.0, 4.0]
+        items = ["c", "a", "b", "e", "d"]
+
+        assert nsmallest(2, keys, items) == ["a", "b"]
+        assert nsmallest(5, keys, items) == ["a", "b", "c", "d", "e"]
+        assert nsmallest(10, keys, items) == ["a", "b", "c", "d", "e"]
+        assert nsmallest(0, keys, items) == []
+        assert nsmallest(-1, keys, items) == []
+        assert nsmallest(1, [], []) == []
+
+    def test_nlargest(self) -> None:
+        """Test selecting items with the largest keys, keys passed in a buffer."""
+        keys = array.array("f", [3.0, 1.0, 2.0, 5.0, 4.0])
+        items = ("c", "a", "b", "e", "d")
+
+        assert nlargest(2, keys, items) == ["e", "d"]
+        assert nlargest(5, array.array("d", keys), items) == ["e", "d", "c", "b", "a"]
+
+    def test_stable(self) -> None:
+        """Test items with equal keys are kept in the order given, for both selection algorithms."""
+        keys = [float(i % 3) for i in range(3000)]
+        items = list(range(3000))
+
+        for n in (1, 10, 1000, 3000):
+            assert nsmallest(n, keys, items) == heapq.nsmallest(n, items, key=keys.__getitem__)
+            assert nlargest(n, keys, items) == heapq.nlargest(n, items, key=keys.__getitem__)
+
+    @given(lists(integers(min_value=-10, max_value=10)), integers(min_value=0, max_value=50))
+    def test_heapq(self, keys, n) -> None:
+        """Test results are the same as of heapq."""
+        items = [str(i) for i in range(len(keys))]
+        by_key = dict(zip(items, keys)).__getitem__
+
+        assert nsmallest(n, keys, items) == heapq.nsmallest(n, items, key=by_key)
+        assert nlargest(n, keys, items) == heapq.nlargest(n, items, key=by_key)
+
+    def test_refcount(self) -> None:
+        """Test items selected are referenced by the result only."""
+        items = ["foo_nselect", "bar_nselect"]
+        refcounts = [sys.getrefcount(item) for item in items]
+
+        result = nlargest(1, [1.0, 2.0], items)
+        assert result == ["bar_nselect"]
+        assert sys.getrefcount(items[1]) == refcounts[1] + 1
+
+        del result
+        assert [sys.getrefcount(item) for item in items] == refcounts
+
+    def test_invalid(self) -> None:
+        """Test passing invalid keys."""
+        with pytest.raises(ValueError):
+            nsmallest(1, [1.0], ["a", "b"])
+
+        with pytest.raises(ValueError):
+            nsmallest(1, array.array("d", [1.0, 2.0]), ["a"])
+
+        with pytest.raises(ValueError):
+            nlargest(1, [float("nan")], ["a"])
+
+        with pytest.raises(TypeError):
+            nlargest(1, array.array("i", [1]), ["a"])
+
+        with pytest.raises(TypeError):
+            nlargest(1, ["a"], ["a"])